@@ -0,0 +1,471 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>       // unique_ptr
+#include <chrono>
+#include <algorithm>    // sort
+#include <cstdint>
+#include <cstdlib>      // atoi
+#include <cstdio>       // snprintf
+#include <cerrno>
+#include <fcntl.h>      // open
+#include <unistd.h>     // close
+#include <sys/stat.h>   // mkdir
+#include "../point.hpp"
+#include "../polygon.hpp"
+#include "../shapefile.hpp"
+#include "../image.hpp"
+#include "../map_renderer.hpp"
+#include "synthetic_shapefile.hpp"
+
+// Benchmarks each stage of drawing a map, and drawing whole maps, using synthetic shapefiles so
+// it runs offline and gives the same input every time. Every benchmark that draws an image checks
+// a checksum of the bitmap against bench/golden.txt, so a change that speeds something up can't
+// quietly change the output. Results are written as JSON, and can be compared against an earlier run.
+
+const unsigned int kDefaultIterations = 5;
+const unsigned int kWorldWidth = 3600;
+const unsigned int kWorldHeight = 1800;
+
+void print_help() {
+    std::cerr << "Usage:" << std::endl;
+    std::cerr << "\t" << "bench [options]" << std::endl;
+    std::cerr << "\nOptions: " << std::endl;
+    std::cerr << "\t" << "--iterations N       Time each benchmark N times (default 5)" << std::endl;
+    std::cerr << "\t" << "--filter TEXT        Only run benchmarks whose name contains TEXT" << std::endl;
+    std::cerr << "\t" << "--data DIR           Write the synthetic shapefiles to DIR (default build/bench_data)" << std::endl;
+    std::cerr << "\t" << "--output FILE        Write the results to FILE as JSON (default stdout)" << std::endl;
+    std::cerr << "\t" << "--baseline FILE      Compare the results with an earlier JSON output" << std::endl;
+    std::cerr << "\t" << "--golden FILE        Golden image checksums (default bench/golden.txt)" << std::endl;
+    std::cerr << "\t" << "--update-golden      Write the checksums from this run to the golden file" << std::endl;
+}
+
+struct Result {
+    std::string name;
+    std::vector<double> times_ms;
+    std::string checksum;   // Of the bitmap drawn, or empty for benchmarks that don't draw anything
+    std::string golden;     // "match", "mismatch" or "new" when there is a checksum
+
+    double min_ms() const { return *std::min_element(times_ms.begin(), times_ms.end()); }
+    double median_ms() const {
+        std::vector<double> sorted = times_ms;
+        std::sort(sorted.begin(), sorted.end());
+        return (sorted.size() % 2 == 1) ? sorted[sorted.size() / 2] :
+                                          (sorted[(sorted.size() / 2) - 1] + sorted[sorted.size() / 2]) / 2.0;
+    }
+    double mean_ms() const {
+        double total = 0.0;
+        for (double time : times_ms) total += time;
+        return total / times_ms.size();
+    }
+};
+
+// Shapefile the benchmarks are run against
+struct Dataset {
+    std::string name;
+    SyntheticShapefileOptions options;
+    std::string path;
+};
+
+double now_ms() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 64 bit FNV-1a hash, as 16 hex digits
+std::string checksum(const std::string& data) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (unsigned char byte : data) {
+        hash = (hash ^ byte) * 0x100000001B3ULL;
+    }
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(hash));
+    return text;
+}
+
+// Checksum of an image's bitmap
+template <size_t BITS_PER_PIXEL>
+std::string checksum(Image<uint8_t, BITS_PER_PIXEL>& image) {
+    std::ostringstream bitmap;
+    image.write_bitmap_image(bitmap);
+    return checksum(bitmap.str());
+}
+
+// Checksum of a file's contents
+std::string file_checksum(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    std::ostringstream data;
+    data << file.rdbuf();
+    return checksum(data.str());
+}
+
+std::string json_escape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+// Reads "name checksum" lines
+std::map<std::string, std::string> read_golden(const std::string& filename) {
+    std::map<std::string, std::string> golden;
+    std::ifstream file(filename);
+    std::string name;
+    std::string sum;
+    while (file >> name >> sum) {
+        golden[name] = sum;
+    }
+    return golden;
+}
+
+void write_golden(const std::string& filename, const std::vector<Result>& results) {
+    std::map<std::string, std::string> golden = read_golden(filename);
+    for (const auto& result : results) {
+        if (!result.checksum.empty()) golden[result.name] = result.checksum;
+    }
+    std::ofstream file(filename);
+    if (!file.good()) throw std::runtime_error("Failed to open file: \"" + filename + "\"");
+    for (const auto& entry : golden) {
+        file << entry.first << " " << entry.second << "\n";
+    }
+}
+
+// Pull the median time of each benchmark out of an earlier JSON output. Relies on the
+// layout written by write_json, with each benchmark on its own line
+std::map<std::string, double> read_baseline(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file.good()) throw std::runtime_error("Failed to open file: \"" + filename + "\"");
+    std::map<std::string, double> baseline;
+    std::string line;
+    const std::string name_key = "\"name\": \"";
+    const std::string median_key = "\"median_ms\": ";
+    while (std::getline(file, line)) {
+        const size_t name_start = line.find(name_key);
+        const size_t median_start = line.find(median_key);
+        if (name_start == std::string::npos || median_start == std::string::npos) continue;
+        const size_t name_end = line.find('"', name_start + name_key.size());
+        const std::string name = line.substr(name_start + name_key.size(), name_end - name_start - name_key.size());
+        baseline[name] = std::stod(line.substr(median_start + median_key.size()));
+    }
+    return baseline;
+}
+
+void write_json(std::ostream& out, const std::vector<Result>& results, unsigned int iterations) {
+    const char* simd_levels[] = {"scalar", "sse4.1", "avx2"};
+    out << "{\n";
+    out << "  \"simd\": \"" << simd_levels[Simd::get_level()] << "\",\n";
+    out << "  \"iterations\": " << iterations << ",\n";
+    out << "  \"benchmarks\": [\n";
+    for (size_t index = 0; index < results.size(); index++) {
+        const Result& result = results[index];
+        out << "    {\"name\": \"" << json_escape(result.name) << "\", "
+            << "\"min_ms\": " << result.min_ms() << ", "
+            << "\"median_ms\": " << result.median_ms() << ", "
+            << "\"mean_ms\": " << result.mean_ms();
+        if (!result.checksum.empty()) {
+            out << ", \"checksum\": \"" << result.checksum << "\", \"golden\": \"" << result.golden << "\"";
+        }
+        out << "}" << ((index + 1 < results.size()) ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+class Bench {
+
+private:
+    unsigned int iterations;
+    std::string filter;
+    std::map<std::string, std::string> golden;
+    std::vector<Result> results;
+
+    bool _wanted(const std::string& name) const {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    }
+
+    // Time run() iterations times, calling setup() before and check() after each, untimed.
+    // check() returns the checksum of anything drawn, which must be the same every time
+    template <class Setup, class Run, class Check>
+    void _measure(const std::string& name, Setup setup, Run run, Check check) {
+        if (!_wanted(name)) return;
+        Result result;
+        result.name = name;
+        for (unsigned int iteration = 0; iteration < iterations; iteration++) {
+            setup();
+            const double start = now_ms();
+            run();
+            result.times_ms.push_back(now_ms() - start);
+            const std::string sum = check();
+            if (iteration > 0 && sum != result.checksum) {
+                throw std::runtime_error(name + " drew a different image on iteration " + std::to_string(iteration));
+            }
+            result.checksum = sum;
+        }
+        if (!result.checksum.empty()) {
+            auto expected = golden.find(name);
+            result.golden = (expected == golden.end()) ? "new" : (expected->second == result.checksum) ? "match" : "mismatch";
+        }
+        std::cerr << name << ": " << result.median_ms() << " ms";
+        if (!result.golden.empty()) std::cerr << " (" << result.golden << ")";
+        std::cerr << std::endl;
+        results.push_back(result);
+    }
+
+    static std::string _no_check() { return std::string(); }
+
+    static void _get_polygons(const std::string& path, std::vector<Polygon>& polygons) {
+        Shapefile shapefile(path);
+        shapefile.read();
+        polygons.clear();
+        shapefile.get_polygons(polygons);
+    }
+
+    static Viewport _world_viewport() {
+        return {-180.0, 180.0, -90.0, 90.0, kWorldWidth, kWorldHeight};
+    }
+
+    template <size_t BITS_PER_PIXEL = 8>
+    static std::unique_ptr<Image<uint8_t, BITS_PER_PIXEL>> _new_image(const Viewport& viewport,
+                                                                      ImageStorage storage = kPixelStorage) {
+        std::unique_ptr<Image<uint8_t, BITS_PER_PIXEL>> image(
+            new Image<uint8_t, BITS_PER_PIXEL>(viewport.width, viewport.height, viewport.height, storage));
+        set_palette(*image, kDefaultPalette);
+        image->set_background(kOceanColour);
+        return image;
+    }
+
+public:
+    Bench(unsigned int bench_iterations, const std::string& bench_filter, const std::map<std::string, std::string>& golden_checksums) :
+        iterations(bench_iterations), filter(bench_filter), golden(golden_checksums) {  }
+
+    // Each stage of drawing a map on its own
+    void run_stages(const Dataset& dataset) {
+        const std::string suffix = "/" + dataset.name;
+        const Viewport viewport = _world_viewport();
+        const Transform transform = viewport.get_transform();
+        std::vector<Polygon> source;
+        _get_polygons(dataset.path, source);
+
+        _measure("shapefile_read" + suffix, []() {  }, [&]() {
+            Shapefile shapefile(dataset.path);
+            shapefile.read();
+        }, _no_check);
+
+        Shapefile shapefile(dataset.path);
+        shapefile.read();
+        std::vector<Polygon> polygons;
+        _measure("get_polygons" + suffix, [&]() { polygons.clear(); }, [&]() {
+            shapefile.get_polygons(polygons);
+        }, _no_check);
+
+        _measure("shift_scale" + suffix, [&]() { polygons = source; }, [&]() {
+            for (auto& polygon : polygons) {
+                polygon.shift(transform.x_shift, transform.y_shift);
+                polygon.scale(transform.x_scale, transform.y_scale);
+            }
+        }, _no_check);
+
+        _measure("transform" + suffix, [&]() { polygons = source; }, [&]() {
+            for (auto& polygon : polygons) {
+                polygon.transform(transform);
+            }
+        }, _no_check);
+
+        std::unique_ptr<Image<uint8_t, 8>> image = _new_image(viewport);
+        _measure("polygon_fill" + suffix, [&]() { image->set_background(kOceanColour); }, [&]() {
+            for (const auto& polygon : source) {
+                image->draw_polygon(polygon, transform, true, kLandColour, false, kBorderColour);
+            }
+        }, [&]() { return checksum(*image); });
+
+        _measure("polygon_border" + suffix, [&]() { image->set_background(kOceanColour); }, [&]() {
+            for (const auto& polygon : source) {
+                image->draw_polygon(polygon, transform, false, kLandColour, true, kBorderColour);
+            }
+        }, [&]() { return checksum(*image); });
+    }
+
+    // Writing a world map to a file in each format. Compressed formats are checked against the file written
+    void run_write(const Dataset& dataset, const std::string& output_path) {
+        const Viewport viewport = _world_viewport();
+        std::vector<Polygon> polygons;
+        _get_polygons(dataset.path, polygons);
+        std::unique_ptr<Image<uint8_t, 8>> image = _new_image(viewport);
+        MapRenderer(polygons).render(*image, viewport, kLandColour, kBorderColour);
+
+        int fd = -1;
+        auto open_output = [&]() {
+            if (fd >= 0) close(fd);
+            fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) throw std::runtime_error("Failed to open file: \"" + output_path + "\"");
+        };
+        _measure("write_bitmap_image/" + dataset.name, open_output, [&]() {
+            image->write_bitmap_image(fd);
+        }, [&]() { return checksum(*image); });
+        _measure("write_rle_bitmap_image/" + dataset.name, open_output, [&]() {
+            image->write_rle_bitmap_image(fd);
+        }, [&]() { return file_checksum(output_path); });
+        _measure("write_png_image/" + dataset.name, open_output, [&]() {
+            image->write_png_image(fd);
+        }, [&]() { return file_checksum(output_path); });
+        if (fd >= 0) close(fd);
+    }
+
+    // Whole maps, from reading the shapefile to writing the bitmap, the same way map_gen draws them
+    void run_end_to_end(const Dataset& dataset) {
+        const std::vector<std::pair<std::string, Viewport>> views = {
+            {"render_world", _world_viewport()},
+            {"render_region", {-20.0, 40.0, 30.0, 70.0, 2000, 1334}},
+            {"render_large", {-180.0, 180.0, -90.0, 90.0, 12000, 6000}}
+        };
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd < 0) throw std::runtime_error("Failed to open /dev/null");
+        for (const auto& view : views) {
+            std::unique_ptr<Image<uint8_t, 8>> image;
+            _measure(view.first + "/" + dataset.name, [&]() { image.reset(); }, [&]() {
+                std::vector<Polygon> polygons;
+                _get_polygons(dataset.path, polygons);
+                image = _new_image(view.second);
+                MapRenderer(polygons).render(*image, view.second, kLandColour, kBorderColour);
+                image->write_bitmap_image(fd);
+            }, [&]() { return checksum(*image); });
+        }
+        // The large map again, with pixels packed 4 bits to a byte
+        const Viewport& large = views.back().second;
+        std::unique_ptr<Image<uint8_t, 4>> packed_image;
+        _measure("render_large_4bit/" + dataset.name, [&]() { packed_image.reset(); }, [&]() {
+            std::vector<Polygon> polygons;
+            _get_polygons(dataset.path, polygons);
+            packed_image = _new_image<4>(large);
+            MapRenderer(polygons).render(*packed_image, large, kLandColour, kBorderColour);
+            packed_image->write_bitmap_image(fd);
+        }, [&]() { return checksum(*packed_image); });
+        // And with each row held as runs, which should give exactly the same bitmap as render_large
+        std::unique_ptr<Image<uint8_t, 8>> run_image;
+        _measure("render_large_runs/" + dataset.name, [&]() { run_image.reset(); }, [&]() {
+            std::vector<Polygon> polygons;
+            _get_polygons(dataset.path, polygons);
+            run_image = _new_image(large, kRunStorage);
+            MapRenderer(polygons).render(*run_image, large, kLandColour, kBorderColour);
+            run_image->write_bitmap_image(fd);
+        }, [&]() { return checksum(*run_image); });
+        // And in blocks, which should also match render_large
+        std::unique_ptr<Image<uint8_t, 8>> block_image;
+        _measure("render_large_blocks/" + dataset.name, [&]() { block_image.reset(); }, [&]() {
+            std::vector<Polygon> polygons;
+            _get_polygons(dataset.path, polygons);
+            block_image = _new_image(large, kBlockStorage);
+            MapRenderer(polygons).render(*block_image, large, kLandColour, kBorderColour);
+            block_image->write_bitmap_image(fd);
+        }, [&]() { return checksum(*block_image); });
+        close(fd);
+    }
+
+    const std::vector<Result>& get_results() const { return results; }
+};
+
+int main(int argc, char *argv[]) {
+    unsigned int iterations = kDefaultIterations;
+    std::string filter;
+    std::string data_dir = "build/bench_data";
+    std::string output_path;
+    std::string baseline_path;
+    std::string golden_path = "bench/golden.txt";
+    bool update_golden = false;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg(argv[i]);
+        if (arg == "--iterations" && (i + 1) < argc) {
+            iterations = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--filter" && (i + 1) < argc) {
+            filter = argv[++i];
+        } else if (arg == "--data" && (i + 1) < argc) {
+            data_dir = argv[++i];
+        } else if (arg == "--output" && (i + 1) < argc) {
+            output_path = argv[++i];
+        } else if (arg == "--baseline" && (i + 1) < argc) {
+            baseline_path = argv[++i];
+        } else if (arg == "--golden" && (i + 1) < argc) {
+            golden_path = argv[++i];
+        } else if (arg == "--update-golden") {
+            update_golden = true;
+        } else {
+            print_help();
+            return 1;
+        }
+    }
+
+    // Many small, simple records (like a 50m map), and fewer large, detailed ones (like a 10m map)
+    std::vector<Dataset> datasets(2);
+    datasets[0].name = "small";
+    datasets[0].options.seed = 1;
+    datasets[0].options.records = 250;
+    datasets[1].name = "detailed";
+    datasets[1].options.seed = 2;
+    datasets[1].options.records = 120;
+    datasets[1].options.min_points = 2000;
+    datasets[1].options.max_points = 30000;
+    datasets[1].options.min_radius = 2.0;
+    datasets[1].options.max_radius = 30.0;
+    datasets[1].options.roughness = 0.01;
+
+    std::vector<Result> results;
+    bool all_match = true;
+    try {
+        if (mkdir(data_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Failed to create directory: \"" + data_dir + "\"");
+        }
+        for (auto& dataset : datasets) {
+            dataset.path = data_dir + "/" + dataset.name + ".shp";
+            SyntheticShapefile().write(dataset.path, dataset.options);
+        }
+
+        Bench bench(iterations, filter, read_golden(golden_path));
+        for (const auto& dataset : datasets) {
+            bench.run_stages(dataset);
+        }
+        bench.run_write(datasets[1], data_dir + "/write.out");
+        for (const auto& dataset : datasets) {
+            bench.run_end_to_end(dataset);
+        }
+        results = bench.get_results();
+
+        if (update_golden) {
+            write_golden(golden_path, results);
+        } else {
+            for (const auto& result : results) {
+                if (result.golden == "mismatch") {
+                    std::cerr << "Error: " << result.name << " no longer matches its golden image" << std::endl;
+                    all_match = false;
+                }
+            }
+        }
+
+        if (output_path.empty()) {
+            write_json(std::cout, results, iterations);
+        } else {
+            std::ofstream output(output_path);
+            if (!output.good()) throw std::runtime_error("Failed to open file: \"" + output_path + "\"");
+            write_json(output, results, iterations);
+        }
+
+        if (!baseline_path.empty()) {
+            const std::map<std::string, double> baseline = read_baseline(baseline_path);
+            std::cerr << "\nMedian times against " << baseline_path << ":" << std::endl;
+            for (const auto& result : results) {
+                auto before = baseline.find(result.name);
+                if (before == baseline.end()) continue;
+                std::cerr << "\t" << result.name << ": " << before->second << " ms -> " << result.median_ms()
+                          << " ms (" << (before->second / result.median_ms()) << "x)" << std::endl;
+            }
+        }
+    } catch (std::exception& error) {
+        std::cerr << "Error: " << error.what() << std::endl;
+        return 1;
+    }
+    return all_match ? 0 : 1;
+}
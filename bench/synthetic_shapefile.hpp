@@ -0,0 +1,187 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>      // memcpy
+#include <algorithm>    // min, max
+#include <cmath>        // sin, cos
+#include <fstream>
+#include <stdexcept>
+#include "../point.hpp"
+
+// Settings for a synthetic shapefile. Every record is made of one or more islands scattered over
+// the world, each with a coastline wobbling around a centre, and some with a lake in the middle
+struct SyntheticShapefileOptions {
+    uint64_t seed = 1;
+    unsigned int records = 200;
+    unsigned int min_islands = 1;       // Islands (outer rings) per record
+    unsigned int max_islands = 3;
+    unsigned int min_points = 50;       // Points per coastline
+    unsigned int max_points = 400;
+    double min_radius = 0.5;            // Size of each island, in degrees
+    double max_radius = 15.0;
+    double lake_probability = 0.3;      // Chance of an island having a lake (hole)
+    double roughness = 0.02;            // Point to point noise on the coastline, as a fraction of the radius
+};
+
+// Writes deterministic synthetic shapefiles (.shp and .shx), so benchmarks can run without
+// downloading any maps. The same options always give the same bytes, as the random numbers
+// come from a fixed generator (SplitMix64) rather than the platform's standard library
+class SyntheticShapefile {
+
+private:
+    const unsigned int kFileCode = 9994;
+    const unsigned int kFileVersion = 1000;
+    const unsigned int kPolygonShapeType = 5;
+    const unsigned int kMainHeaderSize = 100;
+
+    uint64_t state;
+
+    uint64_t _next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [min, max)
+    double _uniform(double min, double max) {
+        return min + ((max - min) * (static_cast<double>(_next() >> 11) * (1.0 / 9007199254740992.0)));
+    }
+
+    unsigned int _uniform_int(unsigned int min, unsigned int max) {
+        return min + static_cast<unsigned int>(_next() % (static_cast<uint64_t>(max - min) + 1));
+    }
+
+    // Closed ring of n points around a centre. The radius is a few random waves plus a little noise, and
+    // never drops below 0.6 of the radius (for a roughness up to 0.05), so the ring never crosses itself. Clockwise rings are
+    // outer rings and anticlockwise rings are holes, as in the shapefile spec
+    std::vector<Point> _ring(const Point& centre, double radius, unsigned int n, bool clockwise, double roughness) {
+        const double kPi = 3.14159265358979323846;
+        double amplitude[3] = {0.2, 0.1, 0.05};
+        double frequency[3] = {3.0, 7.0, 19.0};
+        double phase[3];
+        for (unsigned int wave = 0; wave < 3; wave++) {
+            phase[wave] = _uniform(0.0, 2.0 * kPi);
+        }
+        std::vector<Point> points;
+        points.reserve(n + 1);
+        for (unsigned int i = 0; i < n; i++) {
+            const double angle = (clockwise ? -2.0 : 2.0) * kPi * i / n;
+            double r = 1.0 + _uniform(-roughness, roughness);
+            for (unsigned int wave = 0; wave < 3; wave++) {
+                r += amplitude[wave] * std::sin((frequency[wave] * angle) + phase[wave]);
+            }
+            points.push_back({centre.x + (radius * r * std::cos(angle)), centre.y + (radius * r * std::sin(angle))});
+        }
+        points.push_back(points.front());
+        return points;
+    }
+
+    static void _put_big_endian(std::vector<uint8_t>& data, uint32_t val) {
+        const uint8_t bytes[4] = {static_cast<uint8_t>(val >> 24), static_cast<uint8_t>(val >> 16),
+                                  static_cast<uint8_t>(val >> 8), static_cast<uint8_t>(val)};
+        data.insert(data.end(), bytes, bytes + 4);
+    }
+
+    template <class V>
+    static void _put_little_endian(std::vector<uint8_t>& data, V val) {
+        uint8_t bytes[sizeof(V)];
+        std::memcpy(bytes, &val, sizeof(V));
+        data.insert(data.end(), bytes, bytes + sizeof(V));
+    }
+
+    // 100 byte header shared by the .shp and .shx files
+    std::vector<uint8_t> _header(size_t file_size) {
+        std::vector<uint8_t> header;
+        _put_big_endian(header, kFileCode);
+        for (unsigned int unused = 0; unused < 5; unused++) _put_big_endian(header, 0);
+        _put_big_endian(header, static_cast<uint32_t>(file_size / 2));
+        _put_little_endian<uint32_t>(header, kFileVersion);
+        _put_little_endian<uint32_t>(header, kPolygonShapeType);
+        const double box[8] = {-180.0, -90.0, 180.0, 90.0, 0.0, 0.0, 0.0, 0.0};
+        for (double val : box) _put_little_endian(header, val);
+        return header;
+    }
+
+    static void _write_file(const std::string& filename, const std::vector<uint8_t>& header, const std::vector<uint8_t>& body) {
+        std::ofstream file(filename, std::ios::binary);
+        if (!file.good()) throw std::runtime_error("Failed to open file: \"" + filename + "\"");
+        file.write(reinterpret_cast<const char*>(header.data()), header.size());
+        file.write(reinterpret_cast<const char*>(body.data()), body.size());
+        if (!file.good()) throw std::runtime_error("Failed to write: " + filename);
+    }
+
+public:
+    SyntheticShapefile() : state(0) {  }
+
+    // Write filename (which should end in .shp) along with its .shx index file
+    void write(const std::string& filename, const SyntheticShapefileOptions& options) {
+        if (filename.size() < 4 || filename.compare(filename.size() - 4, 4, ".shp") != 0) {
+            throw std::runtime_error("Synthetic shapefile name must end in .shp: " + filename);
+        }
+        if (options.min_islands < 1 || options.min_islands > options.max_islands ||
+            options.min_points < 4 || options.min_points > options.max_points || options.roughness > 0.05) {
+            throw std::runtime_error("Invalid synthetic shapefile options");
+        }
+        state = options.seed;
+
+        std::vector<uint8_t> records;
+        std::vector<uint8_t> index;
+        for (unsigned int record = 0; record < options.records; record++) {
+            // Islands, each followed by its lake when it has one
+            std::vector<std::vector<Point>> parts;
+            const unsigned int islands = _uniform_int(options.min_islands, options.max_islands);
+            for (unsigned int island = 0; island < islands; island++) {
+                const Point centre = {_uniform(-180.0, 180.0), _uniform(-90.0, 90.0)};
+                const double radius = _uniform(options.min_radius, options.max_radius);
+                const unsigned int points = _uniform_int(options.min_points, options.max_points);
+                parts.push_back(_ring(centre, radius, points, true, options.roughness));
+                if (_uniform(0.0, 1.0) < options.lake_probability) {
+                    parts.push_back(_ring(centre, radius * 0.2, std::max(4u, points / 10), false, options.roughness));
+                }
+            }
+
+            std::vector<uint8_t> content;
+            Point min = parts[0][0];
+            Point max = parts[0][0];
+            uint32_t number_points = 0;
+            for (const auto& part : parts) {
+                for (const auto& point : part) {
+                    min = {std::min(min.x, point.x), std::min(min.y, point.y)};
+                    max = {std::max(max.x, point.x), std::max(max.y, point.y)};
+                }
+                number_points += part.size();
+            }
+            _put_little_endian<uint32_t>(content, kPolygonShapeType);
+            _put_little_endian(content, min.x);
+            _put_little_endian(content, min.y);
+            _put_little_endian(content, max.x);
+            _put_little_endian(content, max.y);
+            _put_little_endian<uint32_t>(content, parts.size());
+            _put_little_endian<uint32_t>(content, number_points);
+            uint32_t first_point = 0;
+            for (const auto& part : parts) {
+                _put_little_endian<uint32_t>(content, first_point);
+                first_point += part.size();
+            }
+            for (const auto& part : parts) {
+                for (const auto& point : part) {
+                    _put_little_endian(content, point.x);
+                    _put_little_endian(content, point.y);
+                }
+            }
+
+            // Offsets and lengths are in 16 bit words
+            _put_big_endian(index, static_cast<uint32_t>((kMainHeaderSize + records.size()) / 2));
+            _put_big_endian(index, static_cast<uint32_t>(content.size() / 2));
+            _put_big_endian(records, record + 1);
+            _put_big_endian(records, static_cast<uint32_t>(content.size() / 2));
+            records.insert(records.end(), content.begin(), content.end());
+        }
+
+        _write_file(filename, _header(kMainHeaderSize + records.size()), records);
+        _write_file(filename.substr(0, filename.size() - 4) + ".shx", _header(kMainHeaderSize + index.size()), index);
+    }
+};
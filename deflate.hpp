@@ -0,0 +1,487 @@
+#pragma once
+
+#include <vector>
+#include <queue>        // priority_queue
+#include <cstdint>
+#include <cstring>      // memcpy
+#include <algorithm>    // min, max, fill
+#include <functional>   // greater
+
+// Compresses data into the deflate format (RFC 1951) used by zlib streams and PNG files.
+//
+// Repeats are found with hash chains over a 32 KB window (LZ77), checking one byte ahead for a
+// longer match before taking a short one. Each block is written with Huffman codes built for it, or the
+// fixed codes when those come out smaller. A stream can be compressed in pieces on separate threads:
+// each piece can match data up to 32 KB before it, and ends on a byte boundary with an empty stored
+// block (like zlib's Z_SYNC_FLUSH), so the pieces can simply be joined together in order, followed by finish()
+class Deflate {
+
+private:
+    static const size_t kWindowSize = 32768;
+    static const unsigned int kHashBits = 15;
+    static const unsigned int kMinMatch = 3;
+    static const unsigned int kMaxMatch = 258;
+    // Most earlier positions to try for each match
+    static const unsigned int kMaxChain = 32;
+    // Matches at least this long are taken straight away, without looking for a longer one a byte later
+    static const unsigned int kMaxLazy = 32;
+    static const unsigned int kEndOfBlock = 256;
+    static const unsigned int kLiteralCodes = 286;      // Literals, end of block, and match lengths
+    static const unsigned int kDistanceCodes = 30;
+    static const unsigned int kCodeLengthCodes = 19;
+    static const unsigned int kMaxBits = 15;
+    static const unsigned int kMaxCodeLengthBits = 7;
+    static const int kNoPosition = -1;
+
+    // A literal byte (distance 0), or a match of length bytes starting distance bytes back
+    struct Token {
+        uint16_t value;
+        uint16_t distance;
+    };
+
+    // Huffman code for each symbol, bit reversed as codes are written from the least significant bit
+    struct Code {
+        std::vector<uint16_t> codes;
+        std::vector<uint8_t> bits;
+    };
+
+    // Match length and distance symbols, and the fixed Huffman codes
+    struct Tables {
+        uint16_t length_base[29];
+        uint8_t length_extra[29];
+        uint16_t distance_base[30];
+        uint8_t distance_extra[30];
+        uint8_t length_symbol[kMaxMatch + 1];   // Index into length_base for each match length
+        uint8_t distance_symbol[512];           // For distances up to 256, then (distance - 1) >> 7
+        Code fixed_literals;
+        Code fixed_distances;
+
+        Tables() {
+            unsigned int length = 3;
+            for (unsigned int symbol = 0; symbol < 28; symbol++) {
+                length_extra[symbol] = (symbol < 8) ? 0 : ((symbol - 4) / 4);
+                length_base[symbol] = length;
+                for (unsigned int count = 0; count < (1u << length_extra[symbol]); count++) {
+                    length_symbol[length++] = symbol;
+                }
+            }
+            // 258 has its own symbol, rather than being the last length of symbol 27
+            length_extra[28] = 0;
+            length_base[28] = kMaxMatch;
+            length_symbol[kMaxMatch] = 28;
+
+            unsigned int distance = 1;
+            for (unsigned int symbol = 0; symbol < kDistanceCodes; symbol++) {
+                distance_extra[symbol] = (symbol < 4) ? 0 : ((symbol - 2) / 2);
+                distance_base[symbol] = distance;
+                for (unsigned int count = 0; count < (1u << distance_extra[symbol]); count++, distance++) {
+                    if (distance <= 256) {
+                        distance_symbol[distance - 1] = symbol;
+                    } else {
+                        distance_symbol[256 + ((distance - 1) >> 7)] = symbol;
+                    }
+                }
+            }
+
+            // The fixed literal codes cover 288 symbols, though the last two are never used
+            fixed_literals.bits.resize(288);
+            for (unsigned int symbol = 0; symbol < 288; symbol++) {
+                fixed_literals.bits[symbol] = (symbol < 144) ? 8 : (symbol < 256) ? 9 : (symbol < 280) ? 7 : 8;
+            }
+            fixed_distances.bits.assign(kDistanceCodes, 5);
+            _set_codes(fixed_literals);
+            _set_codes(fixed_distances);
+        }
+    };
+
+    // Writes bits from the least significant end of each byte, as deflate expects
+    class BitWriter {
+    private:
+        std::vector<uint8_t>& out;
+        uint64_t bits;
+        unsigned int count;
+
+    public:
+        explicit BitWriter(std::vector<uint8_t>& output) : out(output), bits(0), count(0) {  }
+
+        inline void put(uint32_t value, unsigned int number_bits) {
+            bits |= static_cast<uint64_t>(value) << count;
+            count += number_bits;
+            if (count >= 32) {
+                const uint8_t bytes[4] = {static_cast<uint8_t>(bits), static_cast<uint8_t>(bits >> 8),
+                                          static_cast<uint8_t>(bits >> 16), static_cast<uint8_t>(bits >> 24)};
+                out.insert(out.end(), bytes, bytes + 4);
+                bits >>= 32;
+                count -= 32;
+            }
+        }
+
+        inline void put(const Code& code, unsigned int symbol) {
+            put(code.codes[symbol], code.bits[symbol]);
+        }
+
+        // Write out any bits left over, padding the last byte with zeros
+        void align() {
+            while (count > 0) {
+                out.push_back(static_cast<uint8_t>(bits));
+                bits >>= 8;
+                count = (count > 8) ? (count - 8) : 0;
+            }
+            bits = 0;
+        }
+    };
+
+    std::vector<int32_t> head;
+    std::vector<int32_t> previous;
+    std::vector<Token> tokens;
+
+    static const Tables& _tables() {
+        static const Tables tables;
+        return tables;
+    }
+
+    // Canonical Huffman codes for the code lengths in code.bits
+    static void _set_codes(Code& code) {
+        unsigned int count[kMaxBits + 1] = {};
+        for (uint8_t bits : code.bits) count[bits]++;
+        count[0] = 0;
+        unsigned int next[kMaxBits + 1] = {};
+        for (unsigned int bits = 1; bits <= kMaxBits; bits++) {
+            next[bits] = (next[bits - 1] + count[bits - 1]) << 1;
+        }
+        code.codes.assign(code.bits.size(), 0);
+        for (size_t symbol = 0; symbol < code.bits.size(); symbol++) {
+            const unsigned int bits = code.bits[symbol];
+            if (bits == 0) continue;
+            const unsigned int value = next[bits]++;
+            uint16_t reversed = 0;
+            for (unsigned int bit = 0; bit < bits; bit++) {
+                reversed = (reversed << 1) | ((value >> bit) & 1);
+            }
+            code.codes[symbol] = reversed;
+        }
+    }
+
+    // Huffman code lengths for the symbol counts, none longer than max_bits. When the tree comes out
+    // too deep the counts are halved (keeping every used symbol), which flattens it, until it fits.
+    // At least two symbols are always given a code, as some decoders don't accept a single code
+    static void _set_lengths(std::vector<uint32_t> counts, unsigned int max_bits, Code& code) {
+        const size_t number_symbols = counts.size();
+        size_t used = std::count_if(counts.begin(), counts.end(), [](uint32_t count) { return count > 0; });
+        for (size_t symbol = 0; symbol < number_symbols && used < 2; symbol++) {
+            if (counts[symbol] > 0) continue;
+            counts[symbol] = 1;
+            used++;
+        }
+        code.bits.assign(number_symbols, 0);
+        std::vector<size_t> parent(2 * number_symbols);
+        std::vector<uint8_t> depth(2 * number_symbols);
+        while (true) {
+            typedef std::pair<uint64_t, size_t> Node;
+            std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+            for (size_t symbol = 0; symbol < number_symbols; symbol++) {
+                if (counts[symbol] > 0) queue.push({counts[symbol], symbol});
+            }
+            // Internal nodes are numbered from number_symbols, in the order they are made
+            size_t next_node = number_symbols;
+            while (queue.size() > 1) {
+                const Node first = queue.top();
+                queue.pop();
+                const Node second = queue.top();
+                queue.pop();
+                parent[first.second] = next_node;
+                parent[second.second] = next_node;
+                queue.push({first.first + second.first, next_node++});
+            }
+            // The root is the last node made, and every node's parent is made after it
+            unsigned int max_depth = 0;
+            depth[next_node - 1] = 0;
+            for (size_t node = next_node - 1; node-- > 0;) {
+                if (node < number_symbols && counts[node] == 0) continue;
+                depth[node] = depth[parent[node]] + 1;
+                if (node < number_symbols) max_depth = std::max<unsigned int>(max_depth, depth[node]);
+            }
+            if (max_depth <= max_bits) {
+                for (size_t symbol = 0; symbol < number_symbols; symbol++) {
+                    if (counts[symbol] > 0) code.bits[symbol] = depth[symbol];
+                }
+                break;
+            }
+            for (auto& count : counts) {
+                if (count > 0) count = std::max<uint32_t>(1, count / 2);
+            }
+        }
+        _set_codes(code);
+    }
+
+    static inline uint32_t _hash(const uint8_t* p) {
+        const uint32_t bytes = p[0] | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16);
+        return (bytes * 2654435761u) >> (32 - kHashBits);
+    }
+
+    // Number of bytes that match at a and b, up to limit
+    static inline unsigned int _match_length(const uint8_t* a, const uint8_t* b, unsigned int limit) {
+        unsigned int length = 0;
+        while (length + 8 <= limit) {
+            uint64_t x;
+            uint64_t y;
+            std::memcpy(&x, a + length, sizeof(x));
+            std::memcpy(&y, b + length, sizeof(y));
+            if (x != y) return length + (__builtin_ctzll(x ^ y) / 8);
+            length += 8;
+        }
+        while (length < limit && a[length] == b[length]) length++;
+        return length;
+    }
+
+    // Add position to the hash chains, if there are enough bytes left to hash
+    inline void _insert(const uint8_t* data, size_t position, size_t end) {
+        if (position + kMinMatch > end) return;
+        const uint32_t hash = _hash(data + position);
+        previous[position % kWindowSize] = head[hash];
+        head[hash] = static_cast<int32_t>(position);
+    }
+
+    // Longest match for the bytes at position among the positions already added to the hash chains
+    inline unsigned int _find_match(const uint8_t* data, size_t position, size_t end, size_t& best_distance) const {
+        const unsigned int limit = static_cast<unsigned int>(std::min<size_t>(kMaxMatch, end - position));
+        unsigned int best_length = 0;
+        if (limit < kMinMatch) return 0;
+        int32_t candidate = head[_hash(data + position)];
+        for (unsigned int chain = 0; chain < kMaxChain && candidate != kNoPosition; chain++) {
+            const size_t distance = position - candidate;
+            if (distance > kWindowSize) break;
+            if (data[candidate + best_length] == data[position + best_length]) {
+                const unsigned int length = _match_length(data + candidate, data + position, limit);
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = distance;
+                    if (length == limit) break;
+                }
+            }
+            // Chains only run back in time. Anything else is a slot reused by a newer position
+            const int32_t next = previous[candidate % kWindowSize];
+            if (next >= candidate) break;
+            candidate = next;
+        }
+        return (best_length >= kMinMatch) ? best_length : 0;
+    }
+
+    inline unsigned int _distance_symbol(const Tables& tables, unsigned int distance) const {
+        return (distance <= 256) ? tables.distance_symbol[distance - 1] : tables.distance_symbol[256 + ((distance - 1) >> 7)];
+    }
+
+    // Code lengths for the literal and distance codes, run length encoded as code length symbols
+    // (16 repeats the last length, 17 and 18 are runs of zeros), each with its extra bits
+    static void _encode_lengths(const std::vector<uint8_t>& lengths, std::vector<std::pair<uint8_t, uint8_t>>& symbols) {
+        size_t index = 0;
+        while (index < lengths.size()) {
+            const uint8_t length = lengths[index];
+            size_t run = 1;
+            while (index + run < lengths.size() && lengths[index + run] == length) run++;
+            index += run;
+            if (length == 0) {
+                while (run >= 11) {
+                    const size_t count = std::min<size_t>(run, 138);
+                    symbols.push_back({18, static_cast<uint8_t>(count - 11)});
+                    run -= count;
+                }
+                if (run >= 3) {
+                    symbols.push_back({17, static_cast<uint8_t>(run - 3)});
+                    run = 0;
+                }
+            } else {
+                symbols.push_back({length, 0});
+                run--;
+                while (run >= 3) {
+                    const size_t count = std::min<size_t>(run, 6);
+                    symbols.push_back({16, static_cast<uint8_t>(count - 3)});
+                    run -= count;
+                }
+            }
+            for (; run > 0; run--) symbols.push_back({length, 0});
+        }
+    }
+
+public:
+    Deflate() : head(1u << kHashBits, kNoPosition), previous(kWindowSize, kNoPosition) {  }
+
+    // Compress data[start] to data[end - 1] into a single block, which may refer back to the
+    // 32 KB before start. Appends the block to out, followed by an empty stored block so
+    // that it ends on a byte boundary. Nothing is written when start == end
+    void compress(const uint8_t* data, size_t start, size_t end, std::vector<uint8_t>& out) {
+        if (start >= end) return;
+        const Tables& tables = _tables();
+        std::fill(head.begin(), head.end(), kNoPosition);
+        tokens.clear();
+
+        // Prime the hash chains with the window before start
+        const size_t window_start = (start > kWindowSize) ? (start - kWindowSize) : 0;
+        for (size_t position = window_start; position < start; position++) {
+            _insert(data, position, start);
+        }
+
+        // Find the matches, counting how often each symbol is used
+        std::vector<uint32_t> literal_counts(kLiteralCodes, 0);
+        std::vector<uint32_t> distance_counts(kDistanceCodes, 0);
+        size_t position = start;
+        size_t distance = 0;
+        unsigned int length = 0;
+        bool have_match = false;
+        while (position < end) {
+            if (!have_match) length = _find_match(data, position, end, distance);
+            have_match = false;
+            _insert(data, position, end);
+            if (length > 0 && length < kMaxLazy && position + 1 < end) {
+                // Leave this byte as a literal if the match starting at the next one is longer
+                size_t next_distance = 0;
+                const unsigned int next_length = _find_match(data, position + 1, end, next_distance);
+                if (next_length > length) {
+                    tokens.push_back({data[position], 0});
+                    literal_counts[data[position]]++;
+                    position++;
+                    length = next_length;
+                    distance = next_distance;
+                    have_match = true;
+                    continue;
+                }
+            }
+            if (length > 0) {
+                tokens.push_back({static_cast<uint16_t>(length), static_cast<uint16_t>(distance)});
+                literal_counts[257 + tables.length_symbol[length]]++;
+                distance_counts[_distance_symbol(tables, distance)]++;
+                for (size_t next = position + 1; next < position + length; next++) {
+                    _insert(data, next, end);
+                }
+                position += length;
+            } else {
+                tokens.push_back({data[position], 0});
+                literal_counts[data[position]]++;
+                position++;
+            }
+        }
+        literal_counts[kEndOfBlock]++;
+
+        // Build codes for this block, and the code lengths needed to describe them
+        Code literals;
+        Code distances;
+        _set_lengths(literal_counts, kMaxBits, literals);
+        _set_lengths(distance_counts, kMaxBits, distances);
+        size_t number_literals = kLiteralCodes;
+        while (number_literals > 257 && literals.bits[number_literals - 1] == 0) number_literals--;
+        size_t number_distances = kDistanceCodes;
+        while (number_distances > 1 && distances.bits[number_distances - 1] == 0) number_distances--;
+        std::vector<uint8_t> lengths(literals.bits.begin(), literals.bits.begin() + number_literals);
+        lengths.insert(lengths.end(), distances.bits.begin(), distances.bits.begin() + number_distances);
+        std::vector<std::pair<uint8_t, uint8_t>> length_symbols;
+        _encode_lengths(lengths, length_symbols);
+        std::vector<uint32_t> length_counts(kCodeLengthCodes, 0);
+        for (const auto& symbol : length_symbols) length_counts[symbol.first]++;
+        Code code_lengths;
+        _set_lengths(length_counts, kMaxCodeLengthBits, code_lengths);
+        static const uint8_t length_order[kCodeLengthCodes] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        size_t number_code_lengths = kCodeLengthCodes;
+        while (number_code_lengths > 4 && code_lengths.bits[length_order[number_code_lengths - 1]] == 0) number_code_lengths--;
+
+        // Use the fixed codes if they come out smaller. Extra bits are the same either way, so are left out
+        const uint8_t extra_bits[kCodeLengthCodes] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7};
+        uint64_t dynamic_bits = 5 + 5 + 4 + (3 * number_code_lengths);
+        for (const auto& symbol : length_symbols) {
+            dynamic_bits += code_lengths.bits[symbol.first] + extra_bits[symbol.first];
+        }
+        uint64_t fixed_bits = 0;
+        for (unsigned int symbol = 0; symbol < kLiteralCodes; symbol++) {
+            dynamic_bits += static_cast<uint64_t>(literal_counts[symbol]) * literals.bits[symbol];
+            fixed_bits += static_cast<uint64_t>(literal_counts[symbol]) * tables.fixed_literals.bits[symbol];
+        }
+        for (unsigned int symbol = 0; symbol < kDistanceCodes; symbol++) {
+            dynamic_bits += static_cast<uint64_t>(distance_counts[symbol]) * distances.bits[symbol];
+            fixed_bits += static_cast<uint64_t>(distance_counts[symbol]) * tables.fixed_distances.bits[symbol];
+        }
+        const bool use_fixed = (fixed_bits <= dynamic_bits);
+        const Code& literal_code = use_fixed ? tables.fixed_literals : literals;
+        const Code& distance_code = use_fixed ? tables.fixed_distances : distances;
+
+        BitWriter writer(out);
+        writer.put(0, 1);   // Not the final block
+        if (use_fixed) {
+            writer.put(1, 2);
+        } else {
+            writer.put(2, 2);
+            writer.put(number_literals - 257, 5);
+            writer.put(number_distances - 1, 5);
+            writer.put(number_code_lengths - 4, 4);
+            for (size_t index = 0; index < number_code_lengths; index++) {
+                writer.put(code_lengths.bits[length_order[index]], 3);
+            }
+            for (const auto& symbol : length_symbols) {
+                writer.put(code_lengths, symbol.first);
+                writer.put(symbol.second, extra_bits[symbol.first]);
+            }
+        }
+        for (const Token& token : tokens) {
+            if (token.distance == 0) {
+                writer.put(literal_code, token.value);
+                continue;
+            }
+            const unsigned int length_symbol = tables.length_symbol[token.value];
+            writer.put(literal_code, 257 + length_symbol);
+            writer.put(token.value - tables.length_base[length_symbol], tables.length_extra[length_symbol]);
+            const unsigned int distance_symbol = _distance_symbol(tables, token.distance);
+            writer.put(distance_code, distance_symbol);
+            writer.put(token.distance - tables.distance_base[distance_symbol], tables.distance_extra[distance_symbol]);
+        }
+        writer.put(literal_code, kEndOfBlock);
+
+        // Empty stored block, then its length (0) and the length's complement
+        writer.put(0, 1);
+        writer.put(0, 2);
+        writer.align();
+        const uint8_t stored_lengths[4] = {0x00, 0x00, 0xFF, 0xFF};
+        out.insert(out.end(), stored_lengths, stored_lengths + 4);
+    }
+
+    // Append an empty final block, which ends the stream
+    static void finish(std::vector<uint8_t>& out) {
+        BitWriter writer(out);
+        writer.put(1, 1);   // Final block
+        writer.put(1, 2);   // Fixed Huffman codes
+        writer.put(_tables().fixed_literals, kEndOfBlock);
+        writer.align();
+    }
+
+    // Checksum used at the end of a zlib stream. Start from 1
+    static uint32_t adler32(uint32_t adler, const uint8_t* data, size_t length) {
+        // Largest number of bytes that can be summed before the sums could overflow
+        const size_t kMaxRun = 5552;
+        uint32_t a = adler & 0xFFFF;
+        uint32_t b = adler >> 16;
+        while (length > 0) {
+            const size_t run = std::min(length, kMaxRun);
+            for (size_t index = 0; index < run; index++) {
+                a += data[index];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+            data += run;
+            length -= run;
+        }
+        return (b << 16) | a;
+    }
+
+    // Checksum of two pieces of data joined together, from the checksum of each piece
+    static uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_length) {
+        const uint64_t kBase = 65521;
+        const uint64_t remainder = second_length % kBase;
+        const uint64_t a1 = first & 0xFFFF;
+        const uint64_t b1 = first >> 16;
+        const uint64_t a2 = second & 0xFFFF;
+        const uint64_t b2 = second >> 16;
+        // The first piece's a is added to b once for every byte of the second piece, and the
+        // second piece's sums started from 1 rather than from the first piece's a
+        const uint64_t a = (a1 + a2 + kBase - 1) % kBase;
+        const uint64_t b = (b1 + b2 + (remainder * a1) + kBase - remainder) % kBase;
+        return static_cast<uint32_t>((b << 16) | a);
+    }
+};
@@ -0,0 +1,388 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>    // fill
+#include <cstdio>       // rename, remove
+#include <cstring>      // memcmp, memcpy
+#include <stdexcept>
+#include <sys/mman.h>   // mmap
+#include <sys/stat.h>   // fstat
+#include <fcntl.h>      // open
+#include <unistd.h>     // close
+#include "point.hpp"
+#include "polygon.hpp"
+#include "shapefile.hpp"
+#include "simplify.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+// Binary cache of the polygons decoded from a shapefile, so later runs can skip
+// validating records, testing part orientation and assigning holes. Every point is
+// also ranked for simplification, so a polygon can be read at any level of detail by
+// only keeping the points that are significant at that level's tolerance.
+//
+// All values are stored in the processor's (little endian) byte order, and every
+// section is a multiple of 8 bytes so each one is aligned within the mapped file:
+//     Header
+//     uint64_t records[number_polygons]            Record each polygon came from
+//     Point boxes[number_polygons][2]              Bounding box of each polygon
+//     uint64_t polygon_rings[number_polygons + 1]  First ring of each polygon, which is its outer ring
+//     uint64_t ring_points[number_rings + 1]       First point of each ring
+//     Point points[number_points]                  Points of every ring, one after the other
+//     uint64_t valid_levels[number_polygons]       Levels of detail each polygon can be simplified to
+//     double significances[number_points]          Significance of each point, from Simplify::rank
+class GeometryCache {
+
+private:
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        // Size and checksum of the shapefile the cache was built from
+        uint64_t source_size;
+        uint64_t source_checksum;
+        uint64_t number_records;
+        uint64_t number_polygons;
+        uint64_t number_rings;
+        uint64_t number_points;
+    };
+
+    static constexpr const char* kMagic = "MAPCACHE";
+    static const uint32_t kVersion = 2;
+
+    std::string filename;
+    void* mapped_data;
+    size_t mapped_size;
+    bool good;
+
+    // Views of each section within the mapped file
+    const Header* header;
+    const uint64_t* records;
+    const Point* boxes;
+    const uint64_t* polygon_rings;
+    const uint64_t* ring_points;
+    const Point* points;
+    const uint64_t* valid_levels;
+    const double* significances;
+
+    // Level of detail polygons are read at
+    int level;
+
+    static bool _is_little_endian() {
+        int endian_test = 1;
+        return *((char *)&endian_test);
+    }
+
+    // 64 bit FNV-1a, taken a word at a time so checking a large shapefile is cheap
+    static uint64_t _checksum(const std::string& path, uint64_t& size) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.good()) {
+            throw std::runtime_error("Failed to open file: \"" + path + "\"");
+        }
+        const uint64_t kPrime = 0x100000001b3ULL;
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        size = 0;
+        std::vector<char> buffer(1 << 20);
+        while (file) {
+            file.read(buffer.data(), buffer.size());
+            const size_t length = file.gcount();
+            // Pad the final word with zeros
+            std::fill(buffer.begin() + length, buffer.begin() + ((length + 7) & ~static_cast<size_t>(7)), 0);
+            for (size_t index = 0; index < length; index += sizeof(uint64_t)) {
+                uint64_t word;
+                std::memcpy(&word, buffer.data() + index, sizeof(word));
+                hash = (hash ^ word) * kPrime;
+            }
+            size += length;
+        }
+        if (!file.eof()) throw std::runtime_error("Failed to read: " + path);
+        return hash;
+    }
+
+    template <class T>
+    static void _write_array(std::ofstream& file, const std::vector<T>& values) {
+        file.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+
+    void _release() {
+        if (mapped_data != nullptr) {
+            munmap(mapped_data, mapped_size);
+            mapped_data = nullptr;
+            mapped_size = 0;
+        }
+        header = nullptr;
+        good = false;
+    }
+
+    // Point the section views into the mapped file, checking they all fit
+    bool _is_valid() {
+        if (mapped_size < sizeof(Header)) return false;
+        header = static_cast<const Header*>(mapped_data);
+        if (std::memcmp(header->magic, kMagic, sizeof(header->magic)) != 0 ||
+            header->version != kVersion || header->header_size != sizeof(Header)) {
+            return false;
+        }
+        // Sizes are checked one section at a time so a corrupted count can't overflow
+        const uint64_t available = mapped_size - sizeof(Header);
+        const uint64_t number_polygons = header->number_polygons;
+        const uint64_t number_rings = header->number_rings;
+        const uint64_t number_points = header->number_points;
+        if (number_polygons > available / (sizeof(uint64_t) + (2 * sizeof(Point)) + (2 * sizeof(uint64_t))) ||
+            number_rings > available / sizeof(uint64_t) || number_points > available / (sizeof(Point) + sizeof(double))) {
+            return false;
+        }
+        const uint64_t expected_size = sizeof(Header) +
+                                       (number_polygons * sizeof(uint64_t)) +
+                                       (number_polygons * 2 * sizeof(Point)) +
+                                       ((number_polygons + 1) * sizeof(uint64_t)) +
+                                       ((number_rings + 1) * sizeof(uint64_t)) +
+                                       (number_points * sizeof(Point)) +
+                                       (number_polygons * sizeof(uint64_t)) +
+                                       (number_points * sizeof(double));
+        if (expected_size != mapped_size) return false;
+
+        const uint8_t* data = static_cast<const uint8_t*>(mapped_data) + sizeof(Header);
+        records = reinterpret_cast<const uint64_t*>(data);
+        data += number_polygons * sizeof(uint64_t);
+        boxes = reinterpret_cast<const Point*>(data);
+        data += number_polygons * 2 * sizeof(Point);
+        polygon_rings = reinterpret_cast<const uint64_t*>(data);
+        data += (number_polygons + 1) * sizeof(uint64_t);
+        ring_points = reinterpret_cast<const uint64_t*>(data);
+        data += (number_rings + 1) * sizeof(uint64_t);
+        points = reinterpret_cast<const Point*>(data);
+        data += number_points * sizeof(Point);
+        valid_levels = reinterpret_cast<const uint64_t*>(data);
+        data += number_polygons * sizeof(uint64_t);
+        significances = reinterpret_cast<const double*>(data);
+
+        // Check the offsets, so building a polygon never reads outside the file.
+        // Every polygon has an outer ring, and every ring is a closed ring of at least 4 points
+        if (polygon_rings[0] != 0 || polygon_rings[number_polygons] != number_rings) return false;
+        for (uint64_t polygon = 0; polygon < number_polygons; polygon++) {
+            if (polygon_rings[polygon + 1] <= polygon_rings[polygon]) return false;
+            if (records[polygon] >= header->number_records) return false;
+        }
+        if (ring_points[0] != 0 || ring_points[number_rings] != number_points) return false;
+        for (uint64_t ring = 0; ring < number_rings; ring++) {
+            if (ring_points[ring + 1] < (ring_points[ring] + 4)) return false;
+        }
+        return true;
+    }
+
+    void _get_ring(uint64_t ring, std::vector<Point>& ring_points_out) const {
+        const Point* first = points + ring_points[ring];
+        const Point* last = points + ring_points[ring + 1];
+        ring_points_out.assign(first, last);
+    }
+
+    // Keep the points of a ring that are significant at a level. Returns false if the ring collapses
+    bool _get_simplified_ring(uint64_t ring, int ring_level, std::vector<Point>& ring_points_out) const {
+        return Simplify::ring(points + ring_points[ring], significances + ring_points[ring],
+                              ring_points[ring + 1] - ring_points[ring],
+                              LevelsOfDetail::get_tolerance(ring_level), ring_points_out);
+    }
+
+public:
+    GeometryCache() : filename(""), mapped_data(nullptr), mapped_size(0), good(false), header(nullptr),
+                      level(LevelsOfDetail::kOriginalLevel) {  }
+    GeometryCache(const std::string& cache_filename) : filename(cache_filename), mapped_data(nullptr),
+                                                       mapped_size(0), good(false), header(nullptr),
+                                                       level(LevelsOfDetail::kOriginalLevel) {  }
+    ~GeometryCache() {
+        _release();
+    }
+    // Holds a memory mapping, so can't be copied
+    GeometryCache(const GeometryCache&) = delete;
+    GeometryCache& operator=(const GeometryCache&) = delete;
+
+    // Check if a file starts with the cache's magic number, so it can be used in place of a shapefile
+    static bool is_cache_file(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        char magic[8];
+        if (!file.read(magic, sizeof(magic))) return false;
+        return std::memcmp(magic, kMagic, sizeof(magic)) == 0;
+    }
+
+    // Decode a shapefile and write its polygons to cache_filename, ranking every point for
+    // simplification. The cache is written to a
+    // temporary file first and then renamed, so a running reader never sees half a cache
+    static void build(const std::string& shapefile_filename, const std::string& cache_filename,
+                      bool memory_map = true, bool use_index = true) {
+        if (!_is_little_endian()) {
+            throw std::runtime_error("Program will only run on little endian processor");
+        }
+        Header file_header = {};
+        std::memcpy(file_header.magic, kMagic, sizeof(file_header.magic));
+        file_header.version = kVersion;
+        file_header.header_size = sizeof(Header);
+        file_header.source_checksum = _checksum(shapefile_filename, file_header.source_size);
+
+        Shapefile shapefile(shapefile_filename);
+        shapefile.use_memory_map(memory_map);
+        shapefile.use_index_file(use_index);
+        shapefile.read();
+        file_header.number_records = shapefile.get_number_of_records();
+
+        std::vector<uint64_t> polygon_records;
+        std::vector<Point> polygon_boxes;
+        std::vector<uint64_t> polygon_rings = {0};
+        std::vector<uint64_t> ring_points = {0};
+        std::vector<Point> all_points;
+        std::vector<uint64_t> polygon_levels;
+        std::vector<double> all_significances;
+        std::vector<std::vector<double>> ring_significances;
+        auto add_ring = [&](const std::vector<Point>& ring, const std::vector<double>& significance) {
+            all_points.insert(all_points.end(), ring.begin(), ring.end());
+            all_significances.insert(all_significances.end(), significance.begin(), significance.end());
+            ring_points.push_back(all_points.size());
+        };
+        shapefile.for_each_polygon([&](const Polygon& polygon, size_t record_number) {
+            polygon_records.push_back(record_number);
+            polygon_boxes.push_back(polygon.bounding_box.first);
+            polygon_boxes.push_back(polygon.bounding_box.second);
+            polygon_levels.push_back(LevelsOfDetail::get_valid_levels(polygon, ring_significances));
+            add_ring(polygon.outer, ring_significances[0]);
+            for (size_t index = 0; index < polygon.inner.size(); index++) {
+                add_ring(polygon.inner[index], ring_significances[index + 1]);
+            }
+            polygon_rings.push_back(ring_points.size() - 1);
+        });
+        file_header.number_polygons = polygon_records.size();
+        file_header.number_rings = ring_points.size() - 1;
+        file_header.number_points = all_points.size();
+
+        const std::string temp_filename = cache_filename + ".tmp";
+        std::ofstream file(temp_filename, std::ios::binary | std::ios::trunc);
+        if (!file.good()) {
+            throw std::runtime_error("Failed to create file: \"" + temp_filename + "\"");
+        }
+        file.write(reinterpret_cast<const char*>(&file_header), sizeof(file_header));
+        _write_array(file, polygon_records);
+        _write_array(file, polygon_boxes);
+        _write_array(file, polygon_rings);
+        _write_array(file, ring_points);
+        _write_array(file, all_points);
+        _write_array(file, polygon_levels);
+        _write_array(file, all_significances);
+        file.close();
+        if (!file.good() || std::rename(temp_filename.c_str(), cache_filename.c_str()) != 0) {
+            std::remove(temp_filename.c_str());
+            throw std::runtime_error("Failed to write: " + cache_filename);
+        }
+    }
+
+    void read(const std::string& cache_filename) {
+        filename = cache_filename;
+        read();
+    }
+
+    // Map the cache. Only the offsets are checked, the points are used as they are
+    void read() {
+        Stats::Timer timer(Stats::kRead);
+        Trace::Scope scope("read_cache");
+        if (!_is_little_endian()) {
+            throw std::runtime_error("Program will only run on little endian processor");
+        }
+        _release();
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open file: \"" + filename + "\"");
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to read: " + filename);
+        }
+        if (file_stat.st_size > 0) {
+            void* data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Failed to read: " + filename);
+            }
+            mapped_data = data;
+            mapped_size = file_stat.st_size;
+        }
+        close(fd);
+        if (!_is_valid()) {
+            const bool old_version = header != nullptr && header->version != kVersion &&
+                                     std::memcmp(header->magic, kMagic, sizeof(header->magic)) == 0;
+            _release();
+            if (old_version) {
+                throw std::runtime_error("Geometry cache is from another version, rebuild it with --build-cache: " + filename);
+            }
+            throw std::runtime_error("File is not a geometry cache: " + filename);
+        }
+        good = true;
+    }
+
+    // Check the cache was built from the current contents of a shapefile
+    bool matches(const std::string& shapefile_filename) const {
+        if (!good) throw std::runtime_error("GeometryCache::read() must called successfully first");
+        uint64_t size;
+        const uint64_t checksum = _checksum(shapefile_filename, size);
+        return size == header->source_size && checksum == header->source_checksum;
+    }
+
+    // Read polygons simplified to the coarsest level no coarser than level_of_detail that is valid for each
+    // of them, from LevelsOfDetail::get_level_for_pixel_size. Only needs the points kept, so is no
+    // slower than reading them as they are
+    void use_level_of_detail(int level_of_detail) { level = level_of_detail; }
+
+    size_t get_number_of_polygons() const { return good ? header->number_polygons : 0; }
+    size_t get_number_of_records() const { return good ? header->number_records : 0; }
+
+    // Record of the shapefile that a polygon came from, numbered from 0 in file order
+    size_t get_record_number(size_t polygon_index) const { return records[polygon_index]; }
+
+    void get_polygon(size_t polygon_index, Polygon& polygon) const {
+        Stats::Timer timer(Stats::kDecode);
+        Trace::Scope scope("decode_polygon", "polygon", polygon_index);
+        const uint64_t first_ring = polygon_rings[polygon_index];
+        const uint64_t last_ring = polygon_rings[polygon_index + 1];
+        Stats::add(Stats::kRingsDecoded, last_ring - first_ring);
+        const int polygon_level = LevelsOfDetail::get_valid_level(valid_levels[polygon_index], level);
+        if (polygon_level == LevelsOfDetail::kOriginalLevel) {
+            _get_ring(first_ring, polygon.outer);
+            polygon.inner.resize(last_ring - first_ring - 1);
+            for (uint64_t ring = first_ring + 1; ring < last_ring; ring++) {
+                _get_ring(ring, polygon.inner[ring - first_ring - 1]);
+            }
+        } else {
+            // The level is valid, so the outer ring is kept, while holes smaller than the tolerance are dropped
+            _get_simplified_ring(first_ring, polygon_level, polygon.outer);
+            polygon.inner.resize(last_ring - first_ring - 1);
+            size_t kept = 0;
+            for (uint64_t ring = first_ring + 1; ring < last_ring; ring++) {
+                if (_get_simplified_ring(ring, polygon_level, polygon.inner[kept])) kept++;
+            }
+            polygon.inner.resize(kept);
+        }
+        polygon.bounding_box = {boxes[polygon_index * 2], boxes[(polygon_index * 2) + 1]};
+    }
+
+    // Get every polygon, in the same order as Shapefile::get_polygons
+    void get_polygons(std::vector<Polygon>& polygons) const {
+        polygons.clear();
+        if (!good) throw std::runtime_error("GeometryCache::read() must called successfully first");
+        polygons.resize(header->number_polygons);
+        for (size_t polygon_index = 0; polygon_index < polygons.size(); polygon_index++) {
+            get_polygon(polygon_index, polygons[polygon_index]);
+        }
+    }
+
+    // Call visit(polygon, record_number) for each polygon, matching Shapefile::for_each_polygon.
+    // The visitor is free to modify or move from the polygon
+    template <class Visitor>
+    void for_each_polygon(Visitor visit) const {
+        if (!good) throw std::runtime_error("GeometryCache::read() must called successfully first");
+        for (size_t polygon_index = 0; polygon_index < header->number_polygons; polygon_index++) {
+            Polygon polygon;
+            get_polygon(polygon_index, polygon);
+            visit(polygon, static_cast<size_t>(records[polygon_index]));
+        }
+    }
+};
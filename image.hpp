@@ -3,9 +3,33 @@
 #include <fstream>
 #include <vector>
 #include <array>
-#include <cstring>  // memcpy
+#include <cstring>  // memcpy, strerror
 #include <cmath>    // pow
+#include <cerrno>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>      // open
+#include <unistd.h>     // close
+#include <sys/uio.h>    // writev
 #include "polygon.hpp"
+#include "simd.hpp"
+#include "png.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+// File formats an image can be written in
+enum ImageFormat {
+    kBitmapFormat = 0,      // Uncompressed BMP
+    kRleBitmapFormat,       // Run length encoded (BI_RLE8) BMP
+    kPngFormat
+};
+
+// How an image holds its pixels
+enum ImageStorage {
+    kPixelStorage = 0,      // Every pixel, a row at a time
+    kRunStorage,            // Each row as a list of runs of a single colour
+    kBlockStorage           // Square blocks of pixels, a block at a time
+};
 
 template <class T, size_t BITS_PER_PIXEL>
 class Image {
@@ -14,25 +38,172 @@ private:
     uint32_t m_height;
     uint32_t m_max_x;
     uint32_t m_max_y;
+    // Rows of the image held in m_image_data. Normally the whole image, but can be a strip
+    // of rows that is moved down the image, so very large images can be drawn a strip at a time
+    uint32_t m_strip_rows;
+    uint32_t m_first_row;
+    uint32_t m_last_row;
+    // Entries of m_image_data for each row. One per pixel, or one per byte of packed pixels
+    uint32_t m_row_size;
+    ImageStorage m_storage;
+    // With kBlockStorage, the number of blocks across each row of blocks
+    uint32_t m_blocks_across;
     std::vector<T> m_image_data;
+    // A run of pixels of one colour, from start up to the start of the next run in the row (or the end of the row)
+    struct _Run {
+        uint32_t start;
+        T val;
+    };
+    // With kRunStorage, each row of the strip as a list of runs (and m_image_data is empty).
+    // Every row starts with a run at 0, and runs next to each other are always different colours
+    std::vector<std::vector<_Run>> m_runs;
     std::vector<uint32_t> m_colour_table;
+    bool m_reference_fill;
+
+    // Images of fewer than 8 bits per pixel hold their pixels packed into bytes, with the leftmost
+    // pixel of each byte in its top bits (the way BMP and PNG store them)
+    static const bool kPacked = (BITS_PER_PIXEL < 8);
+    static const unsigned int kPixelsPerByte = kPacked ? (8 / BITS_PER_PIXEL) : 1;
+    static const unsigned int kPixelMask = 0xFFu >> (8 - (kPacked ? BITS_PER_PIXEL : 8));
+    // Width (in entries of m_image_data) and height of a block with kBlockStorage. A block of bytes is
+    // a 4 KB page, so a line running down the image stays within the same page for 64 rows
+    static const unsigned int kBlockSize = 64;
+    static const size_t kBlockEntries = kBlockSize * kBlockSize;
+
+    // Polygon edge in the scanline fill edge table. Runs from a to b,
+    // where b = a + (dx, dy), so the crossing of row y is at a.x + (((y - a.y) / dy) * dx)
+    struct _Edge {
+        int y_first;    // First row the edge crosses
+        int y_last;     // Last row the edge crosses
+        double ax;
+        double ay;
+        double dx;
+        double dy;
+    };
+    // A polygon transformed once for drawing in bands of rows, with the edges and border lines
+    // that reach each band kept together, so each band only works through its own
+    struct _BandedPolygon {
+        bool drawn;         // Whether anything in the polygon can be seen
+        int x_start;        // Columns the fill can reach
+        int x_stop;
+        std::vector<Point> points;              // Every ring, transformed, one after another
+        std::vector<_Edge> edges;               // Fill edges of each band, from their first row in the band
+        std::vector<uint32_t> edge_starts;      // Where each band's edges start, plus the total at the end
+        std::vector<uint32_t> lines;            // Index in points of the start of each band's border lines
+        std::vector<uint32_t> line_starts;      // Where each band's lines start, plus the total at the end
+    };
+
+    // Edges crossing the current row, along with their rounded x crossings. Each field is held
+    // in its own array, so Simd::row_crossings can work out several crossings at once
+    struct _ActiveEdges {
+        std::vector<double> ax;
+        std::vector<double> ay;
+        std::vector<double> dx;
+        std::vector<double> dy;
+        std::vector<int> y_last;
+        std::vector<int> x;
+
+        size_t size() const { return x.size(); }
+
+        void push_back(const _Edge& edge) {
+            ax.push_back(edge.ax);
+            ay.push_back(edge.ay);
+            dx.push_back(edge.dx);
+            dy.push_back(edge.dy);
+            y_last.push_back(edge.y_last);
+            x.push_back(0);
+        }
+
+        // Copy edge from over the top of edge to
+        void copy(size_t from, size_t to) {
+            ax[to] = ax[from];
+            ay[to] = ay[from];
+            dx[to] = dx[from];
+            dy[to] = dy[from];
+            y_last[to] = y_last[from];
+            x[to] = x[from];
+        }
+
+        void resize(size_t size) {
+            ax.resize(size);
+            ay.resize(size);
+            dx.resize(size);
+            dy.resize(size);
+            y_last.resize(size);
+            x.resize(size);
+        }
+
+        // Drop edges that finished before row y, keeping the rest in order
+        void remove_finished(int y) {
+            size_t kept = 0;
+            for (size_t index = 0; index < size(); index++) {
+                if (y_last[index] < y) continue;
+                if (kept != index) copy(index, kept);
+                kept++;
+            }
+            resize(kept);
+        }
+
+        // Sort by x crossing. The order changes very little from one row
+        // to the next, so an insertion sort is close to linear here
+        void sort() {
+            for (size_t i = 1; i < size(); i++) {
+                if (x[i - 1] <= x[i]) continue;
+                const _Edge edge = {0, y_last[i], ax[i], ay[i], dx[i], dy[i]};
+                const int edge_x = x[i];
+                size_t j = i;
+                while (j > 0 && x[j - 1] > edge_x) {
+                    copy(j - 1, j);
+                    j--;
+                }
+                ax[j] = edge.ax;
+                ay[j] = edge.ay;
+                dx[j] = edge.dx;
+                dy[j] = edge.dy;
+                y_last[j] = edge.y_last;
+                x[j] = edge_x;
+            }
+        }
+    };
 
 public:
-    Image(unsigned int x_size, unsigned int y_size) : 
+    Image(unsigned int x_size, unsigned int y_size) : Image(x_size, y_size, y_size) {  }
+
+    // Image that only holds strip_rows rows at a time, starting with the rows from 0. Drawing
+    // only touches the rows in the strip, and set_strip moves the strip on to the next rows.
+    // With kRunStorage, each row is held as a list of runs of one colour, so the memory used and the
+    // time taken to fill spans depend on how much detail there is in the image rather than its size.
+    // With kBlockStorage, the pixels are held in blocks of kBlockSize rows, so lines running down the
+    // image touch far fewer cache lines and pages, at the cost of gathering the rows as they are written
+    Image(unsigned int x_size, unsigned int y_size, unsigned int strip_rows, ImageStorage storage = kPixelStorage) :
         m_width(x_size),
         m_height(y_size),
         m_max_x(x_size - 1),
         m_max_y(y_size - 1),
-        m_image_data(x_size * y_size) {
-        
-        if (BITS_PER_PIXEL != 8 && BITS_PER_PIXEL != 16 && BITS_PER_PIXEL != 24 && BITS_PER_PIXEL != 32) {
-            throw std::runtime_error("Bits per pixel must be 8, 16, 24, or 32");
+        m_strip_rows(std::max(1u, std::min(strip_rows, y_size))),
+        m_first_row(0),
+        m_last_row(m_strip_rows - 1),
+        m_row_size(kPacked ? (((x_size * BITS_PER_PIXEL) + 7) / 8) : x_size),
+        m_storage(storage),
+        m_blocks_across((m_row_size + kBlockSize - 1) / kBlockSize),
+        m_image_data(_get_data_size()),
+        m_runs((storage == kRunStorage) ? m_strip_rows : 0, std::vector<_Run>(1, _Run{0, 0})),
+        m_reference_fill(false) {
+
+
+        if (BITS_PER_PIXEL != 1 && BITS_PER_PIXEL != 2 && BITS_PER_PIXEL != 4 && BITS_PER_PIXEL != 8 &&
+            BITS_PER_PIXEL != 16 && BITS_PER_PIXEL != 24 && BITS_PER_PIXEL != 32) {
+            throw std::runtime_error("Bits per pixel must be 1, 2, 4, 8, 16, 24, or 32");
         } else if (BITS_PER_PIXEL > (sizeof(T)*8)) {
             throw std::runtime_error("Image pixel type is not big enough to hold " +\
                                      std::to_string(BITS_PER_PIXEL) + " bits per pixel");
+        } else if (kPacked && sizeof(T) != 1) {
+            throw std::runtime_error("Images of fewer than 8 bits per pixel must use a single byte pixel type");
+        } else if (x_size > kMaxSize || y_size > kMaxSize) {
+            throw std::runtime_error("Images can be at most " + std::to_string(kMaxSize) + " pixels wide or high");
         }
 
-        if (BITS_PER_PIXEL == 8) {
+        if (BITS_PER_PIXEL <= 8) {
             m_colour_table.resize(std::pow(2,BITS_PER_PIXEL));
         }
     }   
@@ -43,16 +214,48 @@ public:
     }
 
     T get_pixel(unsigned int x, unsigned int y) {
-        if (x >= m_width || y >= m_height) throw std::runtime_error("Pixel index out of range");
-        return m_image_data[(y * m_width) + x];
+        if (x >= m_width || y < m_first_row || y > m_last_row) throw std::runtime_error("Pixel index out of range");
+        return _read_pixel(x, y);
     }
     void set_pixel(unsigned int x, unsigned int y, T val) {
-        if (x >= m_width || y >= m_height) throw std::runtime_error("Pixel index out of range " + std::to_string(x) + "," + std::to_string(y));
-        m_image_data[(y * m_width) + x] = val;
+        if (x >= m_width || y < m_first_row || y > m_last_row) throw std::runtime_error("Pixel index out of range " + std::to_string(x) + "," + std::to_string(y));
+        _write_pixel(x, y, val);
+    }
+
+    // Move the strip so that it holds the rows from first_row on. The pixels are left as they
+    // were, so the strip normally needs to be cleared with set_background before drawing into it
+    void set_strip(unsigned int first_row) {
+        if (first_row > m_max_y) throw std::runtime_error("Strip starts past the end of the image");
+        m_first_row = first_row;
+        m_last_row = std::min(m_max_y, first_row + m_strip_rows - 1);
+    }
+
+    uint32_t get_strip_rows() {return m_strip_rows;}
+    uint32_t get_first_row() {return m_first_row;}
+    uint32_t get_last_row() {return m_last_row;}
+
+    // Fill polygons with the original per row crossing search rather than the edge table.
+    // Much slower, but useful for checking the two give identical output
+    void use_reference_fill(bool enable) {
+        m_reference_fill = enable;
     }
 
     void set_background(T val) {
-        std::fill(m_image_data.begin(), m_image_data.end(), val);
+        if (m_storage == kRunStorage) {
+            for (auto& row : m_runs) {
+                row.assign(1, _Run{0, _stored(val)});
+            }
+            return;
+        }
+        std::fill(m_image_data.begin(), m_image_data.end(), kPacked ? static_cast<T>(_repeat(val)) : val);
+        // Blocks clear these bits as the rows are gathered instead
+        if (kPacked && (m_width % kPixelsPerByte) != 0 && m_storage == kPixelStorage) {
+            // Keep the bits past the last pixel of each row 0, so they are the same in every file written
+            const uint8_t last_mask = static_cast<uint8_t>(0xFFu << _pixel_shift(m_max_x));
+            for (size_t index = m_row_size - 1; index < m_image_data.size(); index += m_row_size) {
+                m_image_data[index] &= last_mask;
+            }
+        }
     }
 
     void draw_square(const Point& bl, const Point& tr, T val) {
@@ -69,102 +272,409 @@ public:
     }
 
     void draw_line(const Point& p0, const Point& p1, T val) {
-        // Bresenham's Line Drawing Algorithm
+        draw_line(p0, p1, val, m_first_row, m_last_row);
+    }
 
-        // Round line start and end points to nearest whole pixel value
-        double x1 = std::round(p0.x);
-        double y1 = std::round(p0.y); 
-        double x2 = std::round(p1.x);
-        double y2 = std::round(p1.y);
+    // Draw a line, but only the pixels that land in rows first_row to last_row (inclusive)
+    void draw_line(const Point& p0, const Point& p1, T val, unsigned int first_row, unsigned int last_row) {
+        // Only the rows held in the strip can be drawn
+        first_row = std::max(first_row, m_first_row);
+        last_row = std::min(last_row, m_last_row);
+        if (first_row > last_row) return;
+        _draw_line(p0, p1, val, first_row, last_row);
+    }
 
-        // No need to draw the line if it is outside the viewport
-        if (std::max(x1, x2) < 0.0 || std::max(y1, y2) < 0.0 || std::min(x1, x2) > m_width || std::min(y1, y2) > m_height) {
-            return;
-        }
-        // For large angles, step through y axis rather than x axis
-        const bool large_angle = (std::fabs(y2 - y1) > std::fabs(x2 - x1));
-        if (large_angle) {
-            std::swap(x1, y1);
-            std::swap(x2, y2);
-        }
-        // Algorithm expects x2 >= x1, so swap them if that isn't true
-        if (x1 > x2) {
-            std::swap(x1, x2);
-            std::swap(y1, y2);
+    // Draw lines joining each point to the next
+    void draw_polyline(const std::vector<Point>& points, T val) {
+        draw_polyline(points, val, m_first_row, m_last_row);
+    }
+    void draw_polyline(const std::vector<Point>& points, T val, unsigned int first_row, unsigned int last_row) {
+        first_row = std::max(first_row, m_first_row);
+        last_row = std::min(last_row, m_last_row);
+        if (first_row > last_row) return;
+        for (size_t node = 0; node + 1 < points.size(); node++) {
+            _draw_line(points[node], points[node + 1], val, first_row, last_row);
         }
-        // Get the delta in the x and y coordinates
-        const double dx = x2 - x1;
-        const double dy = std::fabs(y2 - y1);
-        // Initialise the error to mid way between x1 and x2
-        double error = dx / 2.0;
-        const int y_step = (y1 < y2) ? 1 : -1;
-        int y = static_cast<int>(y1);
+    }
 
-        // Step along x axis and inc y axis based when the error term goes below 0
-        // Uses _set_pixel to ignore out of bounds points without flagging an error.
-        // In many (but not all) cases this will be faster than working out where the 
-        // line intersects the edge of the viewport and truncating it
-        if (large_angle) {
-            for (int x = static_cast<int>(x1); x <= static_cast<int>(x2); x++) {
-                _set_pixel(y, x, val);
-                error -= dy;
-                if (error < 0) {
-                    y += y_step;
-                    error += dx;
-                }
-            }
-        } else {
-            for (int x = static_cast<int>(x1); x <= static_cast<int>(x2); x++) {
-                _set_pixel(x, y, val);
-                error -= dy;
-                if (error < 0) {
-                    y += y_step;
-                    error += dx;
-                }
-            }
-        }
+    // Trim a polygon that has been shifted and scaled to pixels down to the parts that can be seen
+    // in the image (see Polygon::clip), so drawing it only works on the edges that are visible.
+    // Points more than a pixel outside the image round to pixels outside it, so draw the same
+    void clip_polygon(Polygon& polygon) const {
+        Stats::Timer timer(Stats::kClip);
+        size_t points = polygon.outer.size();
+        for (const auto& inner : polygon.inner) points += inner.size();
+        polygon.clip(Point({-1.0, -1.0}), Point({static_cast<double>(m_width), static_cast<double>(m_height)}));
+        points -= polygon.outer.size();
+        for (const auto& inner : polygon.inner) points -= inner.size();
+        Stats::add(Stats::kPointsClipped, points);
     }
 
     void draw_polygon(const Polygon& polygon, bool fill, T fill_colour, bool border, T border_colour) {
-        // No need to draw anything if the polygon bounding box 
-        // is outside the image area
-        if (polygon.max_x() < 0.0 || polygon.max_y() < 0.0 || polygon.min_x() > m_width || polygon.min_y() > m_height) {
-            return;
-        // Skip drawing anything less than 1 px wide
-        } else if (((polygon.max_x() - polygon.min_x()) < 1.0) || ((polygon.max_y() - polygon.min_y()) < 1.0)) {
-            return;
-        }
+        draw_polygon(polygon, Transform(), fill, fill_colour, border, border_colour, m_first_row, m_last_row);
+    }
+
+    // Draw a polygon, but only the pixels that land in rows first_row to last_row (inclusive).
+    // Lets separate threads draw separate bands of the image without touching the same pixels
+    void draw_polygon(const Polygon& polygon, bool fill, T fill_colour, bool border, T border_colour,
+                      unsigned int first_row, unsigned int last_row) {
+        draw_polygon(polygon, Transform(), fill, fill_colour, border, border_colour, first_row, last_row);
+    }
+
+    // Draw a polygon, applying the transform to each point as it is drawn. Gives the same result as
+    // shifting and scaling the polygon first, but leaves the polygon untouched so it can be shared
+    void draw_polygon(const Polygon& polygon, const Transform& transform,
+                      bool fill, T fill_colour, bool border, T border_colour) {
+        draw_polygon(polygon, transform, fill, fill_colour, border, border_colour, m_first_row, m_last_row);
+    }
 
+    void draw_polygon(const Polygon& polygon, const Transform& transform,
+                      bool fill, T fill_colour, bool border, T border_colour,
+                      unsigned int first_row, unsigned int last_row) {
+        // Only the rows held in the strip can be drawn
+        first_row = std::max(first_row, m_first_row);
+        last_row = std::min(last_row, m_last_row);
+        if (first_row > last_row) return;
+
+        const std::pair<Point, Point> box = transform.apply(polygon.bounding_box);
+        // Only count culled polygons once, rather than once for every band of rows
+        if (!_is_visible(box, first_row, last_row, first_row == m_first_row)) return;
+
+        Trace::Scope scope("draw_polygon", "points", polygon.outer.size());
         if (fill) {
-            _polygon_fill(polygon, fill_colour);
+            Stats::Timer timer(Stats::kFill);
+            if (m_reference_fill) {
+                _polygon_fill_reference(polygon, transform, box, fill_colour, first_row, last_row);
+            } else {
+                _polygon_fill(polygon, transform, box, fill_colour, first_row, last_row);
+            }
         }
         if (border) {
-            _polygon_border(polygon, border_colour);
+            Stats::Timer timer(Stats::kBorder);
+            _polygon_border(polygon, transform, border_colour, first_row, last_row);
         }
        
     }
 
+    // Draw a list of polygons in order, splitting the image into bands of rows that are drawn in parallel.
+    // Each band is only ever written by one thread and sees every polygon in list order,
+    // so the output is identical to drawing the polygons one at a time. Each polygon is only
+    // transformed and turned into edges once, with the bands sharing the results
+    void draw_polygons(const std::vector<Polygon>& polygons, bool fill, T fill_colour, bool border, T border_colour,
+                       unsigned int num_threads) {
+        draw_polygons(polygons, Transform(), fill, fill_colour, border, border_colour, num_threads);
+    }
+
+    void draw_polygons(const std::vector<Polygon>& polygons, const Transform& transform,
+                       bool fill, T fill_colour, bool border, T border_colour, unsigned int num_threads) {
+        _draw_polygons(polygons.size(), [&polygons](size_t index) -> const Polygon& { return polygons[index]; },
+                       transform, fill, fill_colour, border, border_colour, num_threads);
+    }
+
+    // Draw just the polygons listed in subset (as indices into polygons), in the order they are listed
+    void draw_polygons(const std::vector<Polygon>& polygons, const std::vector<size_t>& subset, const Transform& transform,
+                       bool fill, T fill_colour, bool border, T border_colour, unsigned int num_threads) {
+        _draw_polygons(subset.size(), [&polygons, &subset](size_t index) -> const Polygon& { return polygons[subset[index]]; },
+                       transform, fill, fill_colour, border, border_colour, num_threads);
+    }
+
+    // Size in bytes of the file write_bitmap_image writes
+    uint32_t get_bitmap_size() const {
+        std::array<uint8_t, 14> bmp_header;
+        std::array<uint8_t, 40> dib_header;
+        _get_bitmap_headers(bmp_header, dib_header);
+        return bmp_header[2] | (bmp_header[3] << 8) | (bmp_header[4] << 16) | (static_cast<uint32_t>(bmp_header[5]) << 24);
+    }
+
     uint32_t get_height() {return m_height;}
     uint32_t get_width() {return m_width;}
 
     void save_bitmap_image_to_file(const std::string& filename) {
-        std::ofstream bmp_file(filename, std::ios::binary);
-        if (!bmp_file.good()) {
+        save_image_to_file(filename, kBitmapFormat);
+    }
+
+    void save_image_to_file(const std::string& filename, ImageFormat format, unsigned int num_threads = 1) {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
             throw std::runtime_error("Failed to open file: \"" + filename + "\"");
         }
-        write_bitmap_image(bmp_file);
-        bmp_file.close();
+        try {
+            write_image(fd, format, num_threads);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        if (close(fd) != 0) {
+            throw std::runtime_error("Failed to write file: \"" + filename + "\"");
+        }
+    }
+
+    // Write the image to a file descriptor in any of the formats. Compression is split across num_threads
+    void write_image(int fd, ImageFormat format, unsigned int num_threads = 1) {
+        switch (format) {
+            case kBitmapFormat:
+                write_bitmap_image(fd);
+                break;
+            case kRleBitmapFormat:
+                write_rle_bitmap_image(fd, num_threads);
+                break;
+            case kPngFormat:
+                write_png_image(fd, num_threads);
+                break;
+        }
     }
 
+    // Write the bitmap to a stream, a row at a time straight from the image data
     void write_bitmap_image(std::ostream& bmp_file) {
+        _check_whole_image();
+        Stats::Timer timer(Stats::kEncode);
+        Trace::Scope scope("write_bitmap_image");
+        std::array<uint8_t, 14> bmp_header;
+        std::array<uint8_t, 40> dib_header;
+        const uint32_t size_of_row = _get_bitmap_headers(bmp_header, dib_header);
+        const uint32_t padding_bytes = _get_row_padding(size_of_row);
+        const std::array<uint8_t, 4> padding = {{0, 0, 0, 0}};
+        std::vector<uint8_t> row(size_of_row);
+        std::vector<uint8_t> buffer;
+
+        if (!bmp_file.good()) {
+            throw std::runtime_error("Error with output file stream");
+        }
+
+        bmp_file.write(reinterpret_cast<char*>(bmp_header.data()), bmp_header.size());
+        bmp_file.write(reinterpret_cast<char*>(dib_header.data()), dib_header.size());
+        bmp_file.write(reinterpret_cast<char*>(m_colour_table.data()), m_colour_table.size()*(sizeof(uint32_t)));
+        for (uint32_t y = 0; y < m_height; y++) {
+            if (_is_bitmap_layout()) {
+                bmp_file.write(reinterpret_cast<const char*>(_row_pointer(y)), size_of_row);
+            } else {
+                _get_bitmap_row(y, row.data(), buffer);
+                bmp_file.write(reinterpret_cast<const char*>(row.data()), size_of_row);
+            }
+            bmp_file.write(reinterpret_cast<const char*>(padding.data()), padding_bytes);
+        }
+        Stats::add(Stats::kBytesWritten, bmp_header.size() + dib_header.size() + (m_colour_table.size() * sizeof(uint32_t)) +
+                                         (static_cast<uint64_t>(size_of_row + padding_bytes) * m_height));
+    }
+
+    // Write the bitmap to a file descriptor (e.g. STDOUT_FILENO) without copying the image data.
+    // The headers and rows are handed to writev in batches, with each row followed by its padding
+    void write_bitmap_image(int fd) {
+        _check_whole_image();
+        Trace::Scope scope("write_bitmap_image");
+        write_bitmap_header(fd);
+        write_bitmap_rows(fd);
+    }
+
+    // Write the headers and colour table for the whole image. When drawing a strip at a time,
+    // follow this with write_bitmap_rows for each strip, working up from the strip at row 0
+    void write_bitmap_header(int fd) {
+        Stats::Timer timer(Stats::kEncode);
+        Trace::Scope scope("write_bitmap_header");
+        std::array<uint8_t, 14> bmp_header;
+        std::array<uint8_t, 40> dib_header;
+        _get_bitmap_headers(bmp_header, dib_header);
+        std::vector<iovec> parts;
+        parts.push_back({bmp_header.data(), bmp_header.size()});
+        parts.push_back({dib_header.data(), dib_header.size()});
+        parts.push_back({m_colour_table.data(), m_colour_table.size()*(sizeof(uint32_t))});
+        _write_all(fd, parts);
+    }
+
+    // Write the rows held in the strip. Bitmaps are stored bottom up, which is the same order as the rows
+    void write_bitmap_rows(int fd) {
+        Stats::Timer timer(Stats::kEncode);
+        Trace::Scope scope("write_bitmap_rows", "first_row", m_first_row);
+        std::array<uint8_t, 14> bmp_header;
+        std::array<uint8_t, 40> dib_header;
+        const uint32_t size_of_row = _get_bitmap_headers(bmp_header, dib_header);
+        const uint32_t padding_bytes = _get_row_padding(size_of_row);
+        static const std::array<uint8_t, 4> padding = {{0, 0, 0, 0}};
+        const uint32_t number_rows = m_last_row - m_first_row + 1;
+
+        std::vector<iovec> parts;
+        parts.reserve(kMaxWriteParts);
+        uint8_t* image_data = reinterpret_cast<uint8_t*>(m_image_data.data());
+        if (!_is_bitmap_layout()) {
+            // Convert a batch of rows at a time, padding included, so the strip is never copied all at once
+            const size_t size_of_padded_row = size_of_row + padding_bytes;
+            const uint32_t batch_rows = std::max<size_t>(1, kConvertBatchBytes / size_of_padded_row);
+            std::vector<uint8_t> rows;
+            std::vector<uint8_t> buffer;
+            for (uint32_t y = 0; y < number_rows; y += batch_rows) {
+                const uint32_t count = std::min(batch_rows, number_rows - y);
+                rows.assign(size_of_padded_row * count, 0);
+                for (uint32_t row = 0; row < count; row++) {
+                    _get_bitmap_row(m_first_row + y + row, rows.data() + (row * size_of_padded_row), buffer);
+                }
+                parts.assign(1, {rows.data(), rows.size()});
+                _write_all(fd, parts);
+            }
+            return;
+        } else if (padding_bytes == 0) {
+            // Rows follow on from each other, so the whole strip can be written in one go
+            parts.push_back({image_data, static_cast<size_t>(size_of_row) * number_rows});
+        } else {
+            for (uint32_t y = 0; y < number_rows; y++) {
+                if ((parts.size() + 2) > kMaxWriteParts) {
+                    _write_all(fd, parts);
+                    parts.clear();
+                }
+                parts.push_back({image_data + (static_cast<size_t>(y) * m_row_size * sizeof(T)), size_of_row});
+                parts.push_back({const_cast<uint8_t*>(padding.data()), padding_bytes});
+            }
+        }
+        _write_all(fd, parts);
+    }
+
+    // Write the image as a run length encoded (BI_RLE8) bitmap
+    void write_rle_bitmap_image(int fd, unsigned int num_threads = 1) {
+        _check_whole_image();
+        Trace::Scope scope("write_rle_bitmap_image");
+        std::vector<uint8_t> encoded;
+        encode_rle_rows(encoded, num_threads);
+        write_rle_bitmap(fd, encoded);
+    }
+
+    // Run length encode the rows held in the strip, appending them to encoded. When drawing a strip
+    // at a time, encode each strip working up from the strip at row 0, then write them with write_rle_bitmap.
+    // Every row is encoded on its own, so the rows are split across num_threads
+    void encode_rle_rows(std::vector<uint8_t>& encoded, unsigned int num_threads = 1) {
+        if (BITS_PER_PIXEL > 8) throw std::runtime_error("Run length encoded bitmaps must have at most 8 bits per pixel");
+        Stats::Timer timer(Stats::kEncode);
+        Trace::Scope scope("encode_rle_rows", "first_row", m_first_row);
+        const uint32_t number_rows = m_last_row - m_first_row + 1;
+        const unsigned int number_groups = std::max(1u, std::min(num_threads, number_rows));
+        std::vector<std::vector<uint8_t>> groups(number_groups);
+        auto encode_group = [&](unsigned int group) {
+            const uint32_t first_row = m_first_row + ((static_cast<uint64_t>(number_rows) * group) / number_groups);
+            const uint32_t last_row = m_first_row + ((static_cast<uint64_t>(number_rows) * (group + 1)) / number_groups);
+            // Rows in blocks are gathered, and packed rows unpacked to a byte per pixel first.
+            // Rows of runs are encoded straight from the runs
+            std::vector<uint8_t> gathered((m_storage == kBlockStorage) ? (static_cast<size_t>(m_row_size) * sizeof(T)) : 0);
+            std::vector<uint8_t> unpacked(kPacked ? m_width : 0);
+            for (uint32_t y = first_row; y < last_row; y++) {
+                if (m_storage == kRunStorage) {
+                    _encode_rle_runs(m_runs[y - m_first_row], groups[group]);
+                    continue;
+                }
+                const uint8_t* row = nullptr;
+                if (m_storage == kBlockStorage) {
+                    _copy_row(y, gathered.data());
+                    row = gathered.data();
+                } else {
+                    row = _row_pointer(y);
+                }
+                if (kPacked) {
+                    _unpack_row(row, unpacked.data());
+                    row = unpacked.data();
+                }
+                _encode_rle_row(row, m_width, groups[group]);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (unsigned int group = 1; group < number_groups; group++) {
+            threads.emplace_back(encode_group, group);
+        }
+        encode_group(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (const auto& group : groups) {
+            encoded.insert(encoded.end(), group.begin(), group.end());
+        }
+    }
+
+    // Write the headers and colour table, followed by every row of the image encoded by encode_rle_rows
+    void write_rle_bitmap(int fd, std::vector<uint8_t>& encoded) {
+        Stats::Timer timer(Stats::kEncode);
+        static const std::array<uint8_t, 2> end_of_bitmap = {{0x00, 0x01}};
+        std::array<uint8_t, 14> bmp_header;
+        std::array<uint8_t, 40> dib_header;
+        _get_bitmap_headers(bmp_header, dib_header, kBitmapRle8, encoded.size() + end_of_bitmap.size());
+        std::vector<iovec> parts;
+        parts.push_back({bmp_header.data(), bmp_header.size()});
+        parts.push_back({dib_header.data(), dib_header.size()});
+        parts.push_back({m_colour_table.data(), m_colour_table.size()*(sizeof(uint32_t))});
+        parts.push_back({encoded.data(), encoded.size()});
+        parts.push_back({const_cast<uint8_t*>(end_of_bitmap.data()), end_of_bitmap.size()});
+        _write_all(fd, parts);
+    }
+
+    // Write the image as a palette PNG, compressing it across num_threads
+    void write_png_image(int fd, unsigned int num_threads = 1) {
+        _check_whole_image();
+        Trace::Scope scope("write_png_image");
+        PngEncoder encoder = get_png_encoder(fd, num_threads);
+        encoder.begin();
+        write_png_rows(encoder);
+        encoder.end();
+    }
+
+    // PNG encoder for the whole image, writing to fd. When drawing a strip at a time, call begin(),
+    // then write_png_rows for each strip working down from the strip at the top of the image, then end()
+    PngEncoder get_png_encoder(int fd, unsigned int num_threads = 1) {
+        if (m_colour_table.empty()) throw std::runtime_error("PNG images must have a colour table");
+        return PngEncoder(m_width, m_height, BITS_PER_PIXEL, m_colour_table, num_threads,
+                          [fd](const uint8_t* data, size_t size) {
+                              std::vector<iovec> parts = {{const_cast<uint8_t*>(data), size}};
+                              _write_all(fd, parts);
+                          });
+    }
+
+    // Add the rows held in the strip to a PNG. PNGs are stored top down, so the rows go in reverse
+    void write_png_rows(PngEncoder& encoder) {
+        Stats::Timer timer(Stats::kEncode);
+        Trace::Scope scope("write_png_rows", "first_row", m_first_row);
+        const uint32_t last_row = m_last_row;
+        if (m_storage != kPixelStorage) {
+            encoder.add_expanded_rows(m_last_row - m_first_row + 1, [this, last_row](size_t index, uint8_t* out) {
+                _copy_row(last_row - index, out);
+            });
+            return;
+        }
+        encoder.add_rows(m_last_row - m_first_row + 1, [this, last_row](size_t index) {
+            return _row_pointer(last_row - index);
+        });
+    }
+
+private:
+    // Most iovecs handed to a single writev call (the usual IOV_MAX)
+    static const size_t kMaxWriteParts = 1024;
+    // Most bytes of rows converted to the bitmap layout (widened, expanded from runs or gathered from blocks) to write at once
+    static const size_t kConvertBatchBytes = 1 << 20;
+    // Points of polygons to transform and band at once when drawing in parallel
+    static const size_t kBandBatchPoints = 1 << 18;
+    // Lines with an end further than this from the origin (in pixels) are not drawn
+    static constexpr double kMaxLineCoordinate = 1e15;
+    // Widest or highest image. Lines are clipped to kLineMargin pixels around the image before they are
+    // rounded, so products of two distances along them always fit in 64 bits when stepping through them
+    static const uint32_t kMaxSize = 1 << 30;
+    static const uint32_t kLineMargin = 1 << 28;
+    // Bitmap compression types
+    static const uint32_t kBitmapRgb = 0;
+    static const uint32_t kBitmapRle8 = 1;
+    // Longest run or literal that fits in a BI_RLE8 count
+    static const unsigned int kMaxRleRun = 255;
+
+    void _check_whole_image() const {
+        if (m_first_row != 0 || m_last_row != m_max_y) {
+            throw std::runtime_error("Image only holds a strip of rows, so must be written a strip at a time");
+        }
+    }
+
+    // Fill in the BMP and DIB headers for the image, returning the size of a row without padding.
+    // Compressed bitmaps need the size of the compressed pixel data
+    uint32_t _get_bitmap_headers(std::array<uint8_t, 14>& bmp_header, std::array<uint8_t, 40>& dib_header,
+                                 uint32_t compression = kBitmapRgb, uint32_t compressed_size = 0) const {
         // Initialise default headers
-        std::array<uint8_t, 14> bmp_header = { \
+        bmp_header = {{ \
             0x42, 0x4D,                 // File ID: "BM"
             0x00, 0x00, 0x00, 0x00,     // Size of BMP file
             0x00, 0x00,                 // Unused
             0x00, 0x00,                 // Unused
-            0x00, 0x00, 0x00, 0x00};    // Offset where pixel array starts
-        std::array<uint8_t, 40> dib_header = { \
+            0x00, 0x00, 0x00, 0x00}};   // Offset where pixel array starts
+        dib_header = {{ \
             0x28, 0x00, 0x00, 0x00,     // Size of DIB header
             0x00, 0x00, 0x00, 0x00,     // Width of bitmap in pixels
             0x00, 0x00, 0x00, 0x00,     // Height of bitmap in pixels
@@ -175,22 +685,25 @@ public:
             0x13, 0x0B, 0x00, 0x00,     // Horizontal resolution in pixels per meter (72dpi)
             0x13, 0x0B, 0x00, 0x00,     // Vertical resolution in pixels per meter (72dpi)
             0x00, 0x00, 0x00, 0x00,     // Number of colours in colour table
-            0x00, 0x00, 0x00, 0x00};    // Number of important colours
+            0x00, 0x00, 0x00, 0x00}};   // Number of important colours
+
+        if (!kPacked && BITS_PER_PIXEL != (sizeof(T)*8)) {
+            throw std::runtime_error("Not currently supported!");
+        }
 
         // Configure BMP header
         // Get BMP size
-        const uint32_t size_of_row = (BITS_PER_PIXEL * m_width) / 8;
-        // All rows must be padded to be a multiple of 4 bytes long
-        const uint32_t padding_bytes = (size_of_row % 4) == 0 ? 0 : (4 - (size_of_row % 4));
-        const uint32_t size_of_row_with_padding = size_of_row + padding_bytes;
-        const uint32_t size_of_pixel_array = size_of_row_with_padding * m_height;
+        const uint16_t num_bits_per_pixel = _get_bitmap_bits(compression);
+        const uint32_t size_of_row = ((num_bits_per_pixel * m_width) + 7) / 8;
+        const uint32_t size_of_row_with_padding = size_of_row + _get_row_padding(size_of_row);
+        const uint32_t size_of_pixel_array = (compression == kBitmapRgb) ? (size_of_row_with_padding * m_height) : compressed_size;
         // Pixel array starts after BMP header, DIB header, and colour table (when present)
         uint32_t pixel_array_offset = bmp_header.size() + dib_header.size();
         pixel_array_offset += (m_colour_table.size() * sizeof(uint32_t));
         uint32_t size_of_bmp = size_of_pixel_array + pixel_array_offset;
         // Set size of BMP file
         std::memcpy(bmp_header.data()+2, &size_of_bmp, sizeof(size_of_bmp));
-        // Set pixel array offset        
+        // Set pixel array offset
         std::memcpy(bmp_header.data()+10, &pixel_array_offset, sizeof(pixel_array_offset));
 
         // Configure DIB header
@@ -199,62 +712,751 @@ public:
         // Set height
         std::memcpy(dib_header.data()+8, &m_height, sizeof(m_height));
         // Set number of bits per pixel
-        uint16_t num_bits_per_pixel = BITS_PER_PIXEL;
         std::memcpy(dib_header.data()+14, &num_bits_per_pixel, sizeof(num_bits_per_pixel));
+        // Set compression type
+        std::memcpy(dib_header.data()+16, &compression, sizeof(compression));
         // Set size of raw bitmap data (inc padding)
         std::memcpy(dib_header.data()+20, &size_of_pixel_array, sizeof(size_of_pixel_array));
         // Set number of colours in colour table
         uint16_t colour_table_size = m_colour_table.size();
         std::memcpy(dib_header.data()+32, &colour_table_size, sizeof(colour_table_size));
-        
-        std::vector<uint8_t> padded_image_data(size_of_pixel_array);
-        if (padding_bytes == 0 && BITS_PER_PIXEL == (sizeof(T)*8)) {  // No padding and datatype matches width
-            std::memcpy(padded_image_data.data(), m_image_data.data(), m_image_data.size()*sizeof(T));
-        } else if (BITS_PER_PIXEL == (sizeof(T)*8)) {   // Padding required, but datatype matches width
-            unsigned int image_data_index = 0;
-            unsigned int padded_image_data_index = 0;
-            while (padded_image_data_index < size_of_pixel_array) {
-                std::memcpy(padded_image_data.data() + padded_image_data_index,
-                            m_image_data.data() + image_data_index,
-                            size_of_row);
-                image_data_index += size_of_row;
-                padded_image_data_index += size_of_row_with_padding;
+        return size_of_row;
+    }
+
+    // Encode a row of width pixels, one byte each
+    static void _encode_rle_row(const uint8_t* row, size_t width, std::vector<uint8_t>& out) {
+        auto run_length = [&](size_t x) {
+            size_t end = x + 1;
+            while (end < width && (end - x) < kMaxRleRun && row[end] == row[x]) end++;
+            return end - x;
+        };
+        _encode_rle(width, run_length, [row](size_t x) { return row[x]; }, out);
+    }
+
+    // Encode a row of runs, giving exactly the same bytes as encoding the row's pixels
+    void _encode_rle_runs(const std::vector<_Run>& row, std::vector<uint8_t>& out) const {
+        // Pixels are mostly looked up in order, so move on from the last run found rather than searching
+        size_t run = 0;
+        auto find = [&row, &run](size_t x) {
+            if (x < row[run].start) run = _find_run(row, x);
+            while (run + 1 < row.size() && row[run + 1].start <= x) run++;
+            return run;
+        };
+        auto run_length = [&](size_t x) {
+            const size_t found = find(x);
+            const size_t end = (found + 1 < row.size()) ? row[found + 1].start : m_width;
+            return std::min<size_t>(end - x, kMaxRleRun);
+        };
+        _encode_rle(m_width, run_length, [&](size_t x) { return row[find(x)].val; }, out);
+    }
+
+    // Append one row in BI_RLE8 form: runs of a single colour as (count, colour), and stretches of
+    // at least 3 pixels with no runs in them as (0, count, pixels), padded to an even length.
+    // run_length(x) is the number of pixels (up to kMaxRleRun) from x on that are the same as pixel(x)
+    template <class RunLength, class Pixel>
+    static void _encode_rle(size_t width, RunLength run_length, Pixel pixel, std::vector<uint8_t>& out) {
+        size_t x = 0;
+        while (x < width) {
+            const size_t run = run_length(x);
+            if (run >= 2) {
+                out.push_back(run);
+                out.push_back(pixel(x));
+                x += run;
+                continue;
+            }
+            // Stretch of pixels up to the next run of at least 3
+            size_t end = x + 1;
+            while (end < width && (end - x) < kMaxRleRun && run_length(end) < 3) end++;
+            const size_t count = end - x;
+            if (count < 3) {
+                for (; x < end; x++) {
+                    out.push_back(1);
+                    out.push_back(pixel(x));
+                }
+                continue;
+            }
+            out.push_back(0);
+            out.push_back(count);
+            for (; x < end; x++) {
+                out.push_back(pixel(x));
+            }
+            if ((count % 2) != 0) out.push_back(0);
+            x = end;
+        }
+        // End of line
+        out.push_back(0);
+        out.push_back(0);
+    }
+
+    // All rows must be padded to be a multiple of 4 bytes long
+    // Bits per pixel in a bitmap of the image. BI_RLE8 is always 8 bits per pixel, and as there is no
+    // 2 bit bitmap (outside of Windows CE), 2 bit images are written as 4 bit bitmaps
+    static uint16_t _get_bitmap_bits(uint32_t compression) {
+        if (compression == kBitmapRle8) return 8;
+        return (BITS_PER_PIXEL == 2) ? 4 : BITS_PER_PIXEL;
+    }
+
+    // Whether the image data holds its rows exactly as they are laid out in a bitmap
+    bool _is_bitmap_layout() const {
+        return m_storage == kPixelStorage && BITS_PER_PIXEL != 2;
+    }
+
+    // Write row y to out as it is laid out in a bitmap, using buffer for any steps in between
+    void _get_bitmap_row(uint32_t y, uint8_t* out, std::vector<uint8_t>& buffer) const {
+        const size_t row_bytes = static_cast<size_t>(m_row_size) * sizeof(T);
+        const uint8_t* row = nullptr;
+        if (m_storage != kPixelStorage) {
+            if (BITS_PER_PIXEL != 2) {
+                _copy_row(y, out);
+                return;
             }
+            buffer.resize(row_bytes);
+            _copy_row(y, buffer.data());
+            row = buffer.data();
         } else {
-            throw std::runtime_error("Not currently supported!");
+            row = _row_pointer(y);
+        }
+        if (BITS_PER_PIXEL == 2) {
+            _widen_row(row, out);
+        } else {
+            std::memcpy(out, row, row_bytes);
         }
+    }
 
-        if (!bmp_file.good()) {
-            throw std::runtime_error("Error with output file stream");
+    // Widen a row from 2 to 4 bits per pixel, writing (width + 1) / 2 bytes to out
+    void _widen_row(const uint8_t* row, uint8_t* out) const {
+        const size_t out_size = (m_width + 1) / 2;
+        for (size_t index = 0; index < out_size; index++) {
+            // Each byte of the image holds 4 pixels, so becomes 2 bytes
+            const uint8_t pixels = row[index / 2] >> (((index % 2) == 0) ? 4 : 0);
+            out[index] = static_cast<uint8_t>((((pixels >> 2) & 0x3) << 4) | (pixels & 0x3));
         }
+    }
 
-        bmp_file.write(reinterpret_cast<char*>(bmp_header.data()), bmp_header.size());
-        bmp_file.write(reinterpret_cast<char*>(dib_header.data()), dib_header.size());
-        bmp_file.write(reinterpret_cast<char*>(m_colour_table.data()), m_colour_table.size()*(sizeof(uint32_t)));
-        bmp_file.write(reinterpret_cast<char*>(padded_image_data.data()), padded_image_data.size());
-        
+    // Unpack a row of packed pixels to one byte per pixel, writing width bytes to out
+    void _unpack_row(const uint8_t* row, uint8_t* out) const {
+        for (uint32_t x = 0; x < m_width; x++) {
+            out[x] = (row[x / kPixelsPerByte] >> _pixel_shift(x)) & kPixelMask;
+        }
     }
 
-private:
-    void _set_pixel(unsigned int x, unsigned int y, T val) {
-        if (x >= m_width || y >= m_height) return;
-        m_image_data[(y * m_width) + x] = val;
+    static uint32_t _get_row_padding(uint32_t size_of_row) {
+        return (size_of_row % 4) == 0 ? 0 : (4 - (size_of_row % 4));
+    }
+
+    // writev every part, picking up where a short write left off
+    static void _write_all(int fd, std::vector<iovec>& parts) {
+        size_t first = 0;
+        while (first < parts.size()) {
+            if (parts[first].iov_len == 0) {
+                first++;
+                continue;
+            }
+            const size_t count = std::min(parts.size() - first, kMaxWriteParts);
+            ssize_t written = writev(fd, parts.data() + first, count);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("Failed to write bitmap: " + std::string(std::strerror(errno)));
+            }
+            Stats::add(Stats::kBytesWritten, written);
+            // Skip over the parts that were written in full, and trim the one that was cut short
+            size_t remaining = written;
+            while (first < parts.size() && remaining >= parts[first].iov_len) {
+                remaining -= parts[first].iov_len;
+                first++;
+            }
+            if (remaining > 0) {
+                parts[first].iov_base = static_cast<uint8_t*>(parts[first].iov_base) + remaining;
+                parts[first].iov_len -= remaining;
+            }
+        }
+    }
+
+    // Cut a line down to the part of it inside the box from min to max (Liang-Barsky).
+    // Returns false if none of it is inside
+    static bool _clip_line(Point& p0, Point& p1, const Point& min, const Point& max) {
+        if (p0.x >= min.x && p0.x <= max.x && p0.y >= min.y && p0.y <= max.y &&
+            p1.x >= min.x && p1.x <= max.x && p1.y >= min.y && p1.y <= max.y) {
+            return true;
+        }
+        const double dx = p1.x - p0.x;
+        const double dy = p1.y - p0.y;
+        // Narrow the range of the line, from t0 to t1, to where direction * t <= distance for each side
+        double t0 = 0.0;
+        double t1 = 1.0;
+        auto clip_side = [&](double direction, double distance) {
+            if (direction == 0.0) return distance >= 0.0;
+            const double t = distance / direction;
+            if (direction < 0.0) {
+                t0 = std::max(t0, t);
+            } else {
+                t1 = std::min(t1, t);
+            }
+            return t0 <= t1;
+        };
+        if (!clip_side(-dx, p0.x - min.x) || !clip_side(dx, max.x - p0.x) ||
+            !clip_side(-dy, p0.y - min.y) || !clip_side(dy, max.y - p0.y)) {
+            return false;
+        }
+        const Point start = p0;
+        if (t0 > 0.0) p0 = Point({start.x + (t0 * dx), start.y + (t0 * dy)});
+        if (t1 < 1.0) p1 = Point({start.x + (t1 * dx), start.y + (t1 * dy)});
+        return true;
+    }
+
+    // Bresenham's line drawing algorithm, in integers, clipped to the image width and to rows first_row
+    // to last_row before stepping through any pixels. The pixels drawn are exactly the ones that stepping
+    // along the whole line would draw within those bounds (or along the part within kLineMargin of the
+    // image), so lines crossing the edge of a band, strip or tile join up with their other half, and only
+    // the pixels in bounds cost anything
+    void _draw_line(Point p0, Point p1, T val, unsigned int first_row, unsigned int last_row) {
+        // No need to draw the line if it can't be drawn in integers
+        if (!(std::fabs(p0.x) <= kMaxLineCoordinate && std::fabs(p0.y) <= kMaxLineCoordinate &&
+              std::fabs(p1.x) <= kMaxLineCoordinate && std::fabs(p1.y) <= kMaxLineCoordinate)) {
+            return;
+        }
+        // Cut off the parts of the line far outside the image, which only lines
+        // longer than kLineMargin pixels have, then round to the nearest whole pixels
+        if (!_clip_line(p0, p1, Point({-static_cast<double>(kLineMargin), -static_cast<double>(kLineMargin)}),
+                        Point({static_cast<double>(m_max_x) + kLineMargin, static_cast<double>(m_max_y) + kLineMargin}))) {
+            return;
+        }
+        const double x1_rounded = std::round(p0.x);
+        const double y1_rounded = std::round(p0.y);
+        const double x2_rounded = std::round(p1.x);
+        const double y2_rounded = std::round(p1.y);
+        // No need to draw the line if it is outside the bounds
+        if (std::max(x1_rounded, x2_rounded) < 0.0 || std::min(x1_rounded, x2_rounded) > m_max_x ||
+            std::max(y1_rounded, y2_rounded) < first_row || std::min(y1_rounded, y2_rounded) > last_row) {
+            return;
+        }
+        int64_t x1 = static_cast<int64_t>(x1_rounded);
+        int64_t y1 = static_cast<int64_t>(y1_rounded);
+        int64_t x2 = static_cast<int64_t>(x2_rounded);
+        int64_t y2 = static_cast<int64_t>(y2_rounded);
+
+        // For large angles, step through y axis rather than x axis
+        const bool large_angle = (std::llabs(y2 - y1) > std::llabs(x2 - x1));
+        if (large_angle) {
+            std::swap(x1, y1);
+            std::swap(x2, y2);
+        }
+        // Algorithm expects x2 >= x1, so swap them if that isn't true
+        if (x1 > x2) {
+            std::swap(x1, x2);
+            std::swap(y1, y2);
+        }
+        const int64_t dx = x2 - x1;
+        const int64_t dy = std::llabs(y2 - y1);
+        const int y_step = (y1 < y2) ? 1 : -1;
+        // The bounds in the same (possibly swapped) axes as the line
+        const int64_t x_low = large_angle ? first_row : 0;
+        const int64_t x_high = large_angle ? last_row : m_max_x;
+        const int64_t y_low = large_angle ? 0 : first_row;
+        const int64_t y_high = large_angle ? m_max_x : last_row;
+
+        // Clip the steps along x, then the steps along y. The error term starts at dx and loses 2 dy each
+        // step, gaining 2 dx whenever it drops below 0 (twice the usual terms, to keep them whole), so
+        // after k steps y has moved ceil((2 dy k - dx) / 2 dx), or (2 dy k + dx - 1) / 2 dx in integers
+        int64_t first_step = std::max<int64_t>(0, x_low - x1);
+        int64_t last_step = std::min<int64_t>(dx, x_high - x1);
+        const int64_t min_moved = (y_step > 0) ? (y_low - y1) : (y1 - y_high);
+        const int64_t max_moved = (y_step > 0) ? (y_high - y1) : (y1 - y_low);
+        if (max_moved < 0 || min_moved > dy) return;
+        if (dy > 0) {
+            if (min_moved > 0) {
+                const int64_t steps = (2 * dx * min_moved) - dx + 1;
+                first_step = std::max<int64_t>(first_step, (steps + (2 * dy) - 1) / (2 * dy));
+            }
+            if (max_moved < dy) {
+                const int64_t steps = (2 * dx * (max_moved + 1)) - dx;
+                last_step = std::min<int64_t>(last_step, steps / (2 * dy));
+            }
+        }
+        if (first_step > last_step) return;
+
+        // Catch the error term and y up with the first step drawn
+        int64_t error = dx;
+        int64_t y = y1;
+        if (first_step > 0) {
+            const int64_t dropped = 2 * dy * first_step;
+            const int64_t moved = (dropped + dx - 1) / (2 * dx);
+            error -= dropped - (2 * dx * moved);
+            y += y_step * moved;
+        }
+        const int64_t x = x1 + first_step;
+        const int64_t count = last_step - first_step + 1;
+        Stats::add(Stats::kLinePixels, count);
+
+        // Step along x axis and inc y axis when the error term goes below 0
+        if (kPacked || m_storage == kRunStorage) {
+            // Packed pixels share bytes, and runs have to be split, so pixels are set one at a time, or
+            // for lines closer to horizontal, as the span of pixels the line draws in each row
+            int64_t major = x;
+            int64_t span_start = x;
+            for (int64_t step = 0; step < count; step++) {
+                if (large_angle) _write_pixel(y, major, val);
+                major++;
+                error -= 2 * dy;
+                if (error < 0) {
+                    if (!large_angle) {
+                        _write_span(span_start, major - 1, y, val);
+                        span_start = major;
+                    }
+                    y += y_step;
+                    error += 2 * dx;
+                }
+            }
+            if (!large_angle && span_start < major) _write_span(span_start, major - 1, y, val);
+            return;
+        }
+        if (m_storage == kBlockStorage) {
+            // Move through the pixels of each block, stepping on to the next block at its edges
+            const unsigned int start_x = large_angle ? y : x;
+            const unsigned int start_y = large_angle ? x : y;
+            T* pixel = &m_image_data[_entry_index(start_x, start_y)];
+            int column = start_x % kBlockSize;
+            int row = (start_y - m_first_row) % kBlockSize;
+            const ptrdiff_t next_block = kBlockEntries - kBlockSize;
+            const ptrdiff_t next_block_row = (static_cast<ptrdiff_t>(m_blocks_across) - 1) * kBlockEntries;
+            auto move_across = [&](int direction) {
+                pixel += direction;
+                column += direction;
+                if (column == static_cast<int>(kBlockSize)) {
+                    column = 0;
+                    pixel += next_block;
+                } else if (column < 0) {
+                    column = kBlockSize - 1;
+                    pixel -= next_block;
+                }
+            };
+            auto move_down = [&](int direction) {
+                pixel += direction * static_cast<ptrdiff_t>(kBlockSize);
+                row += direction;
+                if (row == static_cast<int>(kBlockSize)) {
+                    row = 0;
+                    pixel += next_block_row;
+                } else if (row < 0) {
+                    row = kBlockSize - 1;
+                    pixel -= next_block_row;
+                }
+            };
+            // Stops on the last pixel, so never steps past the end of the image
+            for (int64_t step = 0; ; step++) {
+                *pixel = val;
+                if ((step + 1) == count) break;
+                if (large_angle) {
+                    move_down(1);
+                } else {
+                    move_across(1);
+                }
+                error -= 2 * dy;
+                if (error < 0) {
+                    if (large_angle) {
+                        move_across(y_step);
+                    } else {
+                        move_down(y_step);
+                    }
+                    error += 2 * dx;
+                }
+            }
+            return;
+        }
+        // Otherwise move through the pixels themselves, so that no step has to work out where its pixel is
+        T* pixel = &m_image_data[large_angle ? _index(y, x) : _index(x, y)];
+        const ptrdiff_t x_stride = large_angle ? static_cast<ptrdiff_t>(m_width) : 1;
+        const ptrdiff_t y_stride = y_step * (large_angle ? 1 : static_cast<ptrdiff_t>(m_width));
+        for (int64_t step = 0; ; step++) {
+            *pixel = val;
+            if ((step + 1) == count) break;
+            pixel += x_stride;
+            error -= 2 * dy;
+            if (error < 0) {
+                pixel += y_stride;
+                error += 2 * dx;
+            }
+        }
+    }
+
+    // Draw polygon(0) to polygon(count - 1) in order, splitting the rows of the strip into bands drawn in parallel
+    template <class GetPolygon>
+    void _draw_polygons(size_t count, GetPolygon polygon, const Transform& transform,
+                        bool fill, T fill_colour, bool border, T border_colour, unsigned int num_threads) {
+        // The reference fill is only there to check the output against, so is always drawn on one thread
+        if (num_threads <= 1 || m_reference_fill) {
+            for (size_t index = 0; index < count; index++) {
+                draw_polygon(polygon(index), transform, fill, fill_colour, border, border_colour);
+            }
+            return;
+        }
+        // Use a few bands per thread so that bands full of detail don't leave the other threads idle
+        const unsigned int strip_height = m_last_row - m_first_row + 1;
+        const unsigned int band_height = (strip_height + std::min(strip_height, num_threads * 4) - 1) /
+                                         std::min(strip_height, num_threads * 4);
+        const unsigned int num_bands = (strip_height + band_height - 1) / band_height;
+
+        // Work through the polygons a batch at a time, so only a batch is ever held transformed.
+        // Each batch is banded across all the threads, then drawn by all of them a band at a time
+        std::vector<_BandedPolygon> batch;
+        size_t batch_start = 0;
+        while (batch_start < count) {
+            size_t batch_end = batch_start;
+            size_t batch_points = 0;
+            while (batch_end < count && (batch_end == batch_start || batch_points < kBandBatchPoints)) {
+                const Polygon& next = polygon(batch_end++);
+                batch_points += next.outer.size();
+                for (const auto& inner : next.inner) batch_points += inner.size();
+            }
+            if (batch.size() < batch_end - batch_start) batch.resize(batch_end - batch_start);
+
+            std::atomic<size_t> next_polygon(batch_start);
+            _run_threads(num_threads, [&]() {
+                Trace::Scope scope("band_polygons");
+                std::vector<_Edge> edges;
+                size_t index;
+                while ((index = next_polygon++) < batch_end) {
+                    _band_polygon(polygon(index), transform, fill, border, band_height, num_bands,
+                                  batch[index - batch_start], edges);
+                }
+            });
+
+            std::atomic<unsigned int> next_band(0);
+            _run_threads(num_threads, [&]() {
+                unsigned int band;
+                while ((band = next_band++) < num_bands) {
+                    const unsigned int first_row = m_first_row + (band * band_height);
+                    const unsigned int last_row = std::min(first_row + band_height - 1, m_last_row);
+                    Trace::Scope scope("draw_band", "first_row", first_row);
+                    for (size_t index = 0; index < batch_end - batch_start; index++) {
+                        _draw_banded_polygon(batch[index], band, first_row, last_row, fill, fill_colour, border, border_colour);
+                    }
+                }
+            });
+            batch_start = batch_end;
+        }
+    }
+
+    // Run work on num_threads threads (including this one), returning once they have all finished
+    template <class Work>
+    static void _run_threads(unsigned int num_threads, Work work) {
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < num_threads; i++) {
+            threads.emplace_back(work);
+        }
+        work();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Whether a polygon whose transformed bounding box is box could draw anything in rows first_row to
+    // last_row. Polygons outside the image or less than a pixel across are counted as culled when count_culled
+    bool _is_visible(const std::pair<Point, Point>& box, unsigned int first_row, unsigned int last_row,
+                     bool count_culled) const {
+        // No need to draw anything if the polygon bounding box
+        // is outside the image area
+        if (box.second.x < 0.0 || box.second.y < 0.0 || box.first.x > m_width || box.first.y > m_height) {
+            if (count_culled) Stats::add(Stats::kPolygonsCulled, 1);
+            return false;
+        // Or if it is outside the rows being drawn. Borders are rounded to the nearest
+        // pixel, so allow an extra row either side
+        } else if ((box.second.y + 1.0) < first_row || (box.first.y - 1.0) > last_row) {
+            return false;
+        // Skip drawing anything less than 1 px wide
+        } else if (((box.second.x - box.first.x) < 1.0) || ((box.second.y - box.first.y) < 1.0)) {
+            if (count_culled) Stats::add(Stats::kPolygonsCulled, 1);
+            return false;
+        }
+        return true;
+    }
+
+    // Transform a polygon and split its edges and border lines into the bands of rows they reach,
+    // reusing the vectors in banded. edges is scratch space for the edges before they are banded
+    void _band_polygon(const Polygon& polygon, const Transform& transform, bool fill, bool border,
+                       unsigned int band_height, unsigned int num_bands, _BandedPolygon& banded,
+                       std::vector<_Edge>& edges) const {
+        const std::pair<Point, Point> box = transform.apply(polygon.bounding_box);
+        banded.drawn = _is_visible(box, m_first_row, m_last_row, true);
+        banded.points.clear();
+        banded.edges.clear();
+        banded.edge_starts.assign(num_bands + 1, 0);
+        banded.lines.clear();
+        banded.line_starts.assign(num_bands + 1, 0);
+        if (!banded.drawn) return;
+
+        Trace::Scope scope("band_polygon", "points", polygon.outer.size());
+        // Every ring transformed one after another, with the index each ring starts at
+        std::vector<size_t> ring_starts;
+        ring_starts.push_back(0);
+        auto add_ring = [&](const std::vector<Point>& ring) {
+            const size_t start = banded.points.size();
+            banded.points.resize(start + ring.size());
+            Simd::transform(ring.data(), banded.points.data() + start, ring.size(), transform);
+            ring_starts.push_back(banded.points.size());
+        };
+        add_ring(polygon.outer);
+        for (const auto& inner : polygon.inner) add_ring(inner);
+        auto band_of = [&](unsigned int row) { return (row - m_first_row) / band_height; };
+
+        if (fill) {
+            Stats::Timer timer(Stats::kFill);
+            // The same rows and columns as _polygon_fill, over the whole strip
+            banded.x_start = (box.first.x < 0.0) ? 0 : std::floor(box.first.x);
+            banded.x_stop = (box.second.x > m_max_x) ? m_max_x : std::ceil(box.second.x);
+            const int y_start = std::max<int>((box.first.y < 0.0) ? 0 : std::floor(box.first.y), m_first_row);
+            const int y_stop = std::min<int>((box.second.y > m_max_y) ? m_max_y : std::ceil(box.second.y), m_last_row);
+            edges.clear();
+            for (size_t ring = 0; ring + 1 < ring_starts.size(); ring++) {
+                _add_ring_edges(banded.points.data() + ring_starts[ring], ring_starts[ring + 1] - ring_starts[ring],
+                                y_start, y_stop, edges);
+            }
+            _sort_edges(edges);
+            // Count the edges in each band, then give each band a copy of every edge that crosses it,
+            // starting at its first row. Edges stay sorted by their first row within each band
+            for (const _Edge& edge : edges) {
+                for (unsigned int band = band_of(edge.y_first); band <= band_of(edge.y_last); band++) {
+                    banded.edge_starts[band + 1]++;
+                }
+            }
+            for (unsigned int band = 0; band < num_bands; band++) {
+                banded.edge_starts[band + 1] += banded.edge_starts[band];
+            }
+            banded.edges.resize(banded.edge_starts[num_bands]);
+            std::vector<uint32_t> next(banded.edge_starts.begin(), banded.edge_starts.end() - 1);
+            for (const _Edge& edge : edges) {
+                for (unsigned int band = band_of(edge.y_first); band <= band_of(edge.y_last); band++) {
+                    _Edge& copy = banded.edges[next[band]++];
+                    copy = edge;
+                    copy.y_first = std::max<int>(edge.y_first, m_first_row + (band * band_height));
+                }
+            }
+        }
+
+        if (border) {
+            Stats::Timer timer(Stats::kBorder);
+            // Lines are drawn between rounded points, so reach the rows their rounded ends lie between
+            std::vector<std::pair<uint32_t, uint32_t>> line_bands;
+            for (size_t ring = 0; ring + 1 < ring_starts.size(); ring++) {
+                for (size_t start = ring_starts[ring]; start + 1 < ring_starts[ring + 1]; start++) {
+                    const double y1 = std::round(banded.points[start].y);
+                    const double y2 = std::round(banded.points[start + 1].y);
+                    const double low = std::max<double>(std::min(y1, y2), m_first_row);
+                    const double high = std::min<double>(std::max(y1, y2), m_last_row);
+                    // Also skips lines with ends that aren't numbers
+                    if (!(low <= high)) continue;
+                    const uint32_t first_band = band_of(static_cast<unsigned int>(low));
+                    const uint32_t last_band = band_of(static_cast<unsigned int>(high));
+                    for (uint32_t band = first_band; band <= last_band; band++) {
+                        banded.line_starts[band + 1]++;
+                    }
+                    line_bands.push_back({first_band, last_band});
+                    banded.lines.push_back(start);
+                }
+            }
+            for (unsigned int band = 0; band < num_bands; band++) {
+                banded.line_starts[band + 1] += banded.line_starts[band];
+            }
+            std::vector<uint32_t> starts(banded.lines);
+            banded.lines.resize(banded.line_starts[num_bands]);
+            std::vector<uint32_t> next(banded.line_starts.begin(), banded.line_starts.end() - 1);
+            for (size_t line = 0; line < starts.size(); line++) {
+                for (uint32_t band = line_bands[line].first; band <= line_bands[line].second; band++) {
+                    banded.lines[next[band]++] = starts[line];
+                }
+            }
+        }
+    }
+
+    // Draw the parts of a banded polygon in one band, which covers rows first_row to last_row
+    void _draw_banded_polygon(const _BandedPolygon& banded, unsigned int band, unsigned int first_row,
+                              unsigned int last_row, bool fill, T fill_colour, bool border, T border_colour) {
+        if (!banded.drawn) return;
+        if (fill) {
+            Stats::Timer timer(Stats::kFill);
+            _fill_edges(banded.edges.data() + banded.edge_starts[band], banded.edge_starts[band + 1] - banded.edge_starts[band],
+                        banded.x_start, banded.x_stop, last_row, fill_colour);
+        }
+        if (border) {
+            Stats::Timer timer(Stats::kBorder);
+            for (uint32_t line = banded.line_starts[band]; line < banded.line_starts[band + 1]; line++) {
+                const uint32_t start = banded.lines[line];
+                _draw_line(banded.points[start], banded.points[start + 1], border_colour, first_row, last_row);
+            }
+        }
+    }
+
+    // Entries of m_image_data needed for the strip. Blocks cover whole blocks, past the edge of the image
+    size_t _get_data_size() const {
+        if (m_storage == kRunStorage) return 0;
+        if (m_storage == kPixelStorage) return static_cast<size_t>(m_row_size) * m_strip_rows;
+        const size_t blocks_down = (m_strip_rows + kBlockSize - 1) / kBlockSize;
+        return blocks_down * m_blocks_across * kBlockEntries;
+    }
+
+    // Position of the start of row y (which must be in the strip) in m_image_data
+    inline size_t _row_index(unsigned int y) const {
+        return static_cast<size_t>(y - m_first_row) * m_row_size;
+    }
+
+    // Row y (which must be in the strip), when the image holds every pixel a row at a time
+    inline const uint8_t* _row_pointer(unsigned int y) const {
+        return reinterpret_cast<const uint8_t*>(m_image_data.data() + _row_index(y));
+    }
+
+    // Position of pixel x, y (which must be in the strip) in m_image_data, when pixels aren't packed
+    inline size_t _index(unsigned int x, unsigned int y) const {
+        return _row_index(y) + x;
+    }
+
+    // How far pixel x is shifted up within its byte, when pixels are packed
+    static inline unsigned int _pixel_shift(unsigned int x) {
+        return 8 - (((x % kPixelsPerByte) + 1) * BITS_PER_PIXEL);
+    }
+
+    // A byte of packed pixels that are all val
+    static inline uint8_t _repeat(T val) {
+        return static_cast<uint8_t>((val & kPixelMask) * (0xFFu / kPixelMask));
     }
 
-    void _polygon_fill(const Polygon& polygon, T val) {
-               
+    // The value kept for a pixel of val
+    static inline T _stored(T val) {
+        return kPacked ? static_cast<T>(val & kPixelMask) : val;
+    }
+
+    // Position in m_image_data of the entry holding pixel x, y (which must be in the strip)
+    inline size_t _entry_index(unsigned int x, unsigned int y) const {
+        const unsigned int column = kPacked ? (x / kPixelsPerByte) : x;
+        if (m_storage != kBlockStorage) return _row_index(y) + column;
+        return _block_row_index(column / kBlockSize, y) + (column % kBlockSize);
+    }
+
+    // Position in m_image_data of row y (which must be in the strip) of the block'th block across
+    inline size_t _block_row_index(unsigned int block, unsigned int y) const {
+        const unsigned int row = y - m_first_row;
+        return ((((static_cast<size_t>(row / kBlockSize) * m_blocks_across) + block) * kBlockSize) + (row % kBlockSize)) *
+               kBlockSize;
+    }
+
+    inline T _read_pixel(unsigned int x, unsigned int y) const {
+        if (m_storage == kRunStorage) {
+            const std::vector<_Run>& row = m_runs[y - m_first_row];
+            return row[_find_run(row, x)].val;
+        }
+        if (!kPacked) return m_image_data[_entry_index(x, y)];
+        return (m_image_data[_entry_index(x, y)] >> _pixel_shift(x)) & kPixelMask;
+    }
+
+    // Set a pixel (which must be in the strip). Packed pixels only keep the bits of val that fit
+    inline void _write_pixel(unsigned int x, unsigned int y, T val) {
+        if (m_storage == kRunStorage) {
+            _fill_runs(x, x, y, val);
+            return;
+        }
+        if (!kPacked) {
+            m_image_data[_entry_index(x, y)] = val;
+            return;
+        }
+        const unsigned int shift = _pixel_shift(x);
+        T& pixels = m_image_data[_entry_index(x, y)];
+        pixels = static_cast<T>((pixels & ~(kPixelMask << shift)) | ((val & kPixelMask) << shift));
+    }
+
+    void _polygon_fill(const Polygon& polygon, const Transform& transform, const std::pair<Point, Point>& box,
+                       T val, unsigned int first_row, unsigned int last_row) {
+
+        // Only need to fill over the bounding box area that is visible within the viewport
+        int x_start = (box.first.x < 0.0) ? 0 : std::floor(box.first.x);
+        int y_start = (box.first.y < 0.0) ? 0 : std::floor(box.first.y);
+        int x_stop = (box.second.x > m_max_x) ? m_max_x : std::ceil(box.second.x);
+        int y_stop = (box.second.y > m_max_y) ? m_max_y : std::ceil(box.second.y);
+        // Only fill the rows being drawn
+        if (y_start < static_cast<int>(first_row)) y_start = first_row;
+        if (y_stop > static_cast<int>(last_row)) y_stop = last_row;
+
+        // Build the edge table once for all rings, sorted by the first row each edge crosses
+        std::vector<_Edge> edges;
+        std::vector<Point> points;
+        _add_edges(polygon.outer, transform, y_start, y_stop, edges, points);
+        for (const auto& inner : polygon.inner) {
+            _add_edges(inner, transform, y_start, y_stop, edges, points);
+        }
+        _sort_edges(edges);
+        _fill_edges(edges.data(), edges.size(), x_start, x_stop, y_stop, val);
+    }
+
+    static void _sort_edges(std::vector<_Edge>& edges) {
+        std::sort(edges.begin(), edges.end(),
+                  [](const _Edge& a, const _Edge& b) { return a.y_first < b.y_first; });
+    }
+
+    // Fill between each pair of crossings of the edges (sorted by their first row) on each row up to
+    // y_stop, limited to columns x_start to x_stop
+    void _fill_edges(const _Edge* edges, size_t number_edges, int x_start, int x_stop, int y_stop, T val) {
+        if (number_edges == 0) return;
+        // Edges crossing the current row, kept sorted by their x crossing
+        _ActiveEdges active;
+        size_t next_edge = 0;
+
+        for (int y_index = edges[0].y_first; y_index <= y_stop; y_index++) {
+            // Drop edges that finished on the previous row
+            active.remove_finished(y_index);
+            // Add edges that start on this row
+            while (next_edge < number_edges && edges[next_edge].y_first <= y_index) {
+                active.push_back(edges[next_edge]);
+                next_edge++;
+            }
+            const size_t number_active = active.size();
+            if (number_active == 0) {
+                // Nothing left to fill
+                if (next_edge == number_edges) break;
+                // Jump straight to the next row that has an edge on it
+                y_index = edges[next_edge].y_first - 1;
+                continue;
+            }
+
+            // Update the crossing of every active edge on this row.
+            // Uses exactly the same interpolation as _get_x_crossings so both fills match pixel for pixel
+            Simd::row_crossings(active.ax.data(), active.ay.data(), active.dx.data(), active.dy.data(),
+                                number_active, static_cast<double>(y_index), active.x.data());
+            active.sort();
+
+            // Step through each pair or crossings and fill the span in between
+            const std::vector<int>& x_crossings = active.x;
+            for (unsigned int node_index = 0; node_index + 1 < number_active; node_index += 2) {
+                // Crossings are sorted, so once one starts outside the viewport the rest will too
+                if (x_crossings[node_index] >= x_stop) break;
+                // If the span ends before the viewport starts, skip it
+                if (x_crossings[node_index + 1] < x_start) continue;
+                // Limit fill range to the viewport
+                unsigned int x_fill_start = (x_crossings[node_index] < 0) ?
+                                            0 : static_cast<unsigned int>(x_crossings[node_index]);
+                unsigned int x_fill_stop = (x_crossings[node_index + 1] > static_cast<int>(m_max_x)) ?
+                                            m_max_x : static_cast<unsigned int>(x_crossings[node_index + 1]);
+                _fill_span(x_fill_start, x_fill_stop, y_index, val);
+            }
+        }
+    }
+
+    void _polygon_fill_reference(const Polygon& polygon, const Transform& transform, const std::pair<Point, Point>& box,
+                                 T val, unsigned int first_row, unsigned int last_row) {
+        // Original fill. Finds the crossings for each row by walking every edge of every ring.
+        // Kept so the output of _polygon_fill can be checked against it pixel for pixel
+
         // Only need to fill over the bounding box area that is visible within the viewport
-        int x_start = (polygon.min_x() < 0.0) ? 0 : std::floor(polygon.min_x());
-        int y_start = (polygon.min_y() < 0.0) ? 0 : std::floor(polygon.min_y());
-        int x_stop = (polygon.max_x() > m_max_x) ? m_max_x : std::ceil(polygon.max_x());
-        int y_stop = (polygon.max_y() > m_max_y) ? m_max_y : std::ceil(polygon.max_y());
+        int x_start = (box.first.x < 0.0) ? 0 : std::floor(box.first.x);
+        int y_start = (box.first.y < 0.0) ? 0 : std::floor(box.first.y);
+        int x_stop = (box.second.x > m_max_x) ? m_max_x : std::ceil(box.second.x);
+        int y_stop = (box.second.y > m_max_y) ? m_max_y : std::ceil(box.second.y);
+        // Only fill the rows being drawn
+        if (y_start < static_cast<int>(first_row)) y_start = first_row;
+        if (y_stop > static_cast<int>(last_row)) y_stop = last_row;
 
         // Step through each row within the bounding box
         for (int y_index = y_start; y_index <= y_stop; y_index++) {
             std::vector<int> x_crossings;
-            _get_x_crossings(polygon.outer, y_index, x_crossings);
+            _get_x_crossings(polygon.outer, transform, y_index, x_crossings);
             for (const auto& inner :  polygon.inner) {
-                _get_x_crossings(inner, y_index, x_crossings);
+                _get_x_crossings(inner, transform, y_index, x_crossings);
             }
             // If no crossings on this row, then continue to the next row
             if (x_crossings.size() < 2) continue;            
@@ -273,6 +1475,7 @@ private:
                 unsigned int x_fill_stop = (x_crossings[node_index + 1] > static_cast<int>(m_max_x)) ?
                                             m_max_x : static_cast<unsigned int>(x_crossings[node_index + 1]);
                 // Fill the pixels between the pair of x coordinates
+                Stats::add(Stats::kPixelsFilled, x_fill_stop - x_fill_start + 1);
                 for (unsigned int x_index = x_fill_start; x_index <= x_fill_stop; x_index++) {
                     set_pixel(x_index, y_index, val);
                 }
@@ -280,38 +1483,241 @@ private:
         }
     }
 
-    void _polygon_border(const Polygon& polygon, T val) {
-        for  (unsigned int node = 0; node < (polygon.outer.size() - 1); node++) {
-            draw_line(polygon.outer[node], polygon.outer[node + 1], val);
-        }
+    void _polygon_border(const Polygon& polygon, const Transform& transform,
+                         T val, unsigned int first_row, unsigned int last_row) {
+        std::vector<Point> points;
+        _ring_border(polygon.outer, transform, val, first_row, last_row, points);
         for (const auto& inner_poly : polygon.inner) {
-            for  (unsigned int node = 0; node < (inner_poly.size() - 1); node++) {
-                draw_line(inner_poly[node], inner_poly[node + 1], val);
-            }
+            _ring_border(inner_poly, transform, val, first_row, last_row, points);
         }
     }
 
-    void _get_x_crossings(const std::vector<Point>& polygon, unsigned int row_index, std::vector<int>& x_crossings) {
+    void _ring_border(const std::vector<Point>& ring, const Transform& transform,
+                      T val, unsigned int first_row, unsigned int last_row, std::vector<Point>& points) {
+        // Transform the whole ring in one pass, then join each point to the next
+        points.resize(ring.size());
+        Simd::transform(ring.data(), points.data(), ring.size(), transform);
+        draw_polyline(points, val, first_row, last_row);
+    }
+
+    void _get_x_crossings(const std::vector<Point>& polygon, const Transform& transform,
+                          unsigned int row_index, std::vector<int>& x_crossings) {
 
         unsigned int i = 1;
         unsigned int j = 0;
         double y_index_dbl = static_cast<double>(row_index);
+        Stats::add(Stats::kEdgesScanned, polygon.empty() ? 0 : polygon.size() - 1);
         // Step through each adjacent pair of nodes in the polygon
         while(i < polygon.size()) {
+            const Point point_i = transform.apply(polygon[i]);
+            const Point point_j = transform.apply(polygon[j]);
             // If one node is above the current row, and one node is below
             // the current row (or one node is directly on it)
-            if (((polygon[i].y < y_index_dbl) && (polygon[j].y >= y_index_dbl)) ||
-                ((polygon[j].y < y_index_dbl) && (polygon[i].y >= y_index_dbl))) {
+            if (((point_i.y < y_index_dbl) && (point_j.y >= y_index_dbl)) ||
+                ((point_j.y < y_index_dbl) && (point_i.y >= y_index_dbl))) {
                 // Interpolate the coordinate of the point that the polygon crosses the x axis on this row
-                x_crossings.push_back(
-                    round(
-                        polygon[i].x + (
-                            ((y_index_dbl - polygon[i].y) / (polygon[j].y - polygon[i].y)) * 
-                            (polygon[j].x - polygon[i].x)
-                )));
+                x_crossings.push_back(_x_crossing(point_i, point_j, y_index_dbl));
             }
             i++;
             j++;
         }
     }
+
+    static inline int _x_crossing(const Point& a, const Point& b, double y_index_dbl) {
+        return static_cast<int>(round(a.x + (((y_index_dbl - a.y) / (b.y - a.y)) * (b.x - a.x))));
+    }
+
+    void _add_edges(const std::vector<Point>& polygon, const Transform& transform,
+                    int y_start, int y_stop, std::vector<_Edge>& edges, std::vector<Point>& points) {
+        if (polygon.empty()) return;
+        // Transform the whole ring in one pass. Each point is the end of one edge and the start of the next
+        points.resize(polygon.size());
+        Simd::transform(polygon.data(), points.data(), polygon.size(), transform);
+        _add_ring_edges(points.data(), points.size(), y_start, y_stop, edges);
+    }
+
+    // Add the edges of a ring that has already been transformed, keeping rows y_start to y_stop
+    static void _add_ring_edges(const Point* points, size_t count, int y_start, int y_stop, std::vector<_Edge>& edges) {
+        if (count == 0) return;
+        Stats::add(Stats::kEdgesScanned, count - 1);
+        Point b = points[0];
+        for (size_t i = 1; i < count; i++) {
+            const Point a = points[i];
+            // Horizontal edges never cross a row
+            if (a.y != b.y) {
+                // An edge crosses row y when min_y < y <= max_y
+                double first = std::floor(std::min(a.y, b.y)) + 1.0;
+                double last = std::floor(std::max(a.y, b.y));
+                // Only keep the rows that are inside the viewport
+                if (first < y_start) first = y_start;
+                if (last > y_stop) last = y_stop;
+                if (first <= last) {
+                    // Edges run from a to b to match the crossings found by _get_x_crossings
+                    edges.push_back({static_cast<int>(first), static_cast<int>(last), a.x, a.y, b.x - a.x, b.y - a.y});
+                }
+            }
+            b = a;
+        }
+    }
+
+    inline void _fill_span(unsigned int x_start, unsigned int x_stop, unsigned int y, T val) {
+        Stats::add(Stats::kPixelsFilled, x_stop - x_start + 1);
+        if (m_storage != kPixelStorage) {
+            _write_span(x_start, x_stop, y, val);
+            return;
+        }
+        if (kPacked) {
+            _fill_packed_span(reinterpret_cast<uint8_t*>(m_image_data.data() + _row_index(y)), x_start, x_stop, val);
+            return;
+        }
+        auto row = m_image_data.begin() + _index(0, y);
+        std::fill(row + x_start, row + x_stop + 1, val);
+    }
+
+    // Fill a span of packed pixels. Only the bytes at either end are shared with pixels outside the
+    // span, so they are masked, and the whole bytes in between are set by memset a word at a time
+    static void _fill_packed_span(uint8_t* row, unsigned int x_start, unsigned int x_stop, T val) {
+        const uint8_t pixels = _repeat(val);
+        const size_t first_byte = x_start / kPixelsPerByte;
+        const size_t last_byte = x_stop / kPixelsPerByte;
+        // Bits of the first and last bytes that are in the span
+        uint8_t first_mask = static_cast<uint8_t>(0xFFu >> ((x_start % kPixelsPerByte) * BITS_PER_PIXEL));
+        const uint8_t last_mask = static_cast<uint8_t>(0xFFu << _pixel_shift(x_stop));
+        if (first_byte == last_byte) first_mask &= last_mask;
+        row[first_byte] = static_cast<uint8_t>((row[first_byte] & ~first_mask) | (pixels & first_mask));
+        if (first_byte == last_byte) return;
+        std::memset(row + first_byte + 1, pixels, last_byte - first_byte - 1);
+        row[last_byte] = static_cast<uint8_t>((row[last_byte] & ~last_mask) | (pixels & last_mask));
+    }
+
+    // Set pixels x_start to x_stop of row y (which must all be in the image and strip) to val
+    inline void _write_span(unsigned int x_start, unsigned int x_stop, unsigned int y, T val) {
+        if (m_storage == kRunStorage) {
+            _fill_runs(x_start, x_stop, y, val);
+        } else if (m_storage == kBlockStorage) {
+            _fill_blocks(x_start, x_stop, y, val);
+        } else if (kPacked) {
+            _fill_packed_span(reinterpret_cast<uint8_t*>(m_image_data.data() + _row_index(y)), x_start, x_stop, val);
+        } else {
+            std::fill(m_image_data.begin() + _index(x_start, y), m_image_data.begin() + _index(x_stop, y) + 1, val);
+        }
+    }
+
+    // Index of the run in row that holds pixel x
+    static inline size_t _find_run(const std::vector<_Run>& row, uint32_t x) {
+        const auto after = std::upper_bound(row.begin(), row.end(), x,
+                                            [](uint32_t pixel, const _Run& run) { return pixel < run.start; });
+        return (after - row.begin()) - 1;
+    }
+
+    // Set pixels x_start to x_stop of row y to val, by swapping the runs they cover for a single run.
+    // Joins the new run on to the runs either side when they are the same colour
+    void _fill_runs(unsigned int x_start, unsigned int x_stop, unsigned int y, T val) {
+        std::vector<_Run>& row = m_runs[y - m_first_row];
+        val = _stored(val);
+        const size_t first = _find_run(row, x_start);
+        // The runs the span covers are all replaced, so step through them rather than searching again
+        size_t last = first;
+        while (last + 1 < row.size() && row[last + 1].start <= x_stop) last++;
+        // Nothing to do when the span is already in a run of val, as with borders drawn twice
+        if (first == last && row[first].val == val) return;
+        // Runs from begin up to end are replaced. The run holding x_start is kept if it starts before it
+        const size_t begin = (row[first].start < x_start) ? (first + 1) : first;
+        size_t end = last + 1;
+        _Run added[2];
+        size_t number_added = 0;
+        if (begin == 0 || row[begin - 1].val != val) {
+            added[number_added++] = _Run{x_start, val};
+        }
+        const uint32_t after = x_stop + 1;
+        if (after < m_width) {
+            if (end < row.size() && row[end].start == after) {
+                // The next run starts straight after the span, so join it on if it is the same colour
+                if (row[end].val == val) end++;
+            } else if (row[last].val != val) {
+                // Keep the rest of the last run
+                added[number_added++] = _Run{after, row[last].val};
+            }
+        }
+        const size_t removed = end - begin;
+        if (number_added > removed) {
+            row.insert(row.begin() + begin, number_added - removed, added[0]);
+        } else if (removed > number_added) {
+            row.erase(row.begin() + begin, row.begin() + begin + (removed - number_added));
+        }
+        std::copy(added, added + number_added, row.begin() + begin);
+    }
+
+    // Set pixels x_start to x_stop of row y to val, a block at a time
+    void _fill_blocks(unsigned int x_start, unsigned int x_stop, unsigned int y, T val) {
+        const unsigned int block_pixels = kBlockSize * kPixelsPerByte;
+        const unsigned int first_block = x_start / block_pixels;
+        const unsigned int last_block = x_stop / block_pixels;
+        // The same row of each block across is kBlockEntries on from the last
+        T* row = m_image_data.data() + _block_row_index(first_block, y);
+        const unsigned int first_start = x_start - (first_block * block_pixels);
+        const unsigned int last_stop = x_stop - (last_block * block_pixels);
+        if (first_block == last_block) {
+            _fill_block_row(row, first_start, last_stop, val);
+            return;
+        }
+        _fill_block_row(row, first_start, block_pixels - 1, val);
+        row += kBlockEntries;
+        if (kPacked) {
+            const uint8_t pixels = _repeat(val);
+            for (unsigned int block = first_block + 1; block < last_block; block++, row += kBlockEntries) {
+                std::memset(row, pixels, kBlockSize);
+            }
+        } else {
+            // Whole rows of blocks are a fixed size, so each fill can be a few wide stores
+            for (unsigned int block = first_block + 1; block < last_block; block++, row += kBlockEntries) {
+                std::fill_n(row, kBlockSize, val);
+            }
+        }
+        _fill_block_row(row, 0, last_stop, val);
+    }
+
+    // Set pixels x_start to x_stop of a row of a block
+    static inline void _fill_block_row(T* row, unsigned int x_start, unsigned int x_stop, T val) {
+        if (kPacked) {
+            _fill_packed_span(reinterpret_cast<uint8_t*>(row), x_start, x_stop, val);
+        } else {
+            std::fill(row + x_start, row + x_stop + 1, val);
+        }
+    }
+
+    // Write row y (which must be in the strip) to out, laid out as the image would hold it with
+    // kPixelStorage (m_row_size entries), when it is held as runs or in blocks
+    void _copy_row(uint32_t y, uint8_t* out) const {
+        if (m_storage == kRunStorage) {
+            _expand_runs(y, out);
+            return;
+        }
+        T* pixels = reinterpret_cast<T*>(out);
+        for (unsigned int block = 0; block < m_blocks_across; block++) {
+            const size_t column = static_cast<size_t>(block) * kBlockSize;
+            const size_t count = std::min<size_t>(kBlockSize, m_row_size - column);
+            std::copy_n(m_image_data.data() + _block_row_index(block, y), count, pixels + column);
+        }
+        // Clear the bits past the last pixel, which set_background fills along with the rest of the block
+        if (kPacked && (m_width % kPixelsPerByte) != 0) {
+            out[m_row_size - 1] &= static_cast<uint8_t>(0xFFu << _pixel_shift(m_max_x));
+        }
+    }
+
+    // Write row y of runs to out laid out as the image would hold every pixel (m_row_size entries)
+    void _expand_runs(uint32_t y, uint8_t* out) const {
+        const std::vector<_Run>& row = m_runs[y - m_first_row];
+        // The bits past the last pixel are always 0
+        if (kPacked) out[m_row_size - 1] = 0;
+        for (size_t run = 0; run < row.size(); run++) {
+            const uint32_t end = (run + 1 < row.size()) ? row[run + 1].start : m_width;
+            if (kPacked) {
+                _fill_packed_span(out, row[run].start, end - 1, row[run].val);
+            } else {
+                T* pixels = reinterpret_cast<T*>(out);
+                std::fill(pixels + row[run].start, pixels + end, row[run].val);
+            }
+        }
+    }
 };
\ No newline at end of file
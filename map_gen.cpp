@@ -1,15 +1,68 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <vector>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <memory>     // unique_ptr
+#include <numeric>    // iota
+#include <algorithm>  // stable_sort, remove_if
+#include <cstdlib>    // strtod
+#include <cerrno>
+#include <sys/stat.h>   // mkdir
+#include <unistd.h>     // STDOUT_FILENO
 #include "polygon.hpp"
 #include "image.hpp"
 #include "shapefile.hpp"
+#include "geometry_cache.hpp"
+#include "map_renderer.hpp"
+#include "map_server.hpp"
+#include "point_locator.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+// When streaming with multiple threads, the number of points to collect
+// before drawing them as a batch
+const size_t kStreamBatchPoints = 1 << 20;
+// Number of points to read in before looking them up as a batch
+const size_t kLookupBatchPoints = 1 << 20;
 
 void print_help() {
     std::cerr << "\nUsage: " << std::endl;
     std::cerr << "\t" << "map_gen <path_to_map_shapefile> [image_width] [image_height]" << std::endl;
     std::cerr << "\t" << "map_gen <path_to_map_shapefile> ";
     std::cerr << "x_min x_max y_min y_max [image_width] [image_height]" << std::endl;
+    std::cerr << "\t" << "map_gen --tiles <output_dir> <path_to_map_shapefile> min_zoom max_zoom" << std::endl;
+    std::cerr << "\t" << "map_gen --serve [--socket <socket_path>] <path_to_map_shapefile>..." << std::endl;
+    std::cerr << "\t" << "map_gen --client <socket_path> render map x_min x_max y_min y_max width height [palette]" << std::endl;
+    std::cerr << "\t" << "map_gen --batch <job_file> <path_to_map_shapefile>" << std::endl;
+    std::cerr << "\t" << "map_gen --build-cache <cache_file> <path_to_map_shapefile>" << std::endl;
+    std::cerr << "\t" << "map_gen --lookup <path_to_map_shapefile> < points.txt" << std::endl;
+    std::cerr << "\nA cache file can be used in place of the shapefile in any of the above" << std::endl;
+    std::cerr << "\nOptions: " << std::endl;
+    std::cerr << "\t" << "--threads N          Draw using N threads (0 uses all cores)" << std::endl;
+    std::cerr << "\t" << "--reference-fill     Fill polygons with the original (slow) per row search" << std::endl;
+    std::cerr << "\t" << "--no-mmap            Read the shapefile into memory rather than memory mapping it" << std::endl;
+    std::cerr << "\t" << "--no-index           Ignore the .shx index file and walk every record header instead" << std::endl;
+    std::cerr << "\t" << "--no-simd            Use the scalar versions of the vectorised kernels" << std::endl;
+    std::cerr << "\t" << "--stream             Decode and draw one record at a time to limit memory use" << std::endl;
+    std::cerr << "\t" << "--memory-budget MB   Draw the image a strip of rows at a time, using at most MB megabytes of pixels" << std::endl;
+    std::cerr << "\t" << "--stats              Write timings and counts for each stage to stderr as JSON" << std::endl;
+    std::cerr << "\t" << "--trace FILE         Write a timeline of each thread's work to FILE (Chrome trace format)" << std::endl;
+    std::cerr << "\t" << "--simplify           Simplify polygons to within half a pixel before drawing them" << std::endl;
+    std::cerr << "\t" << "--format FORMAT      Write the image as bmp (default), rle (run length encoded bmp) or png" << std::endl;
+    std::cerr << "\t" << "--bits N             Store and write the image with N (2, 4 or 8) bits per pixel" << std::endl;
+    std::cerr << "\t" << "--run-storage        Hold each row of the image as runs of one colour rather than every pixel" << std::endl;
+    std::cerr << "\t" << "--block-storage      Hold the image in 64x64 blocks rather than a row at a time" << std::endl;
+    std::cerr << "\t" << "--tiles DIR          Write a pyramid of tiles to DIR/z/x/y.bmp (or .png)" << std::endl;
+    std::cerr << "\t" << "--tile-size N        Width and height of each tile in pixels (default 256)" << std::endl;
+    std::cerr << "\t" << "--serve              Load the shapefiles once, then answer render requests" << std::endl;
+    std::cerr << "\t" << "--socket PATH        Listen for requests on a Unix domain socket rather than stdin" << std::endl;
+    std::cerr << "\t" << "--client PATH        Send a request to a server listening on PATH" << std::endl;
+    std::cerr << "\t" << "--build-cache FILE   Write the decoded polygons to FILE for faster loading" << std::endl;
+    std::cerr << "\t" << "--batch FILE         Draw every image listed in FILE (see README)" << std::endl;
+    std::cerr << "\t" << "--lookup             Print the record containing each \"lon lat\" line read from stdin" << std::endl;
 }
 
 template<typename T>
@@ -44,6 +97,445 @@ T read_arg(char* str, int min, int max, const std::string& name) {
     return val;
 }
 
+// Write the timings and counts collected with --stats to stderr,
+// and the events recorded with --trace to trace_path
+void write_reports(const std::string& trace_path) {
+    if (Stats::enabled()) Stats::write_json(std::cerr);
+    if (Trace::enabled()) {
+        std::ofstream trace_file(trace_path);
+        Trace::write_json(trace_file);
+        if (!trace_file.good()) {
+            std::cerr << "Error: Failed to write trace: \"" << trace_path << "\"" << std::endl;
+        }
+    }
+}
+
+// Create a directory if it doesn't already exist
+void make_directory(const std::string& path) {
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+        throw std::runtime_error("Failed to create directory: \"" + path + "\"");
+    }
+}
+
+// Decode every polygon from either a shapefile, or a cache written by --build-cache
+void load_polygons(const std::string& path, bool memory_map, bool use_index, unsigned int num_threads,
+                   std::vector<Polygon>& polygons) {
+    if (GeometryCache::is_cache_file(path)) {
+        GeometryCache cache(path);
+        cache.read();
+        cache.get_polygons(polygons);
+        return;
+    }
+    Shapefile shapefile(path);
+    shapefile.use_memory_map(memory_map);
+    shapefile.use_index_file(use_index);
+    shapefile.read();
+    shapefile.get_polygons(polygons, num_threads);
+}
+
+// Decode every polygon along with the record it came from, numbered from 0 in file order
+void load_polygons(const std::string& path, bool memory_map, bool use_index,
+                   std::vector<Polygon>& polygons, std::vector<size_t>& records) {
+    polygons.clear();
+    records.clear();
+    auto add_polygon = [&](Polygon& polygon, size_t record_number) {
+        polygons.push_back(std::move(polygon));
+        records.push_back(record_number);
+    };
+    if (GeometryCache::is_cache_file(path)) {
+        GeometryCache cache(path);
+        cache.read();
+        cache.for_each_polygon(add_polygon);
+        return;
+    }
+    Shapefile shapefile(path);
+    shapefile.use_memory_map(memory_map);
+    shapefile.use_index_file(use_index);
+    shapefile.read();
+    shapefile.for_each_polygon(add_polygon);
+}
+
+// Read "lon lat" (or "lon,lat") lines from stdin, and write the record containing each point
+// to stdout, or -1 if it is not inside any polygon. Points are looked up in batches across num_threads
+void lookup_points(const PointLocator& locator, unsigned int num_threads) {
+    std::ios::sync_with_stdio(false);
+    std::vector<Point> points;
+    std::vector<int64_t> results;
+    std::string line;
+    std::string output;
+    size_t line_number = 0;
+    bool more = true;
+    while (more) {
+        points.clear();
+        while (points.size() < kLookupBatchPoints && (more = static_cast<bool>(std::getline(std::cin, line)))) {
+            line_number++;
+            const char* text = line.c_str();
+            char* end;
+            Point point;
+            point.x = std::strtod(text, &end);
+            bool good = (end != text);
+            text = end;
+            while (*text == ' ' || *text == '\t' || *text == ',') text++;
+            point.y = std::strtod(text, &end);
+            good = good && (end != text);
+            while (*end == ' ' || *end == '\t' || *end == '\r') end++;
+            if (!good || *end != '\0') {
+                throw std::runtime_error("Invalid point on line " + std::to_string(line_number) + ": " + line);
+            }
+            points.push_back(point);
+        }
+        locator.find(points, results, num_threads);
+        output.clear();
+        for (int64_t record : results) {
+            output += std::to_string(record);
+            output += '\n';
+        }
+        std::cout.write(output.data(), output.size());
+    }
+    std::cout.flush();
+}
+
+// Draw polygons (already shifted and scaled to pixels) into an image that only holds a strip of rows,
+// writing each finished strip to fd. Polygons are sorted into the strips their bounding boxes cover
+// up front, so each strip only looks at its own polygons. The output is identical to drawing the whole image
+template <size_t BITS_PER_PIXEL>
+void draw_strips(Image<uint8_t, BITS_PER_PIXEL>& image, const std::vector<Polygon>& polygons, unsigned int num_threads,
+                 ImageFormat format, int fd) {
+    const unsigned int strip_rows = image.get_strip_rows();
+    const unsigned int max_row = image.get_height() - 1;
+    const unsigned int number_strips = (image.get_height() + strip_rows - 1) / strip_rows;
+    std::vector<std::vector<size_t>> strips(number_strips);
+    for (size_t polygon_index = 0; polygon_index < polygons.size(); polygon_index++) {
+        // Borders are rounded to the nearest pixel, so allow an extra row either side
+        const std::pair<Point, Point>& box = polygons[polygon_index].bounding_box;
+        const double first_row = std::floor(box.first.y) - 1.0;
+        const double last_row = std::ceil(box.second.y) + 1.0;
+        if (last_row < 0.0 || first_row > max_row) continue;
+        const unsigned int first_strip = static_cast<unsigned int>(std::max(first_row, 0.0)) / strip_rows;
+        const unsigned int last_strip = static_cast<unsigned int>(std::min<double>(last_row, max_row)) / strip_rows;
+        for (unsigned int strip = first_strip; strip <= last_strip; strip++) {
+            strips[strip].push_back(polygon_index);
+        }
+    }
+
+    // Bitmaps are stored bottom up, so the strip at row 0 is written first. PNGs are stored top down,
+    // so are written from the last strip. Run length encoded strips are kept until the end, as the
+    // bitmap's header needs the size of them all
+    PngEncoder png_encoder = image.get_png_encoder(fd, num_threads);
+    std::vector<uint8_t> rle_rows;
+    if (format == kBitmapFormat) {
+        image.write_bitmap_header(fd);
+    } else if (format == kPngFormat) {
+        png_encoder.begin();
+    }
+    for (unsigned int index = 0; index < number_strips; index++) {
+        const unsigned int strip = (format == kPngFormat) ? (number_strips - 1 - index) : index;
+        Trace::Scope scope("draw_strip", "first_row", strip * strip_rows);
+        image.set_strip(strip * strip_rows);
+        image.set_background(kOceanColour);
+        image.draw_polygons(polygons, strips[strip], Transform(), true, kLandColour, true, kBorderColour, num_threads);
+        if (format == kBitmapFormat) {
+            image.write_bitmap_rows(fd);
+        } else if (format == kRleBitmapFormat) {
+            image.encode_rle_rows(rle_rows, num_threads);
+        } else {
+            image.write_png_rows(png_encoder);
+        }
+    }
+    if (format == kRleBitmapFormat) {
+        image.write_rle_bitmap(fd, rle_rows);
+    } else if (format == kPngFormat) {
+        png_encoder.end();
+    }
+}
+
+struct Tile {
+    unsigned int zoom;
+    unsigned int x;
+    unsigned int y;
+};
+
+// Render every tile from min_zoom to max_zoom into output_dir/z/x/y.bmp (or .png).
+// Tiles use the same longitude/latitude projection as the rest of map_gen. At zoom z there are
+// 2^(z+1) columns and 2^z rows of tiles, each covering 180/2^z degrees, with row 0 at the top.
+// Each tile is identical to running map_gen with the tile's bounds and a size of tile_size x tile_size.
+// The polygons are decoded once and shared by every thread, with each thread drawing whole tiles
+void generate_tiles(const std::string& output_dir, const std::vector<Polygon>& polygons, bool simplify,
+                    unsigned int min_zoom, unsigned int max_zoom, unsigned int tile_size, ImageFormat format,
+                    unsigned int num_threads) {
+    const std::string extension = (format == kPngFormat) ? ".png" : ".bmp";
+    MapRenderer renderer(polygons);
+    std::unique_ptr<LevelsOfDetail> levels_of_detail;
+    if (simplify) {
+        levels_of_detail.reset(new LevelsOfDetail(polygons, num_threads));
+        renderer.use_levels_of_detail(levels_of_detail.get());
+    }
+
+    // Create all the directories up front, and make a list of every tile to draw
+    std::vector<Tile> tiles;
+    make_directory(output_dir);
+    for (unsigned int zoom = min_zoom; zoom <= max_zoom; zoom++) {
+        const unsigned int columns = 2u << zoom;
+        const unsigned int rows = 1u << zoom;
+        make_directory(output_dir + "/" + std::to_string(zoom));
+        for (unsigned int x = 0; x < columns; x++) {
+            make_directory(output_dir + "/" + std::to_string(zoom) + "/" + std::to_string(x));
+            for (unsigned int y = 0; y < rows; y++) {
+                tiles.push_back({zoom, x, y});
+            }
+        }
+    }
+
+    std::atomic<size_t> next_tile(0);
+    std::vector<std::string> errors(num_threads);
+
+    auto draw_tiles = [&](unsigned int thread_index) {
+        // Each thread reuses the same image for all of its tiles
+        Image<uint8_t, 8> image(tile_size, tile_size);
+        set_palette(image, kDefaultPalette);
+        size_t tile_index;
+        while ((tile_index = next_tile++) < tiles.size()) {
+            const Tile& tile = tiles[tile_index];
+            const double tile_span = 180.0 / static_cast<double>(1u << tile.zoom);
+            const Viewport viewport = {-180.0 + (tile.x * tile_span), -180.0 + ((tile.x + 1) * tile_span),
+                                       90.0 - ((tile.y + 1) * tile_span), 90.0 - (tile.y * tile_span),
+                                       tile_size, tile_size};
+            const std::string filename = output_dir + "/" + std::to_string(tile.zoom) + "/" +
+                                         std::to_string(tile.x) + "/" + std::to_string(tile.y) + extension;
+            try {
+                Trace::Scope scope("draw_tile", "zoom", tile.zoom);
+                image.set_background(kOceanColour);
+                renderer.render(image, viewport, kLandColour, kBorderColour);
+                image.save_image_to_file(filename, format);
+            } catch (std::runtime_error& error) {
+                errors[thread_index] = error.what();
+                // Stop the other threads as well
+                next_tile = tiles.size();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < num_threads; i++) {
+        threads.emplace_back(draw_tiles, i);
+    }
+    draw_tiles(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const auto& error : errors) {
+        if (!error.empty()) throw std::runtime_error(error);
+    }
+}
+
+// A single image listed in a batch job file
+struct Job {
+    std::string output;
+    Viewport viewport;
+    Palette palette;
+};
+
+// Read a batch job file. Each line is "<output> <x_min> <x_max> <y_min> <y_max> <width> <height> [palette]",
+// which is a render request to the server (see map_server.hpp) with the file to write in place of the map.
+// Blank lines and lines starting with # are skipped
+std::vector<Job> read_jobs(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.good()) {
+        throw std::runtime_error("Failed to open file: \"" + path + "\"");
+    }
+    std::vector<Job> jobs;
+    std::string line;
+    for (size_t line_number = 1; std::getline(file, line); line_number++) {
+        std::istringstream request(line);
+        Job job;
+        if (!(request >> job.output) || job.output[0] == '#') continue;
+        try {
+            MapServer::read_view(request, job.viewport, job.palette);
+        } catch (std::runtime_error& error) {
+            throw std::runtime_error(path + " line " + std::to_string(line_number) + ": " + error.what());
+        }
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+// Draw every job in a batch. The polygons are decoded once and shared by every thread, with each thread
+// drawing whole jobs and applying each job's transform as it draws. The largest jobs are handed out first,
+// so the threads finish on small jobs rather than one thread being left with a large one
+void draw_jobs(const std::vector<Job>& jobs, const std::vector<Polygon>& polygons, bool simplify,
+               ImageFormat format, unsigned int num_threads) {
+    MapRenderer renderer(polygons);
+    std::unique_ptr<LevelsOfDetail> levels_of_detail;
+    if (simplify) {
+        levels_of_detail.reset(new LevelsOfDetail(polygons, num_threads));
+        renderer.use_levels_of_detail(levels_of_detail.get());
+    }
+
+    std::vector<size_t> order(jobs.size());
+    std::iota(order.begin(), order.end(), 0);
+    auto pixels = [&jobs](size_t job) {
+        return static_cast<uint64_t>(jobs[job].viewport.width) * jobs[job].viewport.height;
+    };
+    std::stable_sort(order.begin(), order.end(), [&pixels](size_t a, size_t b) { return pixels(a) > pixels(b); });
+
+    std::atomic<size_t> next_job(0);
+    std::vector<std::string> errors(num_threads);
+
+    auto draw = [&](unsigned int thread_index) {
+        size_t job_index;
+        while ((job_index = next_job++) < order.size()) {
+            const Job& job = jobs[order[job_index]];
+            try {
+                Trace::Scope scope("draw_job", "pixels", pixels(order[job_index]));
+                Image<uint8_t, 8> image(job.viewport.width, job.viewport.height);
+                set_palette(image, job.palette);
+                image.set_background(kOceanColour);
+                renderer.render(image, job.viewport, kLandColour, kBorderColour);
+                image.save_image_to_file(job.output, format);
+            } catch (std::runtime_error& error) {
+                errors[thread_index] = error.what();
+                // Stop the other threads as well
+                next_job = order.size();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < num_threads; i++) {
+        threads.emplace_back(draw, i);
+    }
+    draw(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const auto& error : errors) {
+        if (!error.empty()) throw std::runtime_error(error);
+    }
+}
+
+// Draw the viewport of the shapefile (or cache) into an image with BITS_PER_PIXEL bits per pixel,
+// and write it to stdout. Allows piping to a tool like imagemagick for resizing or converting to other file formats
+template <size_t BITS_PER_PIXEL>
+void draw_map(const Viewport& viewport, Shapefile& shapefile, GeometryCache& cache, bool use_cache, bool simplify,
+              bool stream, unsigned int memory_budget, bool reference_fill, ImageStorage storage, ImageFormat format,
+              unsigned int threads) {
+    const unsigned int width = viewport.width;
+    const unsigned int height = viewport.height;
+    const Transform transform = viewport.get_transform();
+
+    // Region of the map that could draw anything into the image
+    const Point view_min = viewport.get_region().first;
+    const Point view_max = viewport.get_region().second;
+
+    // When simplifying, use the coarsest level of detail whose error is under half a pixel. A cache has
+    // its points ranked already, so only reads the points kept at that level. Ranking the points of a
+    // shapefile takes longer than drawing them, so is only worth doing for a cache
+    if (simplify && !use_cache) {
+        throw std::runtime_error("--simplify needs a geometry cache to draw a single image, build one with --build-cache");
+    }
+    cache.use_level_of_detail(simplify ? LevelsOfDetail::get_level_for_pixel_size(viewport.get_pixel_size()) :
+                                         LevelsOfDetail::kOriginalLevel);
+
+    // With a memory budget, only hold the rows that fit in it and draw the image a strip at a time.
+    // Rows held as runs are counted as if every pixel was held, as their size depends on what is drawn,
+    // and blocks are counted without the rows and columns that round the strip up to whole blocks
+    unsigned int strip_rows = height;
+    if (memory_budget > 0) {
+        const size_t row_bytes = ((static_cast<size_t>(width) * BITS_PER_PIXEL) + 7) / 8;
+        const size_t budget_rows = (static_cast<size_t>(memory_budget) << 20) / row_bytes;
+        strip_rows = std::max<size_t>(1, std::min<size_t>(budget_rows, height));
+    }
+    if (stream && strip_rows < height) {
+        throw std::runtime_error("--stream can't be used with a --memory-budget that is smaller than the image");
+    }
+
+    // Create image, and set up colour table
+    Image<uint8_t, BITS_PER_PIXEL> image(width, height, strip_rows, storage);
+    set_palette(image, kDefaultPalette);
+
+    // Set background to blue
+    image.set_background(kOceanColour);
+    image.use_reference_fill(reference_fill);
+
+    if (stream) {
+        // Decode, shift, scale and draw one record at a time, so only a single
+        // record's polygons are held in memory. When drawing with multiple threads,
+        // polygons are collected into small batches which are then drawn in parallel
+        std::vector<Polygon> batch;
+        size_t batch_points = 0;
+        auto draw_visible = [&](Polygon& polygon, size_t) {
+            // Skip polygons outside the viewport before doing any work on them
+            if (!polygon.intersects(view_min, view_max)) return;
+            {
+                Stats::Timer timer(Stats::kTransform);
+                polygon.transform(transform);
+            }
+            image.clip_polygon(polygon);
+            if (threads <= 1) {
+                image.draw_polygon(polygon, true, kLandColour, true, kBorderColour);
+                return;
+            }
+            batch_points += polygon.outer.size();
+            for (const auto& inner : polygon.inner) batch_points += inner.size();
+            batch.push_back(std::move(polygon));
+            if (batch_points >= kStreamBatchPoints) {
+                image.draw_polygons(batch, true, kLandColour, true, kBorderColour, threads);
+                batch.clear();
+                batch_points = 0;
+            }
+        };
+        if (use_cache) {
+            cache.for_each_polygon(draw_visible);
+        } else {
+            shapefile.for_each_polygon(draw_visible);
+        }
+        image.draw_polygons(batch, true, kLandColour, true, kBorderColour, threads);
+    } else {
+        // Extract all the polygons from the shapefile
+        std::vector<Polygon> polygons;
+        if (use_cache) {
+            cache.get_polygons(polygons);
+        } else {
+            shapefile.get_polygons(polygons, threads);
+        }
+
+        // Only keep the polygons that are within the viewport, so the rest are never shifted, scaled or
+        // drawn. Kept in their original order. The viewport is only looked up once, so each bounding box
+        // is tested in turn rather than building a spatial index
+        {
+            Stats::Timer timer(Stats::kCull);
+            Trace::Scope scope("cull");
+            polygons.erase(std::remove_if(polygons.begin(), polygons.end(), [&](const Polygon& polygon) {
+                return !polygon.intersects(view_min, view_max);
+            }), polygons.end());
+        }
+
+        // Shift and scale the lat/lng polygons to match the image size, in a single pass,
+        // then drop the parts of them that are outside the image
+        {
+            Trace::Scope scope("transform", "polygons", polygons.size());
+            for (auto& polygon : polygons) {
+                {
+                    Stats::Timer timer(Stats::kTransform);
+                    polygon.transform(transform);
+                }
+                image.clip_polygon(polygon);
+            }
+        }
+
+        if (strip_rows < height) {
+            // Draws and writes the image to stdout a strip at a time
+            draw_strips(image, polygons, threads, format, STDOUT_FILENO);
+            return;
+        }
+
+        // Draw all the country boundaries
+        image.draw_polygons(polygons, true, kLandColour, true, kBorderColour, threads);
+    }
+
+    image.write_image(STDOUT_FILENO, format, threads);
+}
+
 int main(int argc, char **argv) {
 
     // Image defaults
@@ -55,6 +547,259 @@ int main(int argc, char **argv) {
     double x_max = 180.0;
     double y_min = -90.0;
     double y_max = 90.0;
+    unsigned int threads = 1;
+    bool threads_set = false;
+    bool reference_fill = false;
+    bool memory_map = true;
+    bool use_index = true;
+    bool stream = false;
+    unsigned int memory_budget = 0;
+    bool simplify = false;
+    std::string tiles_dir;
+    unsigned int tile_size = 256;
+    bool serve = false;
+    std::string socket_path;
+    std::string client_socket_path;
+    std::string cache_path;
+    bool lookup = false;
+    std::string trace_path;
+    ImageFormat format = kBitmapFormat;
+    unsigned int bits = 8;
+    ImageStorage storage = kPixelStorage;
+    std::string batch_path;
+
+    // Pull out any options, leaving just the positional arguments
+    std::vector<char*> args;
+    for (int i = 0; i < argc; i++) {
+        const std::string arg(argv[i]);
+        if (arg == "--threads" && (i + 1) < argc) {
+            threads = read_arg<int>(argv[++i], 0, 1024, "threads");
+            if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+            threads_set = true;
+        } else if (arg == "--reference-fill") {
+            reference_fill = true;
+        } else if (arg == "--no-mmap") {
+            memory_map = false;
+        } else if (arg == "--no-simd") {
+            Simd::set_level(Simd::kScalar);
+        } else if (arg == "--no-index") {
+            use_index = false;
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--memory-budget" && (i + 1) < argc) {
+            memory_budget = read_arg<int>(argv[++i], 1, 1 << 20, "memory_budget");
+        } else if (arg == "--stats") {
+            Stats::enable();
+        } else if (arg == "--trace" && (i + 1) < argc) {
+            trace_path = argv[++i];
+            Trace::enable();
+        } else if (arg == "--format" && (i + 1) < argc) {
+            const std::string name = argv[++i];
+            if (name == "bmp") {
+                format = kBitmapFormat;
+            } else if (name == "rle") {
+                format = kRleBitmapFormat;
+            } else if (name == "png") {
+                format = kPngFormat;
+            } else {
+                std::cerr << "Error: Unknown format " << name << std::endl;
+                print_help();
+                return 1;
+            }
+        } else if (arg == "--bits" && (i + 1) < argc) {
+            bits = read_arg<int>(argv[++i], 2, 8, "bits");
+            if (bits != 2 && bits != 4 && bits != 8) {
+                std::cerr << "Error: --bits must be 2, 4 or 8" << std::endl;
+                print_help();
+                return 1;
+            }
+        } else if (arg == "--run-storage") {
+            storage = kRunStorage;
+        } else if (arg == "--block-storage") {
+            storage = kBlockStorage;
+        } else if (arg == "--simplify") {
+            simplify = true;
+        } else if (arg == "--tiles" && (i + 1) < argc) {
+            tiles_dir = argv[++i];
+        } else if (arg == "--tile-size" && (i + 1) < argc) {
+            tile_size = read_arg<int>(argv[++i], 2, 4096, "tile_size");
+        } else if (arg == "--serve") {
+            serve = true;
+        } else if (arg == "--socket" && (i + 1) < argc) {
+            socket_path = argv[++i];
+        } else if (arg == "--client" && (i + 1) < argc) {
+            client_socket_path = argv[++i];
+        } else if (arg == "--batch" && (i + 1) < argc) {
+            batch_path = argv[++i];
+        } else if (arg == "--lookup") {
+            lookup = true;
+        } else if (arg == "--build-cache" && (i + 1) < argc) {
+            cache_path = argv[++i];
+        } else if (arg.compare(0, 2, "--") == 0) {
+            std::cerr << "Error: Unknown option " << arg << std::endl;
+            print_help();
+            return 1;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    argc = args.size();
+    argv = args.data();
+
+    if (bits != 8 && (serve || !batch_path.empty() || !tiles_dir.empty())) {
+        std::cerr << "Error: --bits can only be used when drawing a single image" << std::endl;
+        return 1;
+    }
+    if (storage != kPixelStorage && (serve || !batch_path.empty() || !tiles_dir.empty())) {
+        std::cerr << "Error: --run-storage and --block-storage can only be used when drawing a single image" << std::endl;
+        return 1;
+    }
+
+    if (!client_socket_path.empty()) {
+        if (argc < 2) {
+            print_help();
+            return 1;
+        }
+        std::string request_line = argv[1];
+        for (int i = 2; i < argc; i++) {
+            request_line += " " + std::string(argv[i]);
+        }
+        try {
+            MapServer::request(client_socket_path, request_line, STDOUT_FILENO);
+        } catch (std::exception& error) {
+            std::cerr << "Error: " << error.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!cache_path.empty()) {
+        if (argc != 2) {
+            print_help();
+            return 1;
+        }
+        try {
+            // Leave a cache that is already up to date alone. One written by an older
+            // version of map_gen can't be read, so is rebuilt
+            if (GeometryCache::is_cache_file(cache_path)) {
+                GeometryCache cache(cache_path);
+                bool up_to_date = false;
+                try {
+                    cache.read();
+                    up_to_date = cache.matches(argv[1]);
+                } catch (std::runtime_error&) {
+                }
+                if (up_to_date) {
+                    std::cerr << "Cache is up to date: " << cache_path << std::endl;
+                    return 0;
+                }
+            }
+            GeometryCache::build(argv[1], cache_path, memory_map, use_index);
+        } catch (std::runtime_error& error) {
+            std::cerr << "Error: " << error.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (lookup) {
+        if (argc != 2) {
+            print_help();
+            return 1;
+        }
+        try {
+            std::vector<Polygon> polygons;
+            std::vector<size_t> records;
+            load_polygons(argv[1], memory_map, use_index, polygons, records);
+            const PointLocator locator(polygons, records);
+            lookup_points(locator, threads);
+        } catch (std::runtime_error& error) {
+            std::cerr << "Error: " << error.what() << std::endl;
+            return 1;
+        }
+        write_reports(trace_path);
+        return 0;
+    }
+
+    if (serve) {
+        if (argc < 2) {
+            print_help();
+            return 1;
+        }
+        // Decode every map once up front. Each map's polygons must stay put
+        // while the server is running, so they are all decoded before it starts
+        std::vector<std::vector<Polygon>> maps(argc - 1);
+        std::vector<std::unique_ptr<LevelsOfDetail>> levels_of_detail;
+        MapServer server;
+        try {
+            for (int i = 1; i < argc; i++) {
+                load_polygons(argv[i], memory_map, use_index, threads, maps[i - 1]);
+            }
+            for (const auto& polygons : maps) {
+                if (simplify) {
+                    levels_of_detail.emplace_back(new LevelsOfDetail(polygons, threads));
+                    server.add_map(polygons, levels_of_detail.back().get());
+                } else {
+                    server.add_map(polygons);
+                }
+            }
+            if (socket_path.empty()) {
+                // Clients that hang up early should not take down the server
+                std::signal(SIGPIPE, SIG_IGN);
+                server.serve(STDIN_FILENO, STDOUT_FILENO);
+            } else {
+                // Answer a connection per core at once unless told otherwise
+                server.serve(socket_path, threads_set ? threads : std::max(1u, std::thread::hardware_concurrency()));
+            }
+        } catch (std::runtime_error& error) {
+            std::cerr << "Error: " << error.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!batch_path.empty()) {
+        if (argc != 2) {
+            print_help();
+            return 1;
+        }
+        // Jobs are independent, so use every core unless told otherwise
+        if (!threads_set) threads = std::max(1u, std::thread::hardware_concurrency());
+
+        try {
+            const std::vector<Job> jobs = read_jobs(batch_path);
+            std::vector<Polygon> polygons;
+            load_polygons(argv[1], memory_map, use_index, threads, polygons);
+            draw_jobs(jobs, polygons, simplify, format, threads);
+        } catch (std::runtime_error& error) {
+            std::cerr << "Error: " << error.what() << std::endl;
+            return 1;
+        }
+        write_reports(trace_path);
+        return 0;
+    }
+
+    if (!tiles_dir.empty()) {
+        if (argc != 4) {
+            print_help();
+            return 1;
+        }
+        const unsigned int min_zoom = read_arg<int>(argv[2], 0, 20, "min_zoom");
+        const unsigned int max_zoom = read_arg<int>(argv[3], min_zoom, 20, "max_zoom");
+        // Tiles are independent, so use every core unless told otherwise
+        if (!threads_set) threads = std::max(1u, std::thread::hardware_concurrency());
+
+        try {
+            std::vector<Polygon> polygons;
+            load_polygons(argv[1], memory_map, use_index, threads, polygons);
+            generate_tiles(tiles_dir, polygons, simplify, min_zoom, max_zoom, tile_size, format, threads);
+        } catch (std::runtime_error& error) {
+            std::cerr << "Error: " << error.what() << std::endl;
+            return 1;
+        }
+        write_reports(trace_path);
+        return 0;
+    }
 
     if (argc == 2) { // No image size specifed
         width = width_default;
@@ -93,51 +838,40 @@ int main(int argc, char **argv) {
         height = std::ceil(width * ((y_max - y_min) / (x_max - x_min)));
     }
 
-    // Open and parse the shapefile
+    // Open and parse the shapefile, or map the cache built from it
+    const bool use_cache = GeometryCache::is_cache_file(argv[1]);
     Shapefile shapefile(argv[1]);
+    shapefile.use_memory_map(memory_map);
+    shapefile.use_index_file(use_index);
+    GeometryCache cache(argv[1]);
     try {
-        shapefile.read();
+        if (use_cache) {
+            cache.read();
+        } else {
+            shapefile.read();
+        }
     } catch (std::runtime_error& error) {
         std::cerr << "Error: " << error.what() << std::endl;
         return 1;
     }
 
-    // Extract all the polygons from the shapefile
-    std::vector<Polygon> polygons;
-    shapefile.get_polygons(polygons);
-
-    double x_scale = static_cast<double>(width - 1) / (x_max - x_min);
-    double y_scale = static_cast<double>(height - 1) / (y_max - y_min);
-
-    double x_shift = -x_min;
-    double y_shift = -y_min;
-
-    // Shift and scale the lat/lng polygons to match the image size
-    for (auto& polygon : polygons) {
-        polygon.shift(x_shift, y_shift);
-        polygon.scale(x_scale, y_scale);
-    }
-
-    // Create image, and set up colour table
-    Image<uint8_t, 8> image(width, height);
-    image.set_colour(0, 0x8A,0xB4,0xF8);    // Blue
-    image.set_colour(1, 0x94,0xD2,0xA5);    // Green
-    image.set_colour(2, 0x6A,0x72,0x75);    // Grey
-    image.set_colour(3, 0x00,0x00,0x00);    // Black
-    image.set_colour(4, 0xFF,0xFF,0xFF);    // White
-
-    // Set background to blue
-    image.set_background(0);
-
-    // Draw all the country boundaries
-    for (auto& polygon : polygons) {
-        image.draw_polygon(polygon, true, 1, true, 2);
+    const Viewport viewport = {x_min, x_max, y_min, y_max, width, height};
+    try {
+        if (bits == 2) {
+            draw_map<2>(viewport, shapefile, cache, use_cache, simplify, stream, memory_budget, reference_fill, storage, format,
+                        threads);
+        } else if (bits == 4) {
+            draw_map<4>(viewport, shapefile, cache, use_cache, simplify, stream, memory_budget, reference_fill, storage, format,
+                        threads);
+        } else {
+            draw_map<8>(viewport, shapefile, cache, use_cache, simplify, stream, memory_budget, reference_fill, storage, format,
+                        threads);
+        }
+    } catch (std::runtime_error& error) {
+        std::cerr << "Error: " << error.what() << std::endl;
+        return 1;
     }
+    write_reports(trace_path);
 
-    // Output bitmap to stdout
-    // Allows piping to a tool like imagemagick for resizing
-    // or converting to other file formats
-    image.write_bitmap_image(std::cout);
-   
     return 0;
 }
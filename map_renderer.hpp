@@ -0,0 +1,126 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <stdexcept>
+#include "point.hpp"
+#include "polygon.hpp"
+#include "image.hpp"
+#include "spatial_index.hpp"
+#include "simplify.hpp"
+#include "stats.hpp"
+
+// Colour table entries used to draw maps
+const uint8_t kOceanColour = 0;
+const uint8_t kLandColour = 1;
+const uint8_t kBorderColour = 2;
+
+// Colour table used to draw maps, as 0xRRGGBB values
+typedef std::array<uint32_t, 5> Palette;
+const Palette kDefaultPalette = {{
+    0x8AB4F8,   // Blue
+    0x94D2A5,   // Green
+    0x6A7275,   // Grey
+    0x000000,   // Black
+    0xFFFFFF    // White
+}};
+
+// Images with fewer bits per pixel only get the colours that fit in their colour table
+template <size_t BITS_PER_PIXEL>
+void set_palette(Image<uint8_t, BITS_PER_PIXEL>& image, const Palette& palette) {
+    for (unsigned int index = 0; index < palette.size() && index < (1u << BITS_PER_PIXEL); index++) {
+        image.set_colour(index, (palette[index] >> 16) & 0xFF, (palette[index] >> 8) & 0xFF, palette[index] & 0xFF);
+    }
+}
+
+// Region of the map to draw, and the size of the image to draw it into
+struct Viewport {
+    double x_min;
+    double x_max;
+    double y_min;
+    double y_max;
+    unsigned int width;
+    unsigned int height;
+
+    // Shift and scale from map coordinates to pixels
+    Transform get_transform() const {
+        return Transform(-x_min, -y_min,
+                         static_cast<double>(width - 1) / (x_max - x_min),
+                         static_cast<double>(height - 1) / (y_max - y_min));
+    }
+
+    // Size of the smallest side of a pixel, in map units
+    double get_pixel_size() const {
+        return std::min((x_max - x_min) / static_cast<double>(width - 1),
+                        (y_max - y_min) / static_cast<double>(height - 1));
+    }
+
+    // Region of the map that could draw anything into the image. Includes a couple of
+    // pixels margin, as Image::draw_polygon makes the exact decision on what is visible
+    std::pair<Point, Point> get_region() const {
+        const Transform transform = get_transform();
+        return {Point({x_min - (2.0 / transform.x_scale), y_min - (2.0 / transform.y_scale)}),
+                Point({x_min + ((width + 2.0) / transform.x_scale), y_min + ((height + 2.0) / transform.y_scale)})};
+    }
+};
+
+// Draws viewports of a shared set of polygons. The polygons are never modified, and
+// are transformed as they are drawn, so one renderer can be used by many threads at once
+class MapRenderer {
+
+private:
+    const std::vector<Polygon>& polygons;
+    SpatialIndex index;
+    const LevelsOfDetail* levels_of_detail;
+
+public:
+    MapRenderer(const std::vector<Polygon>& map_polygons) :
+        polygons(map_polygons), index(map_polygons), levels_of_detail(nullptr) {  }
+
+    // Draw each viewport using the coarsest simplified copy of the polygons whose error
+    // is under half a pixel. The levels must have been built from this renderer's polygons
+    void use_levels_of_detail(const LevelsOfDetail* levels) {
+        levels_of_detail = levels;
+    }
+
+    // Draw the polygons that are within the viewport over the top of the image
+    template <class T, size_t BITS_PER_PIXEL>
+    void render(Image<T, BITS_PER_PIXEL>& image, const Viewport& viewport, T fill_colour, T border_colour) const {
+        if (image.get_width() != viewport.width || image.get_height() != viewport.height) {
+            throw std::runtime_error("Image size does not match the viewport");
+        }
+        const std::pair<Point, Point> region = viewport.get_region();
+        const Transform transform = viewport.get_transform();
+
+        const int level = LevelsOfDetail::get_level_for_pixel_size(viewport.get_pixel_size());
+
+        std::vector<size_t> visible;
+        index.query(region.first, region.second, visible);
+        // Polygons that reach well outside the image are clipped to the region in map coordinates first,
+        // only copying out the points that are kept, so drawing them only works on the edges that are
+        // visible. The rest are drawn as they are
+        Polygon clipped;
+        for (size_t polygon_index : visible) {
+            const Polygon& polygon = (levels_of_detail == nullptr) ?
+                                     polygons[polygon_index] : levels_of_detail->get_polygon(polygon_index, level);
+            const std::pair<Point, Point> box = transform.apply(polygon.bounding_box);
+            if (box.first.x >= -1.0 && box.first.y >= -1.0 && box.second.x <= viewport.width && box.second.y <= viewport.height) {
+                image.draw_polygon(polygon, transform, true, fill_colour, true, border_colour);
+                continue;
+            }
+            {
+                Stats::Timer timer(Stats::kClip);
+                polygon.clip(region.first, region.second, clipped);
+                size_t points = polygon.outer.size() - clipped.outer.size();
+                for (size_t ring = 0; ring < polygon.inner.size(); ring++) {
+                    points += polygon.inner[ring].size() - clipped.inner[ring].size();
+                }
+                Stats::add(Stats::kPointsClipped, points);
+            }
+            image.draw_polygon(clipped, transform, true, fill_colour, true, border_colour);
+        }
+    }
+
+    const std::vector<Polygon>& get_polygons() const { return polygons; }
+    const SpatialIndex& get_index() const { return index; }
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>       // unique_ptr
+#include <sstream>
+#include <thread>
+#include <stdexcept>
+#include <cmath>        // ceil
+#include <cerrno>
+#include <cstring>      // strncpy
+#include <csignal>      // signal
+#include <unistd.h>     // read, write, close, unlink
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "polygon.hpp"
+#include "image.hpp"
+#include "map_renderer.hpp"
+
+// Serves render requests for one or more maps that are loaded once up front.
+//
+// Requests are single lines of text:
+//     render <map> <x_min> <x_max> <y_min> <y_max> <width> <height> [palette]
+//     quit
+// <map> is the index of the map in the order they were loaded. A <height> of 0 keeps the
+// aspect ratio of the map. [palette] is a comma separated list of up to 5 RRGGBB colours,
+// which replace the default ocean, land, border, black and white colours in order.
+//
+// Each render is answered with "OK <length>\n" followed by <length> bytes of bitmap,
+// or "ERROR <message>\n" if the request could not be drawn.
+class MapServer {
+
+private:
+    static const unsigned int kMaxImageSize = 50000;
+
+    std::vector<std::unique_ptr<MapRenderer>> renderers;
+
+    static bool _write_all(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    // Read the next line from fd, using buffer to hold data read past the end of the line.
+    // Returns false once there are no more lines
+    static bool _read_line(int fd, std::string& buffer, std::string& line) {
+        size_t end;
+        while ((end = buffer.find('\n')) == std::string::npos) {
+            char data[4096];
+            ssize_t length = read(fd, data, sizeof(data));
+            if (length < 0 && errno == EINTR) continue;
+            if (length <= 0) {
+                // Allow the last line to be missing its new line
+                if (buffer.empty()) return false;
+                line.swap(buffer);
+                buffer.clear();
+                return true;
+            }
+            buffer.append(data, length);
+        }
+        line = buffer.substr(0, end);
+        buffer.erase(0, end + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        return true;
+    }
+
+    static double _read_number(std::istringstream& request, const std::string& name) {
+        std::string token;
+        if (!(request >> token)) throw std::runtime_error("Missing " + name);
+        try {
+            size_t length;
+            double val = std::stod(token, &length);
+            if (length != token.size()) throw std::invalid_argument(token);
+            return val;
+        } catch (std::logic_error&) {
+            throw std::runtime_error("Invalid " + name + ": " + token);
+        }
+    }
+
+    static Palette _read_palette(const std::string& text) {
+        Palette palette = kDefaultPalette;
+        std::istringstream colours(text);
+        std::string colour;
+        unsigned int index = 0;
+        while (std::getline(colours, colour, ',')) {
+            if (index >= palette.size()) throw std::runtime_error("Too many palette colours");
+            if (colour.size() != 6 || colour.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+                throw std::runtime_error("Invalid palette colour: " + colour);
+            }
+            palette[index++] = std::stoul(colour, nullptr, 16);
+        }
+        return palette;
+    }
+
+    // Draw the map described by a render request
+    std::unique_ptr<Image<uint8_t, 8>> _render(std::istringstream& request) const {
+        const double map = _read_number(request, "map");
+        if (map < 0 || map >= renderers.size() || map != std::floor(map)) {
+            throw std::runtime_error("Unknown map");
+        }
+        Viewport viewport;
+        Palette palette;
+        read_view(request, viewport, palette);
+
+        std::unique_ptr<Image<uint8_t, 8>> image(new Image<uint8_t, 8>(viewport.width, viewport.height));
+        set_palette(*image, palette);
+        image->set_background(kOceanColour);
+        renderers[static_cast<size_t>(map)]->render(*image, viewport, kLandColour, kBorderColour);
+        return image;
+    }
+
+public:
+    // Read "<x_min> <x_max> <y_min> <y_max> <width> <height> [palette]" from the rest of a request,
+    // as described above. Also used for the lines of a batch job file
+    static void read_view(std::istringstream& request, Viewport& viewport, Palette& palette) {
+        viewport.x_min = _read_number(request, "x_min");
+        viewport.x_max = _read_number(request, "x_max");
+        viewport.y_min = _read_number(request, "y_min");
+        viewport.y_max = _read_number(request, "y_max");
+        const double width = _read_number(request, "width");
+        double height = _read_number(request, "height");
+        if (!(viewport.x_min < viewport.x_max) || !(viewport.y_min < viewport.y_max)) {
+            throw std::runtime_error("x/y_min is greater or equal to x/y_max");
+        }
+        if (height == 0) {
+            height = std::ceil(width * ((viewport.y_max - viewport.y_min) / (viewport.x_max - viewport.x_min)));
+        }
+        if (!(width >= 1 && width <= kMaxImageSize && height >= 1 && height <= kMaxImageSize)) {
+            throw std::runtime_error("Image size must be between 1 and " + std::to_string(kMaxImageSize));
+        }
+        viewport.width = width;
+        viewport.height = height;
+
+        std::string palette_text;
+        palette = kDefaultPalette;
+        if (request >> palette_text) palette = _read_palette(palette_text);
+        std::string extra;
+        if (request >> extra) throw std::runtime_error("Unexpected argument: " + extra);
+    }
+
+    // The server keeps a reference to each map's polygons (and levels of detail), so they must outlive it
+    void add_map(const std::vector<Polygon>& polygons, const LevelsOfDetail* levels_of_detail = nullptr) {
+        renderers.emplace_back(new MapRenderer(polygons));
+        renderers.back()->use_levels_of_detail(levels_of_detail);
+    }
+
+    size_t get_number_of_maps() const { return renderers.size(); }
+
+    // Answer requests read from in_fd until the end of the input or a quit request
+    void serve(int in_fd, int out_fd) const {
+        std::string buffer;
+        std::string line;
+        while (_read_line(in_fd, buffer, line)) {
+            std::istringstream request(line);
+            std::string command;
+            if (!(request >> command)) continue;
+
+            std::string response;
+            if (command == "quit") {
+                break;
+            } else if (command == "render") {
+                std::unique_ptr<Image<uint8_t, 8>> image;
+                try {
+                    image = _render(request);
+                } catch (std::exception& error) {
+                    response = "ERROR " + std::string(error.what()) + "\n";
+                }
+                if (image) {
+                    // Send the length, then write the bitmap straight from the image
+                    response = "OK " + std::to_string(image->get_bitmap_size()) + "\n";
+                    if (!_write_all(out_fd, response.data(), response.size())) break;
+                    try {
+                        image->write_bitmap_image(out_fd);
+                    } catch (std::runtime_error&) {
+                        break;
+                    }
+                    continue;
+                }
+            } else {
+                response = "ERROR Unknown command: " + command + "\n";
+            }
+            if (!_write_all(out_fd, response.data(), response.size())) break;
+        }
+    }
+
+    // Listen on a Unix domain socket, answering up to num_workers connections at once, each on its own
+    // thread. Every image being drawn holds its own pixels, so the workers are fixed up front, and any more
+    // clients wait to be accepted until a worker is free. Never returns, but throws if accepting fails
+    void serve(const std::string& socket_path, unsigned int num_workers) const {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) throw std::runtime_error("Socket path is too long");
+        std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server_fd < 0) throw std::runtime_error("Failed to create socket");
+        // Remove any socket left behind by a previous server
+        unlink(socket_path.c_str());
+        if (bind(server_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(server_fd, 64) != 0) {
+            close(server_fd);
+            throw std::runtime_error("Failed to listen on socket: \"" + socket_path + "\"");
+        }
+        // Clients that hang up early should not take down the server
+        std::signal(SIGPIPE, SIG_IGN);
+
+        // Each worker waits in accept for its next connection, and answers it before accepting another
+        auto answer_connections = [this, server_fd]() {
+            while (true) {
+                int client_fd = accept(server_fd, nullptr, nullptr);
+                if (client_fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    // Stop the other workers too, once they have answered their connections
+                    shutdown(server_fd, SHUT_RDWR);
+                    return;
+                }
+                serve(client_fd, client_fd);
+                close(client_fd);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (unsigned int i = 1; i < num_workers; i++) {
+            workers.emplace_back(answer_connections);
+        }
+        answer_connections();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        close(server_fd);
+        throw std::runtime_error("Failed to accept connection");
+    }
+
+    // Send a single request to a server listening on socket_path,
+    // and write the bitmap that comes back to out_fd
+    static void request(const std::string& socket_path, const std::string& request_line, int out_fd) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) throw std::runtime_error("Socket path is too long");
+        std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) throw std::runtime_error("Failed to create socket");
+        if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to connect to: \"" + socket_path + "\"");
+        }
+        const std::string line = request_line + "\n";
+        std::string buffer;
+        std::string response;
+        if (!_write_all(fd, line.data(), line.size()) || !_read_line(fd, buffer, response)) {
+            close(fd);
+            throw std::runtime_error("No response from server");
+        }
+        if (response.compare(0, 3, "OK ") != 0) {
+            close(fd);
+            throw std::runtime_error(response.compare(0, 6, "ERROR ") == 0 ? response.substr(6) : response);
+        }
+        size_t remaining = std::stoull(response.substr(3));
+        // Some of the bitmap may already have been read along with the response line
+        const size_t buffered = std::min(remaining, buffer.size());
+        bool good = _write_all(out_fd, buffer.data(), buffered);
+        remaining -= buffered;
+        while (good && remaining > 0) {
+            char data[65536];
+            ssize_t length = read(fd, data, std::min(remaining, sizeof(data)));
+            if (length < 0 && errno == EINTR) continue;
+            if (length <= 0) break;
+            good = _write_all(out_fd, data, length);
+            remaining -= length;
+        }
+        close(fd);
+        if (!good || remaining > 0) throw std::runtime_error("Incomplete response from server");
+    }
+};
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstring>      // memcpy
+#include <algorithm>    // min, max
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include "deflate.hpp"
+
+// Writes palette (indexed colour) PNG files, with no dependencies beyond Deflate.
+//
+// Rows are added from the top of the image down, a batch at a time, so an image drawn a strip
+// at a time never has to be held in memory at once. Each batch is split into groups of rows that
+// are compressed on separate threads, with each group able to match the 32 KB before it, and written
+// as its own IDAT chunk. Every row is written unfiltered, as the repeats in a map (long runs of one
+// colour, and rows much like the row above) are found just as well without filtering
+class PngEncoder {
+
+public:
+    // Called with each piece of the file in order
+    typedef std::function<void(const uint8_t* data, size_t size)> Write;
+
+private:
+    // Aim for groups of rows of about this many bytes, so each thread has enough to work on
+    static const size_t kGroupBytes = 256 * 1024;
+    static const size_t kWindowSize = 32768;
+
+    uint32_t width;
+    uint32_t height;
+    unsigned int bit_depth;
+    std::vector<uint32_t> palette;
+    unsigned int num_threads;
+    Write write;
+    size_t row_bytes;
+    uint32_t rows_added;
+    uint32_t adler;
+    // The last 32 KB of the previous batch, which the next batch can refer back to
+    std::vector<uint8_t> window;
+
+    static const std::array<uint32_t, 256>& _crc_table() {
+        static const std::array<uint32_t, 256> table = []() {
+            std::array<uint32_t, 256> crc_table;
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (unsigned int bit = 0; bit < 8; bit++) {
+                    c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+                }
+                crc_table[n] = c;
+            }
+            return crc_table;
+        }();
+        return table;
+    }
+
+    static uint32_t _crc32(uint32_t crc, const uint8_t* data, size_t length) {
+        const std::array<uint32_t, 256>& table = _crc_table();
+        crc = ~crc;
+        for (size_t index = 0; index < length; index++) {
+            crc = table[(crc ^ data[index]) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    static void _put_big_endian(std::vector<uint8_t>& out, uint32_t val) {
+        const uint8_t bytes[4] = {static_cast<uint8_t>(val >> 24), static_cast<uint8_t>(val >> 16),
+                                  static_cast<uint8_t>(val >> 8), static_cast<uint8_t>(val)};
+        out.insert(out.end(), bytes, bytes + 4);
+    }
+
+    // Wrap data up as a chunk (length, type, data, CRC of the type and data) and append it to out
+    static void _put_chunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size) {
+        _put_big_endian(out, static_cast<uint32_t>(size));
+        const size_t type_start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data, data + size);
+        _put_big_endian(out, _crc32(0, out.data() + type_start, size + 4));
+    }
+
+    // Run work(0) to work(count - 1) across the threads
+    void _parallel_for(size_t count, const std::function<void(size_t)>& work) const {
+        const size_t number_threads = std::min<size_t>(num_threads, count);
+        if (number_threads <= 1) {
+            for (size_t index = 0; index < count; index++) work(index);
+            return;
+        }
+        auto run = [&](size_t first) {
+            for (size_t index = first; index < count; index += number_threads) work(index);
+        };
+        std::vector<std::thread> threads;
+        for (size_t thread = 1; thread < number_threads; thread++) {
+            threads.emplace_back(run, thread);
+        }
+        run(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+public:
+    // palette holds 0xRRGGBB colours, and must have at most 2^bit_depth entries
+    PngEncoder(uint32_t image_width, uint32_t image_height, unsigned int image_bit_depth,
+               const std::vector<uint32_t>& image_palette, unsigned int threads, const Write& write_function) :
+        width(image_width),
+        height(image_height),
+        bit_depth(image_bit_depth),
+        palette(image_palette),
+        num_threads(std::max(1u, threads)),
+        write(write_function),
+        row_bytes(((static_cast<size_t>(image_width) * image_bit_depth) + 7) / 8),
+        rows_added(0),
+        adler(1) {
+        if (bit_depth != 1 && bit_depth != 2 && bit_depth != 4 && bit_depth != 8) {
+            throw std::runtime_error("PNG bit depth must be 1, 2, 4, or 8");
+        }
+        if (palette.empty() || palette.size() > (1u << bit_depth)) {
+            throw std::runtime_error("PNG palette must have between 1 and " + std::to_string(1u << bit_depth) + " colours");
+        }
+    }
+
+    // Write the signature, image header and palette, along with the start of the compressed data
+    void begin() {
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        std::vector<uint8_t> out(signature, signature + sizeof(signature));
+
+        std::vector<uint8_t> header;
+        _put_big_endian(header, width);
+        _put_big_endian(header, height);
+        header.push_back(bit_depth);
+        header.push_back(3);    // Indexed colour
+        header.push_back(0);    // Deflate compression
+        header.push_back(0);    // Adaptive filtering
+        header.push_back(0);    // No interlace
+        _put_chunk(out, "IHDR", header.data(), header.size());
+
+        std::vector<uint8_t> colours;
+        for (uint32_t colour : palette) {
+            colours.push_back((colour >> 16) & 0xFF);
+            colours.push_back((colour >> 8) & 0xFF);
+            colours.push_back(colour & 0xFF);
+        }
+        _put_chunk(out, "PLTE", colours.data(), colours.size());
+
+        // zlib header: deflate with a 32 KB window, no preset dictionary
+        const uint8_t zlib_header[2] = {0x78, 0x01};
+        _put_chunk(out, "IDAT", zlib_header, sizeof(zlib_header));
+        write(out.data(), out.size());
+    }
+
+    // Compress and write the next count rows down the image, where row(index) returns the
+    // packed pixels of the index'th of these rows (bytes as laid out in a PNG row)
+    template <class GetRow>
+    void add_rows(size_t count, GetRow row) {
+        const size_t size = row_bytes;
+        add_expanded_rows(count, [&row, size](size_t index, uint8_t* out) {
+            std::memcpy(out, row(index), size);
+        });
+    }
+
+    // As add_rows, for images that don't hold their rows the way a PNG lays them out. expand_row(index, out)
+    // writes the packed pixels of the index'th row to out. Rows are expanded on several threads at once
+    template <class ExpandRow>
+    void add_expanded_rows(size_t count, ExpandRow expand_row) {
+        if (count > height - rows_added) throw std::runtime_error("Too many rows added to PNG");
+        const size_t stride = row_bytes + 1;    // Each row starts with its filter type
+        const size_t group_rows = std::max<size_t>(1, kGroupBytes / stride);
+        const size_t batch_rows = group_rows * num_threads;
+
+        std::vector<uint8_t> data;
+        std::vector<std::vector<uint8_t>> chunks(num_threads);
+        std::vector<uint32_t> group_adler(num_threads);
+        for (size_t batch_start = 0; batch_start < count; batch_start += batch_rows) {
+            const size_t rows = std::min(batch_rows, count - batch_start);
+            const size_t number_groups = (rows + group_rows - 1) / group_rows;
+
+            // The window from the last batch, followed by this batch's rows
+            data.assign(window.begin(), window.end());
+            const size_t rows_start = data.size();
+            data.resize(rows_start + (rows * stride));
+            _parallel_for(number_groups, [&](size_t group) {
+                const size_t last_row = std::min(rows, (group + 1) * group_rows);
+                for (size_t index = group * group_rows; index < last_row; index++) {
+                    uint8_t* out = data.data() + rows_start + (index * stride);
+                    out[0] = 0;     // No filter
+                    expand_row(batch_start + index, out + 1);
+                }
+            });
+
+            _parallel_for(number_groups, [&](size_t group) {
+                const size_t start = rows_start + (group * group_rows * stride);
+                const size_t end = rows_start + (std::min(rows, (group + 1) * group_rows) * stride);
+                std::vector<uint8_t> compressed;
+                Deflate deflate;
+                deflate.compress(data.data(), start, end, compressed);
+                group_adler[group] = Deflate::adler32(1, data.data() + start, end - start);
+                chunks[group].clear();
+                _put_chunk(chunks[group], "IDAT", compressed.data(), compressed.size());
+            });
+
+            for (size_t group = 0; group < number_groups; group++) {
+                const size_t group_size = (std::min(rows, (group + 1) * group_rows) - (group * group_rows)) * stride;
+                adler = Deflate::adler32_combine(adler, group_adler[group], group_size);
+                write(chunks[group].data(), chunks[group].size());
+            }
+            const size_t keep = std::min(kWindowSize, data.size());
+            window.assign(data.end() - keep, data.end());
+        }
+        rows_added += count;
+    }
+
+    // Write the end of the compressed data, and the end of the file
+    void end() {
+        if (rows_added != height) throw std::runtime_error("PNG is missing rows");
+        std::vector<uint8_t> last;
+        Deflate::finish(last);
+        _put_big_endian(last, adler);
+        std::vector<uint8_t> out;
+        _put_chunk(out, "IDAT", last.data(), last.size());
+        _put_chunk(out, "IEND", nullptr, 0);
+        write(out.data(), out.size());
+    }
+};
@@ -1,4 +1,5 @@
 #pragma once
+#include <utility>    // pair
 
 struct Point {
     double x;
@@ -14,6 +15,25 @@ struct Point {
     }
 };
 
+// Shift followed by scale, applied to points as they are used rather than
+// modifying them. Gives exactly the same result as Point::shift then Point::scale
+struct Transform {
+    double x_shift;
+    double y_shift;
+    double x_scale;
+    double y_scale;
+    Transform() : x_shift(0.0), y_shift(0.0), x_scale(1.0), y_scale(1.0) {  }
+    Transform(double x_shift, double y_shift, double x_scale, double y_scale) :
+        x_shift(x_shift), y_shift(y_shift), x_scale(x_scale), y_scale(y_scale) {  }
+
+    inline Point apply(const Point& p) const {
+        return Point({(p.x + x_shift) * x_scale, (p.y + y_shift) * y_scale});
+    }
+    inline std::pair<Point, Point> apply(const std::pair<Point, Point>& box) const {
+        return {apply(box.first), apply(box.second)};
+    }
+};
+
 bool operator< (const Point& a, const Point& b) {
     if (a.x < b.x) {
         return true;
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include "point.hpp"
+#include "simd.hpp"
+#include "polygon.hpp"
+#include "prepared_polygon.hpp"
+#include "spatial_index.hpp"
+
+// Finds the record (e.g. the country) that contains each of a batch of points.
+//
+// Built once from the polygons of a shapefile along with the record each came from.
+// A spatial index over the polygons' bounding boxes narrows each point down to a few
+// candidates, and each candidate is a PreparedPolygon, so only the few edges close
+// to the point are checked. Lookups never modify the locator, so any number of
+// threads can use it at once
+class PointLocator {
+
+private:
+
+    // Number of points handed to a thread at a time when looking up a batch
+    static const size_t kBlockSize = 4096;
+    // Number of rows and columns in the grid used to put a batch of points in order
+    static const uint32_t kOrderGridSize = 256;
+
+    std::vector<PreparedPolygon> prepared;
+    std::vector<size_t> records;
+    SpatialIndex index;
+
+    // Indices of the points sorted by the cell of a kOrderGridSize x kOrderGridSize grid over
+    // their bounding box, with the cells in row order and the points in each cell in their original order
+    static std::vector<uint32_t> _get_order(const std::vector<Point>& points) {
+        const std::pair<Point, Point> box = Simd::bounding_box(points.data(), points.size());
+        const double x_scale = kOrderGridSize / std::max(box.second.x - box.first.x, 1e-300);
+        const double y_scale = kOrderGridSize / std::max(box.second.y - box.first.y, 1e-300);
+        std::vector<uint32_t> cells(points.size());
+        std::vector<uint32_t> cell_start((kOrderGridSize * kOrderGridSize) + 1, 0);
+        for (size_t index = 0; index < points.size(); index++) {
+            // Clamp rather than trust NaNs and the far edge of the box to land in the grid
+            const double column = (points[index].x - box.first.x) * x_scale;
+            const double row = (points[index].y - box.first.y) * y_scale;
+            const uint32_t x = (column > 0.0) ? std::min<uint32_t>(kOrderGridSize - 1, column) : 0;
+            const uint32_t y = (row > 0.0) ? std::min<uint32_t>(kOrderGridSize - 1, row) : 0;
+            cells[index] = (y * kOrderGridSize) + x;
+            cell_start[cells[index] + 1]++;
+        }
+        for (size_t cell = 0; cell < (kOrderGridSize * kOrderGridSize); cell++) {
+            cell_start[cell + 1] += cell_start[cell];
+        }
+        std::vector<uint32_t> order(points.size());
+        for (size_t index = 0; index < points.size(); index++) {
+            order[cell_start[cells[index]]++] = index;
+        }
+        return order;
+    }
+
+public:
+    // Returned for points that are not inside any polygon
+    static const int64_t kNotFound = -1;
+
+    // records[i] is the record that polygons[i] came from. The locator keeps
+    // references to the polygons' points, so the polygons must outlive it
+    PointLocator(const std::vector<Polygon>& polygons, const std::vector<size_t>& polygon_records) :
+        records(polygon_records), index(polygons) {
+        if (polygons.size() != polygon_records.size()) {
+            throw std::runtime_error("Every polygon needs a record number");
+        }
+        prepared.reserve(polygons.size());
+        for (const auto& polygon : polygons) {
+            prepared.emplace_back(polygon);
+        }
+    }
+
+    // Record containing the point, or kNotFound. When polygons overlap,
+    // the first polygon in file order that contains the point wins
+    int64_t find(const Point& p) const {
+        size_t found = prepared.size();
+        index.visit(p, p, [&](size_t polygon_index) {
+            if (polygon_index < found && prepared[polygon_index].contains(p)) found = polygon_index;
+        });
+        return (found == prepared.size()) ? kNotFound : static_cast<int64_t>(records[found]);
+    }
+
+    // Look up every point, spreading blocks of points across num_threads threads.
+    // Points are looked up in order of a coarse grid over the batch rather than in the order
+    // given, so that points near each other share the same polygons and edges while they are in cache
+    void find(const std::vector<Point>& points, std::vector<int64_t>& results, unsigned int num_threads) const {
+        const std::vector<uint32_t> order = _get_order(points);
+        std::vector<Point> sorted_points(points.size());
+        for (size_t position = 0; position < points.size(); position++) {
+            sorted_points[position] = points[order[position]];
+        }
+        std::vector<int64_t> sorted_results(points.size());
+        const size_t number_blocks = (points.size() + kBlockSize - 1) / kBlockSize;
+        std::atomic<size_t> next_block(0);
+
+        auto find_blocks = [&]() {
+            size_t block;
+            while ((block = next_block++) < number_blocks) {
+                const size_t last = std::min(points.size(), (block + 1) * kBlockSize);
+                for (size_t position = block * kBlockSize; position < last; position++) {
+                    sorted_results[position] = find(sorted_points[position]);
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < num_threads && i < number_blocks; i++) {
+            threads.emplace_back(find_blocks);
+        }
+        find_blocks();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        results.resize(points.size());
+        for (size_t position = 0; position < points.size(); position++) {
+            results[order[position]] = sorted_results[position];
+        }
+    }
+};
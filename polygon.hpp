@@ -3,6 +3,7 @@
 #include <algorithm>    // min_element
 #include <limits>       // numeric_limits
 #include "point.hpp"
+#include "simd.hpp"
 
 struct Polygon {
     std::vector<Point> outer;
@@ -14,6 +15,11 @@ struct Polygon {
     inline double min_x() const {return bounding_box.first.x;}
     inline double min_y() const {return bounding_box.first.y;}
 
+    // Check if the bounding box overlaps the region min to max
+    inline bool intersects(const Point& min, const Point& max) const {
+        return !(max_x() < min.x || max_y() < min.y || min_x() > max.x || min_y() > max.y);
+    }
+
     void shift(double x_shift, double y_shift) {
         bounding_box.first.shift(x_shift,y_shift);
         bounding_box.second.shift(x_shift,y_shift);
@@ -40,6 +46,38 @@ struct Polygon {
         }
     }
 
+    // Shift then scale in a single pass. Gives exactly the same result as shift followed by scale
+    void transform(const Transform& transform) {
+        bounding_box = transform.apply(bounding_box);
+        Simd::transform(outer.data(), outer.data(), outer.size(), transform);
+        for (auto& inner_poly : inner) {
+            Simd::transform(inner_poly.data(), inner_poly.data(), inner_poly.size(), transform);
+        }
+    }
+
+    // Drop the points of each ring that make no difference to drawing inside the region min to max.
+    // A run of points that all lie past the same side of the region is replaced by a single edge
+    // joining its first and last points, which stays past that side. Each row then crosses the same
+    // number of edges inside the region, and the same number (give or take a pair) past that side, so
+    // a scanline fill inside the region is unchanged. The bounding box is left as it was
+    void clip(const Point& min, const Point& max) {
+        _clip_ring(outer, min, max);
+        for (auto& inner_poly : inner) {
+            _clip_ring(inner_poly, min, max);
+        }
+    }
+
+    // Clip into another polygon, leaving this one alone. Only the points kept are copied, and
+    // clipped's rings are reused, so clipping many polygons into the same one rarely allocates
+    void clip(const Point& min, const Point& max, Polygon& clipped) const {
+        clipped.bounding_box = bounding_box;
+        _clip_ring(outer, min, max, clipped.outer);
+        clipped.inner.resize(inner.size());
+        for (size_t index = 0; index < inner.size(); index++) {
+            _clip_ring(inner[index], min, max, clipped.inner[index]);
+        }
+    }
+
     bool contains(const Point& p) const {
         // If point is within inner boundary, then it is 
         // not within the polygon
@@ -100,25 +138,57 @@ struct Polygon {
     static std::pair<Point, Point> get_bounding_box(std::vector<Point>::const_iterator start,
                                                   std::vector<Point>::const_iterator stop) {
 
-        // Make min the maximum possible value, and max the min possible value
-        Point min({std::numeric_limits<double>().max(), std::numeric_limits<double>().max()});
-        Point max({std::numeric_limits<double>().lowest(), std::numeric_limits<double>().lowest()});
-
-        auto it = start;
-        while (it != stop) {
-            if (it->y < min.y) min.y = it->y;
-            if (it->x < min.x) min.x = it->x;
-            if (it->y > max.y) max.y = it->y;
-            if (it->x > max.x) max.x = it->x;
-            it++;
-        }
-        return {min,max};
+        // An empty range gives a box from the maximum possible value to the minimum possible value
+        return Simd::bounding_box((start == stop) ? nullptr : &*start, stop - start);
     }
     static std::pair<Point, Point> get_bounding_box(std::vector<Point>& points) {
         return get_bounding_box(points.begin(), points.end());
     }
 
 private:
+    // Which sides of the region min to max the point is past, one bit for each side
+    static inline unsigned int _outcode(const Point& p, const Point& min, const Point& max) {
+        return ((p.x < min.x) ? 1 : 0) | ((p.x > max.x) ? 2 : 0) | ((p.y < min.y) ? 4 : 0) | ((p.y > max.y) ? 8 : 0);
+    }
+
+    // Call keep(index) for each point of the ring that clipping keeps, in order. The first and last
+    // points are always kept. run holds the sides that every point since the last one kept is past,
+    // so a point can be dropped when it and the point after it are past one of those sides as well
+    template <class Keep>
+    static void _for_each_kept(const std::vector<Point>& ring, const Point& min, const Point& max, Keep keep) {
+        if (ring.size() < 3) {
+            for (size_t index = 0; index < ring.size(); index++) keep(index);
+            return;
+        }
+        keep(0);
+        unsigned int run = _outcode(ring[0], min, max);
+        unsigned int next = _outcode(ring[1], min, max);
+        for (size_t index = 1; index + 1 < ring.size(); index++) {
+            const unsigned int code = next;
+            next = _outcode(ring[index + 1], min, max);
+            if ((run & code & next) != 0) {
+                run &= code;
+                continue;
+            }
+            keep(index);
+            run = code;
+        }
+        keep(ring.size() - 1);
+    }
+
+    // Points are copied down over the dropped ones
+    static void _clip_ring(std::vector<Point>& ring, const Point& min, const Point& max) {
+        size_t kept = 0;
+        _for_each_kept(ring, min, max, [&](size_t index) { ring[kept++] = ring[index]; });
+        ring.resize(kept);
+    }
+
+    static void _clip_ring(const std::vector<Point>& ring, const Point& min, const Point& max,
+                           std::vector<Point>& clipped) {
+        clipped.clear();
+        _for_each_kept(ring, min, max, [&](size_t index) { clipped.push_back(ring[index]); });
+    }
+
     static bool _intersects(const Point& a, const Point& b, const Point& p) {
 
         double kEpsilon = static_cast<double>(std::numeric_limits<float>().epsilon());
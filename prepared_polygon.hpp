@@ -0,0 +1,277 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>    // min, max
+#include <cmath>        // floor, ceil, sqrt
+#include "point.hpp"
+#include "polygon.hpp"
+
+// A ring set up for answering many point in ring questions.
+//
+// Unlike Polygon::contains, points exactly on an edge are reported as such rather than
+// given an arbitrary answer. The ring's bounding box is split into a grid of cells, each
+// holding the edges that touch it, along with whether the centre of the cell is inside the ring.
+// A point is then located by only checking the edges in its own cell: the path from the point
+// across to the cell's centre column, then along it to the centre, crosses the ring an even
+// number of times if the point and the centre are on the same side. Points whose path can't be
+// checked this way (such as a path through a vertex of the ring) fall back to a full scan
+class PreparedRing {
+
+public:
+    enum Location {
+        kOutside = 0,
+        kInside = 1,
+        kBoundary = 2
+    };
+
+private:
+
+    // Rings with fewer edges than this are just scanned from start to finish
+    static const size_t kMinIndexedEdges = 32;
+    // Average number of edges to aim for in each cell
+    static const size_t kEdgesPerCell = 4;
+
+    enum CellState : uint8_t {
+        kCellOutside = 0,
+        kCellInside = 1,
+        kCellUnknown = 2    // The centre is on an edge, so points in this cell are always scanned
+    };
+
+    const std::vector<Point>* ring;
+    Point min;
+    Point max;
+    double cell_width;
+    double cell_height;
+    size_t columns;
+    size_t rows;
+    // Edges (by index of their first point) touching each cell, with the edges
+    // of cell i from cell_edges[cell_start[i]] to cell_edges[cell_start[i + 1]]
+    std::vector<uint32_t> cell_start;
+    std::vector<uint32_t> cell_edges;
+    std::vector<uint8_t> cell_state;
+
+    static inline double _cross(const Point& a, const Point& b, const Point& p) {
+        return ((b.x - a.x) * (p.y - a.y)) - ((p.x - a.x) * (b.y - a.y));
+    }
+
+    static inline bool _on_edge(const Point& a, const Point& b, const Point& p) {
+        return _cross(a, b, p) == 0.0 &&
+               p.x >= std::min(a.x, b.x) && p.x <= std::max(a.x, b.x) &&
+               p.y >= std::min(a.y, b.y) && p.y <= std::max(a.y, b.y);
+    }
+
+    // Check if edge a to b crosses the horizontal line from u to v (which must have the same y).
+    // Ring points that lie on the line count as just above it, so a vertex is never counted twice
+    static inline bool _crosses_horizontal(const Point& a, const Point& b, const Point& u, const Point& v) {
+        return ((a.y > u.y) != (b.y > u.y)) && ((_cross(a, b, u) > 0.0) != (_cross(a, b, v) > 0.0));
+    }
+
+    // The same for a vertical line from u to v, where ring points on the line count as just to its right
+    static inline bool _crosses_vertical(const Point& a, const Point& b, const Point& u, const Point& v) {
+        return ((a.x > u.x) != (b.x > u.x)) && ((_cross(a, b, u) > 0.0) != (_cross(a, b, v) > 0.0));
+    }
+
+    size_t _column(double x) const {
+        const double column = std::floor((x - min.x) / cell_width);
+        if (!(column > 0.0)) return 0;
+        return std::min(columns - 1, static_cast<size_t>(column));
+    }
+
+    size_t _row(double y) const {
+        const double row = std::floor((y - min.y) / cell_height);
+        if (!(row > 0.0)) return 0;
+        return std::min(rows - 1, static_cast<size_t>(row));
+    }
+
+    Point _centre(size_t column, size_t row) const {
+        return {min.x + ((column + 0.5) * cell_width), min.y + ((row + 0.5) * cell_height)};
+    }
+
+    // Call visit(cell) for every cell the edge touches. Errs on the side of including
+    // cells the edge only just misses, as an extra edge in a cell does no harm
+    template <class Visitor>
+    void _for_each_cell(const Point& a, const Point& b, Visitor visit) const {
+        const double x_pad = cell_width * 1e-6;
+        const double y_pad = cell_height * 1e-6;
+        const double y_low = std::min(a.y, b.y);
+        const double y_high = std::max(a.y, b.y);
+        const size_t first_row = _row(y_low - y_pad);
+        const size_t last_row = _row(y_high + y_pad);
+        for (size_t row = first_row; row <= last_row; row++) {
+            // Part of the edge within this row
+            double x_low = std::min(a.x, b.x);
+            double x_high = std::max(a.x, b.x);
+            if (a.y != b.y && first_row != last_row) {
+                const double row_low = std::max(y_low, min.y + (row * cell_height));
+                const double row_high = std::min(y_high, min.y + ((row + 1) * cell_height));
+                const double x_at_low = a.x + (((row_low - a.y) / (b.y - a.y)) * (b.x - a.x));
+                const double x_at_high = a.x + (((row_high - a.y) / (b.y - a.y)) * (b.x - a.x));
+                x_low = std::max(x_low, std::min(x_at_low, x_at_high));
+                x_high = std::min(x_high, std::max(x_at_low, x_at_high));
+            }
+            const size_t last_column = _column(x_high + x_pad);
+            for (size_t column = _column(x_low - x_pad); column <= last_column; column++) {
+                visit((row * columns) + column);
+            }
+        }
+    }
+
+    // Work out which side of the ring each cell's centre is on, a row at a time. Walks from a point left
+    // of the ring (so outside it) to each centre in turn, flipping sides each time an edge is crossed
+    void _set_cell_states() {
+        const std::vector<Point>& points = *ring;
+        cell_state.assign(columns * rows, kCellUnknown);
+        std::vector<uint32_t> seen(points.size(), 0);
+        uint32_t step = 0;
+        for (size_t row = 0; row < rows; row++) {
+            Point from = {min.x - cell_width, _centre(0, row).y};
+            bool inside = false;
+            size_t from_column = 0;
+            for (size_t column = 0; column < columns; column++) {
+                const Point to = _centre(column, row);
+                bool on_edge = false;
+                bool crossed = false;
+                // Each edge between the two points touches one of the cells from here to there
+                step++;
+                for (size_t cell = (row * columns) + from_column; cell <= (row * columns) + column; cell++) {
+                    for (uint32_t index = cell_start[cell]; index < cell_start[cell + 1]; index++) {
+                        const uint32_t edge = cell_edges[index];
+                        if (seen[edge] == step) continue;
+                        seen[edge] = step;
+                        if (_on_edge(points[edge], points[edge + 1], to)) on_edge = true;
+                        if (_crosses_horizontal(points[edge], points[edge + 1], from, to)) crossed = !crossed;
+                    }
+                }
+                // Leave cells whose centre is on the ring as unknown, and carry on from the last good centre
+                if (on_edge) continue;
+                inside = (inside != crossed);
+                cell_state[(row * columns) + column] = inside ? kCellInside : kCellOutside;
+                from = to;
+                from_column = column;
+            }
+        }
+    }
+
+    Location _scan(const Point& p) const {
+        const std::vector<Point>& points = *ring;
+        // Count the edges that cross the horizontal ray from p to +x
+        bool inside = false;
+        for (size_t edge = 0; edge + 1 < points.size(); edge++) {
+            const Point& a = points[edge];
+            const Point& b = points[edge + 1];
+            if (p.y < std::min(a.y, b.y) || p.y > std::max(a.y, b.y)) continue;
+            if (_on_edge(a, b, p)) return kBoundary;
+            if ((a.y > p.y) != (b.y > p.y)) {
+                // p is left of an upward edge, or right of a downward one, when the crossing is to its right
+                if ((_cross(a, b, p) > 0.0) == (b.y > a.y)) inside = !inside;
+            }
+        }
+        return inside ? kInside : kOutside;
+    }
+
+public:
+    PreparedRing() : ring(nullptr), min({0.0, 0.0}), max({0.0, 0.0}), cell_width(1.0), cell_height(1.0),
+                     columns(0), rows(0) {  }
+
+    // The prepared ring keeps a reference to the points, so they must outlive it
+    explicit PreparedRing(const std::vector<Point>& points) : PreparedRing() {
+        build(points);
+    }
+
+    void build(const std::vector<Point>& points) {
+        ring = &points;
+        cell_start.clear();
+        cell_edges.clear();
+        cell_state.clear();
+        const size_t number_edges = points.empty() ? 0 : points.size() - 1;
+        if (number_edges < kMinIndexedEdges) return;
+
+        const std::pair<Point, Point> box = Polygon::get_bounding_box(points.begin(), points.end());
+        min = box.first;
+        max = box.second;
+        const double width = max.x - min.x;
+        const double height = max.y - min.y;
+        if (!(width > 0.0) || !(height > 0.0)) return;
+        // Roughly square cells
+        const double number_cells = static_cast<double>(number_edges / kEdgesPerCell);
+        columns = std::max<size_t>(1, std::ceil(std::sqrt(number_cells * (width / height))));
+        rows = std::max<size_t>(1, std::ceil(number_cells / columns));
+        cell_width = width / columns;
+        cell_height = height / rows;
+
+        // Count the edges in each cell, then fill them in
+        cell_start.assign((columns * rows) + 1, 0);
+        for (size_t edge = 0; edge < number_edges; edge++) {
+            _for_each_cell(points[edge], points[edge + 1], [this](size_t cell) { cell_start[cell + 1]++; });
+        }
+        for (size_t cell = 0; cell < (columns * rows); cell++) {
+            cell_start[cell + 1] += cell_start[cell];
+        }
+        cell_edges.resize(cell_start.back());
+        std::vector<uint32_t> next(cell_start.begin(), cell_start.end() - 1);
+        for (size_t edge = 0; edge < number_edges; edge++) {
+            _for_each_cell(points[edge], points[edge + 1], [&](size_t cell) { cell_edges[next[cell]++] = edge; });
+        }
+        _set_cell_states();
+    }
+
+    Location locate(const Point& p) const {
+        if (cell_start.empty()) return _scan(p);
+        if (p.x < min.x || p.x > max.x || p.y < min.y || p.y > max.y) return kOutside;
+
+        const size_t column = _column(p.x);
+        const size_t row = _row(p.y);
+        const size_t cell = (row * columns) + column;
+        if (cell_state[cell] == kCellUnknown) return _scan(p);
+
+        // Count the edges crossed going from p across to the centre's column, then to the centre
+        const std::vector<Point>& points = *ring;
+        const Point centre = _centre(column, row);
+        const Point corner = {centre.x, p.y};
+        bool inside = (cell_state[cell] == kCellInside);
+        for (uint32_t index = cell_start[cell]; index < cell_start[cell + 1]; index++) {
+            const Point& a = points[cell_edges[index]];
+            const Point& b = points[cell_edges[index] + 1];
+            if (_on_edge(a, b, p)) return kBoundary;
+            if (_on_edge(a, b, corner)) return _scan(p);
+            if (_crosses_horizontal(a, b, p, corner)) inside = !inside;
+            if (_crosses_vertical(a, b, corner, centre)) inside = !inside;
+        }
+        return inside ? kInside : kOutside;
+    }
+};
+
+// A polygon set up for answering many point in polygon questions.
+// Points on the boundary of the polygon (including the boundary of its holes) count as inside
+class PreparedPolygon {
+
+private:
+    std::pair<Point, Point> bounding_box;
+    PreparedRing outer;
+    std::vector<PreparedRing> inner;
+
+public:
+    // The prepared polygon keeps references to the polygon's rings, so the polygon must outlive it
+    explicit PreparedPolygon(const Polygon& polygon) :
+        bounding_box(polygon.bounding_box), outer(polygon.outer) {
+        inner.reserve(polygon.inner.size());
+        for (const auto& inner_ring : polygon.inner) {
+            inner.emplace_back(inner_ring);
+        }
+    }
+
+    bool contains(const Point& p) const {
+        if (p.x < bounding_box.first.x || p.x > bounding_box.second.x ||
+            p.y < bounding_box.first.y || p.y > bounding_box.second.y) {
+            return false;
+        }
+        const PreparedRing::Location location = outer.locate(p);
+        if (location == PreparedRing::kOutside) return false;
+        if (location == PreparedRing::kBoundary) return true;
+        for (const auto& hole : inner) {
+            if (hole.locate(p) == PreparedRing::kInside) return false;
+        }
+        return true;
+    }
+};
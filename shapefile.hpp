@@ -4,8 +4,19 @@
 #include <string>
 #include <vector>
 #include <cstring>  //memcpy
+#include <stdexcept>
+#include <exception>    // exception_ptr
+#include <thread>
+#include <atomic>
+#include <sys/mman.h>   // mmap
+#include <sys/stat.h>   // fstat
+#include <fcntl.h>      // open
+#include <unistd.h>     // close
 #include "point.hpp"
 #include "polygon.hpp"
+#include "prepared_polygon.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 class Shapefile {
 
@@ -35,27 +46,50 @@ private:
     const unsigned int kPolygonNumPointsOffset = 40;
     const unsigned int kPolygonPartsOffset = 44;
 
-    std::vector<uint8_t> raw_data;
-    std::vector<std::pair<unsigned int,unsigned int>> record_index;
+    // View over the whole shapefile. Points either into the memory mapped
+    // file, or into file_data when memory mapping is turned off
+    const uint8_t* raw_data;
+    size_t raw_size;
+    std::vector<uint8_t> file_data;
+    void* mapped_data;
+    size_t mapped_size;
+    bool memory_map;
+    bool use_shx;
+
+    // Byte offset and length of each record. Offsets are 64 bit so files over 4GB can be indexed
+    std::vector<std::pair<uint64_t, uint64_t>> record_index;
     std::string filename;
     bool good;
 
-    inline unsigned int get_unsigned_int_big_endian(unsigned int index) {
-        return (raw_data[index+3]<<0) | (raw_data[index+2]<<8) | (raw_data[index+1]<<16) | ((unsigned)raw_data[index]<<24);
+    // Index file (.shx) constants
+    const unsigned int kIndexRecordSize = 8;
+    const unsigned int kIndexOffsetOffset = 0;
+    const unsigned int kIndexLengthOffset = 4;
+
+    static inline unsigned int get_unsigned_int_big_endian(const uint8_t* data) {
+        return (data[3]<<0) | (data[2]<<8) | (data[1]<<16) | ((unsigned)data[0]<<24);
+    }
+
+    static inline unsigned int get_unsigned_int_little_endian(const uint8_t* data) {
+        return (data[0]<<0) | (data[1]<<8) | (data[2]<<16) | ((unsigned)data[3]<<24);
     }
 
-    inline unsigned int get_unsigned_int_little_endian(unsigned int index) {
-        return (raw_data[index]<<0) | (raw_data[index+1]<<8) | (raw_data[index+2]<<16) | ((unsigned)raw_data[index+3]<<24);
+    inline unsigned int get_unsigned_int_big_endian(uint64_t index) {
+        return get_unsigned_int_big_endian(raw_data + index);
+    }
+
+    inline unsigned int get_unsigned_int_little_endian(uint64_t index) {
+        return get_unsigned_int_little_endian(raw_data + index);
     }
 
     bool _load_records() {
         record_index.clear();
         // Check all record headers and create record index
-        const unsigned int length = raw_data.size();
-        unsigned int index = kMainHeaderSize;
+        const uint64_t length = raw_size;
+        uint64_t index = kMainHeaderSize;
         unsigned int record_num = 1;
         while (index < length) {
-            unsigned int start = index + kRecordHeaderSize;
+            uint64_t start = index + kRecordHeaderSize;
             // Check data is big enough for the record header
             if (length < (index + kRecordHeaderSize)) return false;
             // Check for sequential record numbers
@@ -63,7 +97,7 @@ private:
             record_num++;
             // Record length in shape file is number of 16 bits word
             // To x2 to get bytes
-            unsigned int record_length = (get_unsigned_int_big_endian(index + kRecordLengthOffset) * 2);
+            uint64_t record_length = static_cast<uint64_t>(get_unsigned_int_big_endian(index + kRecordLengthOffset)) * 2;
             // Check the record is has enough room for at least the shape type
             if (record_length < kMinRecordLength) return false;
             // Store the start index and length of each record
@@ -77,9 +111,72 @@ private:
         return true;
     }
 
+    // Companion index file name, e.g. "countries.shp" -> "countries.shx"
+    std::string _index_filename() const {
+        if (filename.size() < 4) return "";
+        const std::string extension = filename.substr(filename.size() - 4);
+        if (extension == ".shp") return filename.substr(0, filename.size() - 4) + ".shx";
+        if (extension == ".SHP") return filename.substr(0, filename.size() - 4) + ".SHX";
+        return "";
+    }
+
+    // Build the record index from the .shx file rather than walking every record header.
+    // Returns false if there is no usable index file, in which case _load_records should be used.
+    // Record headers are only checked against the index when the record is decoded
+    bool _load_records_from_index() {
+        record_index.clear();
+        const std::string index_filename = _index_filename();
+        if (index_filename.empty()) return false;
+
+        std::ifstream index_file(index_filename, std::ios::binary | std::ios::ate);
+        if (!index_file.good()) return false;
+        const std::streamsize size = index_file.tellg();
+        if (size < static_cast<std::streamsize>(kMainHeaderSize) || ((size - kMainHeaderSize) % kIndexRecordSize) != 0) {
+            return false;
+        }
+        std::vector<uint8_t> index_data(size);
+        index_file.seekg(0, std::ios::beg);
+        index_file.read(reinterpret_cast<char*>(index_data.data()), size);
+        if (!index_file.good()) return false;
+
+        // Index file shares the main file header
+        if (get_unsigned_int_big_endian(index_data.data() + kFileCodeOffset) != kFileCode) return false;
+        if (get_unsigned_int_big_endian(index_data.data() + kFileLengthOffset) != static_cast<uint64_t>(size) / 2) return false;
+        if (get_unsigned_int_little_endian(index_data.data() + kFileVersionOffset) != kFileVersion) return false;
+
+        const size_t number_records = (size - kMainHeaderSize) / kIndexRecordSize;
+        record_index.reserve(number_records);
+        for (size_t record = 0; record < number_records; record++) {
+            const uint8_t* entry = index_data.data() + kMainHeaderSize + (record * kIndexRecordSize);
+            // Offsets and lengths are both in 16 bit words, and the offset points at the record header
+            uint64_t start = static_cast<uint64_t>(get_unsigned_int_big_endian(entry + kIndexOffsetOffset)) * 2;
+            uint64_t record_length = static_cast<uint64_t>(get_unsigned_int_big_endian(entry + kIndexLengthOffset)) * 2;
+            start += kRecordHeaderSize;
+            // Check the record fits inside the shapefile
+            if (start < (kMainHeaderSize + kRecordHeaderSize) || record_length < kMinRecordLength ||
+                (start + record_length) > raw_size) {
+                record_index.clear();
+                return false;
+            }
+            record_index.push_back({start, record_length});
+        }
+        return true;
+    }
+
+    // Check a record's header matches the record index. Needed for records found
+    // via the .shx file, as their headers are not checked up front
+    void _check_record_header(size_t record_number) {
+        const auto& record = record_index[record_number];
+        const uint64_t header = record.first - kRecordHeaderSize;
+        if (get_unsigned_int_big_endian(header + kRecordNumberOffset) != (record_number + 1) ||
+            static_cast<uint64_t>(get_unsigned_int_big_endian(header + kRecordLengthOffset)) * 2 != record.second) {
+            throw std::runtime_error("Shapefile index does not match: " + filename);
+        }
+    }
+
     bool _is_valid() {
         // Check data is long enough to contain the header
-        const unsigned int length = raw_data.size();
+        const size_t length = raw_size;
         if (length < kMainHeaderSize) return false;
         // Check the file code matches the expected value
         unsigned int file_code = get_unsigned_int_big_endian(kFileCodeOffset);        
@@ -94,19 +191,21 @@ private:
         return true;
     }
 
-    bool _is_polygon(std::pair<unsigned int, unsigned int>& record) {
-        unsigned int index = record.first;
+    bool _is_polygon(const std::pair<uint64_t, uint64_t>& record) {
+        uint64_t index = record.first;
         return (get_unsigned_int_little_endian(index + kShapeTypeOffset) == kPolygonShapeType);
     }
 
-    std::vector<Polygon> _get_polygons_from_record(std::pair<unsigned int, unsigned int>& record) {
-        unsigned int index = record.first;
+    std::vector<Polygon> _get_polygons_from_record(const std::pair<uint64_t, uint64_t>& record) {
+        Stats::Timer timer(Stats::kDecode);
+        Trace::Scope scope("decode_record", "offset", record.first);
+        uint64_t index = record.first;
         // Check that this is a polygon record type
         if (get_unsigned_int_little_endian(index + kShapeTypeOffset) != kPolygonShapeType) {
             throw std::runtime_error("Shape type is not Polygon");
         }
         // Check there is enough data to store the polygon record header
-        if (raw_data.size() < (index + kPolygonPartsOffset)) {
+        if (raw_size < (index + kPolygonPartsOffset)) {
             throw std::runtime_error("Polygon is corrupted");
         }
 
@@ -114,35 +213,37 @@ private:
         // which are split across all the parts
         const unsigned int number_parts = get_unsigned_int_little_endian(index + kPolygonNumPartsOffset);
         const unsigned int number_points = get_unsigned_int_little_endian(index + kPolygonNumPointsOffset);
+        Stats::add(Stats::kRecordsDecoded, 1);
+        Stats::add(Stats::kRingsDecoded, number_parts);
 
         // Polygons must have at least one part, and at least 4 points
         if (number_parts == 0 || number_points < 4) {
             throw std::runtime_error("Polygon is corrupted");
         }
         // Check there is enough data to store all the index of each part
-        if (raw_data.size() < (index + kPolygonPartsOffset + (sizeof(uint32_t) * number_parts))) {
+        if (raw_size < (index + kPolygonPartsOffset + (sizeof(uint32_t) * number_parts))) {
             throw std::runtime_error("Polygon is corrupted");
         }
 
         // Get the starting index of each part and store in a vector
         std::vector<uint32_t> part_indexes;
         part_indexes.resize(number_parts);
-        std::memcpy(part_indexes.data(), &raw_data[index + kPolygonPartsOffset], sizeof(uint32_t) * number_parts);
+        std::memcpy(part_indexes.data(), raw_data + index + kPolygonPartsOffset, sizeof(uint32_t) * number_parts);
         // Check all indexes are in bounds
         for (unsigned int part_index : part_indexes) {
             if (part_index >= number_points) throw std::runtime_error("Polygon is corrupted");
         }
 
         // The array of data points starts after the array of part indexes
-        const unsigned int kPolygonPointsOffset = kPolygonPartsOffset + (number_parts * sizeof(uint32_t));
+        const uint64_t kPolygonPointsOffset = kPolygonPartsOffset + (number_parts * sizeof(uint32_t));
         // Check there is enough data in the shapefile to fit all data points
-        if (raw_data.size() < (index + kPolygonPointsOffset + (sizeof(uint32_t) * number_points))) {
+        if (raw_size < (index + kPolygonPointsOffset + (sizeof(Point) * number_points))) {
             throw std::runtime_error("Polygon is corrupted");
         }
         // Read points for all parts into a single vector
         std::vector<Point> points;
         points.resize(number_points);
-        std::memcpy(points.data(), &raw_data[index + kPolygonPointsOffset], sizeof(Point) * number_points);
+        std::memcpy(points.data(), raw_data + index + kPolygonPointsOffset, sizeof(Point) * number_points);
 
         // Store each part
         std::vector<Polygon> polygons;
@@ -172,24 +273,149 @@ private:
         }
 
         // For each inner part, check which outer part(s) it fits within
-        for (auto& inner_part : inner_parts) {
-            for (auto& outer_part : polygons) {
-                for (auto& point : inner_part) {
-                    // If at least on point of the inner part is within
-                    // the outer part, then add it to the part as 
-                    if (Polygon::contains(outer_part.outer, point)) {                        
-                        outer_part.inner.push_back(inner_part);
+        _assign_holes(polygons, inner_parts);
+        return polygons;
+    }
+
+    // Add each hole to every shell that contains it. Shells are narrowed down by bounding box first,
+    // using an interval index over the shells' x ranges. Then the hole's points are tested against each
+    // remaining shell until one is inside, using a prepared ring so each test only looks at a few edges
+    static void _assign_holes(std::vector<Polygon>& shells, std::vector<std::vector<Point>>& holes) {
+        if (holes.empty() || shells.empty()) return;
+
+        // Interval index: shells sorted by min x, along with the largest max x of
+        // every shell up to that point. Shells that could overlap a range are all at or
+        // before the last one starting within it, and stop once the largest max x is too small
+        std::vector<uint32_t> order(shells.size());
+        for (uint32_t shell = 0; shell < order.size(); shell++) order[shell] = shell;
+        std::sort(order.begin(), order.end(),
+                  [&shells](uint32_t a, uint32_t b) { return shells[a].min_x() < shells[b].min_x(); });
+        std::vector<double> max_x_so_far(order.size());
+        for (size_t index = 0; index < order.size(); index++) {
+            max_x_so_far[index] = shells[order[index]].max_x();
+            if (index > 0) max_x_so_far[index] = std::max(max_x_so_far[index], max_x_so_far[index - 1]);
+        }
+
+        std::vector<PreparedRing> prepared(shells.size());
+        std::vector<bool> is_prepared(shells.size(), false);
+        std::vector<uint32_t> containing;
+        for (auto& hole : holes) {
+            const std::pair<Point, Point> box = Polygon::get_bounding_box(hole.begin(), hole.end());
+            containing.clear();
+            auto last = std::upper_bound(order.begin(), order.end(), box.second.x,
+                                         [&shells](double x, uint32_t shell) { return x < shells[shell].min_x(); });
+            for (size_t index = last - order.begin(); index > 0 && max_x_so_far[index - 1] >= box.first.x; index--) {
+                const uint32_t shell = order[index - 1];
+                if (!shells[shell].intersects(box.first, box.second)) continue;
+                if (!is_prepared[shell]) {
+                    prepared[shell].build(shells[shell].outer);
+                    is_prepared[shell] = true;
+                }
+                // A hole belongs to the shell if any of its points are inside it. For a well formed
+                // shapefile that is the first point tested, but overlapping parts are checked in full
+                for (const auto& point : hole) {
+                    if (prepared[shell].locate(point) == PreparedRing::kInside) {
+                        containing.push_back(shell);
                         break;
                     }
                 }
             }
+            for (size_t index = 0; index < containing.size(); index++) {
+                if (index + 1 < containing.size()) {
+                    shells[containing[index]].inner.push_back(hole);
+                } else {
+                    shells[containing[index]].inner.push_back(std::move(hole));
+                }
+            }
         }
-        return polygons;
+    }
+
+    void _release() {
+        if (mapped_data != nullptr) {
+            munmap(mapped_data, mapped_size);
+            mapped_data = nullptr;
+            mapped_size = 0;
+        }
+        file_data = std::vector<uint8_t>();
+        raw_data = nullptr;
+        raw_size = 0;
+    }
+
+    void _map_file() {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open file: \"" + filename + "\"");
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to read: " + filename);
+        }
+        // Can't map an empty file. Leave the view empty and let _is_valid reject it
+        if (file_stat.st_size > 0) {
+            void* data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Failed to read: " + filename);
+            }
+            mapped_data = data;
+            mapped_size = file_stat.st_size;
+            raw_data = static_cast<const uint8_t*>(mapped_data);
+            raw_size = mapped_size;
+        }
+        // The mapping stays valid after the file is closed
+        close(fd);
+    }
+
+    // Tell the kernel how the mapped file is about to be read. Does nothing when the file was read into memory
+    void _advise(int advice) {
+        if (mapped_data != nullptr) madvise(mapped_data, mapped_size, advice);
+    }
+
+    void _read_file() {
+        std::ifstream map_shapefile(filename, std::ios::binary | std::ios::ate);
+        if (!map_shapefile.good()) {
+            throw std::runtime_error("Failed to open file: \"" + filename + "\"");
+        }
+        // Read entire shapefile in one go
+        const std::streamsize size = map_shapefile.tellg();
+        map_shapefile.seekg(0, std::ios::beg);
+        file_data.resize(size);
+        map_shapefile.read(reinterpret_cast<char*>(file_data.data()), size);
+        // Check no errors occurred while reading the file
+        if (!map_shapefile.good()) {
+            throw std::runtime_error("Failed to read: " + filename);
+        } else {
+            map_shapefile.close();
+        }
+        raw_data = file_data.data();
+        raw_size = file_data.size();
     }
 
 public:
-    Shapefile() : filename(""), good(false) {  }
-    Shapefile(const std::string& shapefile_filename) : filename(shapefile_filename), good(false) {  }
+    Shapefile() : raw_data(nullptr), raw_size(0), mapped_data(nullptr), mapped_size(0), memory_map(true),
+                  use_shx(true), filename(""), good(false) {  }
+    Shapefile(const std::string& shapefile_filename) : raw_data(nullptr), raw_size(0), mapped_data(nullptr),
+                                                       mapped_size(0), memory_map(true), use_shx(true),
+                                                       filename(shapefile_filename), good(false) {  }
+    ~Shapefile() {
+        _release();
+    }
+    // Holds a memory mapping, so can't be copied
+    Shapefile(const Shapefile&) = delete;
+    Shapefile& operator=(const Shapefile&) = delete;
+
+    // Memory map the shapefile (the default) rather than reading it into a buffer.
+    // Takes effect on the next call to read()
+    void use_memory_map(bool enable) {
+        memory_map = enable;
+    }
+
+    // Find records using the companion .shx index file when there is one (the default),
+    // rather than walking every record header. Takes effect on the next call to read()
+    void use_index_file(bool enable) {
+        use_shx = enable;
+    }
     
     void read(const std::string& shapefile_filename) {
         filename  = shapefile_filename;
@@ -197,6 +423,8 @@ public:
     }
 
     void read() {
+        Stats::Timer timer(Stats::kRead);
+        Trace::Scope scope("read_shapefile");
         good = false;
         // Check the endian of the processor the code is running on.
         int endian_test = 1;
@@ -204,36 +432,44 @@ public:
             throw std::runtime_error("Program will only run on little endian processor");
         }
 
-        std::ifstream map_shapefile(filename, std::ios::binary);
-        if (!map_shapefile.good()) {
-            throw std::runtime_error("Failed to open file: \"" + filename + "\"");
-        }
-        // Read entire shapefile    
-        raw_data = std::vector<uint8_t>((std::istreambuf_iterator<char>(map_shapefile)),
-                                         std::istreambuf_iterator<char>());
-        // Check no errors occurred while reading the file
-        if (!map_shapefile.good()) {
-            throw std::runtime_error("Failed to read: " + filename);
+        _release();
+        if (memory_map) {
+            _map_file();
         } else {
-            map_shapefile.close();
+            _read_file();
         }
         // Check file looks like a valid shapefile
         if (!_is_valid()) {
             throw std::runtime_error("File is not a shapefile: " + filename);
         }
-        // Check every record and create an index of each record
-        if (!_load_records()) {
-            throw std::runtime_error("File is not a shapefile: " + filename);
+        // Use the index file if there is one, otherwise check
+        // every record and create an index of each record.
+        // Walking the record headers reads the file front to back
+        if (!(use_shx && _load_records_from_index())) {
+            _advise(MADV_SEQUENTIAL);
+            if (!_load_records()) {
+                throw std::runtime_error("File is not a shapefile: " + filename);
+            }
         }
 
         good = true;
     }
 
     void get_polygons(std::vector<Polygon>& polygons) {
+        get_polygons(polygons, 0, record_index.size());
+    }
+
+    // Get the polygons from records first_record to last_record - 1
+    void get_polygons(std::vector<Polygon>& polygons, size_t first_record, size_t last_record) {
         polygons.clear();
         if (!good) throw std::runtime_error("Shapefile::read() must called successfully first");
+        if (first_record > last_record || last_record > record_index.size()) {
+            throw std::runtime_error("Record index out of range");
+        }
 
-        for (auto& record : record_index) {
+        for (size_t record_number = first_record; record_number < last_record; record_number++) {
+            _check_record_header(record_number);
+            auto& record = record_index[record_number];
             if (_is_polygon(record)) {
                 // This should be a relatively efficient way of building the vector
                 // of polygons. With C++11 function returns are handles with std::move,
@@ -245,4 +481,94 @@ public:
             }
         }
     }
+
+    // Decode the records on num_threads threads. Each thread decodes separate runs of records,
+    // which are then joined back together in file order, so the result matches the serial version
+    void get_polygons(std::vector<Polygon>& polygons, unsigned int num_threads) {
+        if (num_threads <= 1 || record_index.size() < 2) {
+            get_polygons(polygons);
+            return;
+        }
+        polygons.clear();
+        if (!good) throw std::runtime_error("Shapefile::read() must called successfully first");
+        // The threads read from all over the file at once, so read the whole file in up front, and undo
+        // any sequential hint from walking the records or for_each_polygon, which would drop pages the
+        // other threads need
+        _advise(MADV_NORMAL);
+        _advise(MADV_WILLNEED);
+
+        // Use a few runs per thread so a run full of detailed records doesn't leave the other threads idle
+        const size_t num_runs = std::min<size_t>(record_index.size(), num_threads * 4);
+        const size_t run_length = (record_index.size() + num_runs - 1) / num_runs;
+        std::vector<std::vector<Polygon>> runs(num_runs);
+        std::vector<std::exception_ptr> errors(num_runs);
+        std::atomic<size_t> next_run(0);
+
+        auto decode_runs = [&]() {
+            size_t run;
+            while ((run = next_run++) < num_runs) {
+                const size_t first_record = std::min(run * run_length, record_index.size());
+                const size_t last_record = std::min(first_record + run_length, record_index.size());
+                // Anything thrown (including running out of memory on a huge record) is
+                // passed back to the calling thread, rather than ending the program here
+                try {
+                    get_polygons(runs[run], first_record, last_record);
+                } catch (...) {
+                    errors[run] = std::current_exception();
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < num_threads; i++) {
+            threads.emplace_back(decode_runs);
+        }
+        decode_runs();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        // Report the first error in file order
+        for (const auto& error : errors) {
+            if (error) std::rethrow_exception(error);
+        }
+        size_t number_polygons = 0;
+        for (const auto& run : runs) number_polygons += run.size();
+        polygons.reserve(number_polygons);
+        for (auto& run : runs) {
+            polygons.insert(polygons.end(), std::make_move_iterator(run.begin()), std::make_move_iterator(run.end()));
+        }
+    }
+
+    // Decode a single record. Records are numbered from 0 in file order
+    std::vector<Polygon> get_record_polygons(size_t record_number) {
+        if (!good) throw std::runtime_error("Shapefile::read() must called successfully first");
+        if (record_number >= record_index.size()) throw std::runtime_error("Record index out of range");
+        _check_record_header(record_number);
+        if (!_is_polygon(record_index[record_number])) return {};
+        return _get_polygons_from_record(record_index[record_number]);
+    }
+
+    // Decode the shapefile one record at a time, calling visit(polygon, record_number) for each polygon.
+    // Only a single record's polygons are held in memory at once, so files much bigger than the
+    // available memory can be processed. The visitor is free to modify or move from the polygon
+    template <class Visitor>
+    void for_each_polygon(Visitor visit) {
+        if (!good) throw std::runtime_error("Shapefile::read() must called successfully first");
+        // Records are decoded front to back, and each is only read once
+        _advise(MADV_SEQUENTIAL);
+
+        for (size_t record_number = 0; record_number < record_index.size(); record_number++) {
+            _check_record_header(record_number);
+            const auto& record = record_index[record_number];
+            if (_is_polygon(record)) {
+                std::vector<Polygon> polygons = _get_polygons_from_record(record);
+                for (auto& polygon : polygons) {
+                    visit(polygon, record_number);
+                }
+            }
+        }
+    }
+
+    size_t get_number_of_records() const { return record_index.size(); }
 };
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cstddef>
+#include <cmath>        // round
+#include <limits>       // numeric_limits
+#include <utility>      // pair
+#include "point.hpp"
+#include "stats.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MAP_GEN_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// Vectorised kernels for the inner loops of every render: transforming points,
+// finding bounding boxes, and finding where edges cross a row.
+//
+// The instruction set is picked once at runtime (AVX2, then SSE4.1, then plain scalar code).
+// Every version does exactly the same floating point operations in the same order as the
+// scalar code (additions and multiplications are never fused), so the results are identical
+// whichever one runs.
+class Simd {
+
+public:
+    enum Level {
+        kScalar = 0,
+        kSse41 = 1,
+        kAvx2 = 2
+    };
+
+private:
+
+    static Level _detect() {
+#ifdef MAP_GEN_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return kAvx2;
+        if (__builtin_cpu_supports("sse4.1")) return kSse41;
+#endif
+        return kScalar;
+    }
+
+    static Level& _level() {
+        static Level level = _detect();
+        return level;
+    }
+
+    static void _transform_scalar(const Point* points, Point* out, size_t count, const Transform& transform) {
+        for (size_t index = 0; index < count; index++) {
+            out[index] = transform.apply(points[index]);
+        }
+    }
+
+    static std::pair<Point, Point> _bounding_box_scalar(const Point* points, size_t count) {
+        // Make min the maximum possible value, and max the min possible value
+        Point min({std::numeric_limits<double>().max(), std::numeric_limits<double>().max()});
+        Point max({std::numeric_limits<double>().lowest(), std::numeric_limits<double>().lowest()});
+        for (size_t index = 0; index < count; index++) {
+            if (points[index].y < min.y) min.y = points[index].y;
+            if (points[index].x < min.x) min.x = points[index].x;
+            if (points[index].y > max.y) max.y = points[index].y;
+            if (points[index].x > max.x) max.x = points[index].x;
+        }
+        return {min, max};
+    }
+
+    static void _row_crossings_scalar(const double* ax, const double* ay, const double* dx, const double* dy,
+                                      size_t count, double y, int* x) {
+        for (size_t index = 0; index < count; index++) {
+            x[index] = static_cast<int>(round(ax[index] + (((y - ay[index]) / dy[index]) * dx[index])));
+        }
+    }
+
+#ifdef MAP_GEN_SIMD_X86
+    // Round half away from zero, like round(). Truncate, then step away
+    // from zero when the part that was cut off is at least a half
+    __attribute__((target("sse4.1")))
+    static inline __m128d _round_sse41(__m128d val) {
+        const __m128d sign_mask = _mm_set1_pd(-0.0);
+        const __m128d half = _mm_set1_pd(0.5);
+        const __m128d one = _mm_set1_pd(1.0);
+        const __m128d truncated = _mm_round_pd(val, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        const __m128d cut = _mm_andnot_pd(sign_mask, _mm_sub_pd(val, truncated));
+        const __m128d step = _mm_or_pd(_mm_and_pd(_mm_cmpge_pd(cut, half), one), _mm_and_pd(val, sign_mask));
+        return _mm_add_pd(truncated, step);
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256d _round_avx2(__m256d val) {
+        const __m256d sign_mask = _mm256_set1_pd(-0.0);
+        const __m256d half = _mm256_set1_pd(0.5);
+        const __m256d one = _mm256_set1_pd(1.0);
+        const __m256d truncated = _mm256_round_pd(val, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        const __m256d cut = _mm256_andnot_pd(sign_mask, _mm256_sub_pd(val, truncated));
+        const __m256d step = _mm256_or_pd(_mm256_and_pd(_mm256_cmp_pd(cut, half, _CMP_GE_OQ), one),
+                                          _mm256_and_pd(val, sign_mask));
+        return _mm256_add_pd(truncated, step);
+    }
+
+    // Points are stored x, y, x, y, ... so each vector holds whole points,
+    // and the shift and scale vectors repeat the x and y values to match
+    __attribute__((target("sse4.1")))
+    static void _transform_sse41(const Point* points, Point* out, size_t count, const Transform& transform) {
+        const __m128d shift = _mm_set_pd(transform.y_shift, transform.x_shift);
+        const __m128d scale = _mm_set_pd(transform.y_scale, transform.x_scale);
+        const double* in_data = reinterpret_cast<const double*>(points);
+        double* out_data = reinterpret_cast<double*>(out);
+        for (size_t index = 0; index < count; index++) {
+            const __m128d point = _mm_loadu_pd(in_data + (index * 2));
+            _mm_storeu_pd(out_data + (index * 2), _mm_mul_pd(_mm_add_pd(point, shift), scale));
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static void _transform_avx2(const Point* points, Point* out, size_t count, const Transform& transform) {
+        const __m256d shift = _mm256_set_pd(transform.y_shift, transform.x_shift, transform.y_shift, transform.x_shift);
+        const __m256d scale = _mm256_set_pd(transform.y_scale, transform.x_scale, transform.y_scale, transform.x_scale);
+        const double* in_data = reinterpret_cast<const double*>(points);
+        double* out_data = reinterpret_cast<double*>(out);
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4) {
+            const __m256d first = _mm256_loadu_pd(in_data + (index * 2));
+            const __m256d second = _mm256_loadu_pd(in_data + (index * 2) + 4);
+            _mm256_storeu_pd(out_data + (index * 2), _mm256_mul_pd(_mm256_add_pd(first, shift), scale));
+            _mm256_storeu_pd(out_data + (index * 2) + 4, _mm256_mul_pd(_mm256_add_pd(second, shift), scale));
+        }
+        _transform_scalar(points + index, out + index, count - index, transform);
+    }
+
+    // Running min and max are only replaced when a point is strictly smaller (or bigger), and NaN
+    // coordinates are skipped, exactly as with the scalar comparisons
+    __attribute__((target("sse4.1")))
+    static std::pair<Point, Point> _bounding_box_sse41(const Point* points, size_t count) {
+        const double* data = reinterpret_cast<const double*>(points);
+        __m128d min = _mm_set1_pd(std::numeric_limits<double>().max());
+        __m128d max = _mm_set1_pd(std::numeric_limits<double>().lowest());
+        __m128d min_2 = min;
+        __m128d max_2 = max;
+        size_t index = 0;
+        for (; index + 2 <= count; index += 2) {
+            const __m128d first = _mm_loadu_pd(data + (index * 2));
+            const __m128d second = _mm_loadu_pd(data + (index * 2) + 2);
+            min = _mm_min_pd(first, min);
+            max = _mm_max_pd(first, max);
+            min_2 = _mm_min_pd(second, min_2);
+            max_2 = _mm_max_pd(second, max_2);
+        }
+        if (index < count) {
+            const __m128d last = _mm_loadu_pd(data + (index * 2));
+            min = _mm_min_pd(last, min);
+            max = _mm_max_pd(last, max);
+        }
+        min = _mm_min_pd(min_2, min);
+        max = _mm_max_pd(max_2, max);
+        std::pair<Point, Point> box;
+        _mm_storeu_pd(&box.first.x, min);
+        _mm_storeu_pd(&box.second.x, max);
+        return box;
+    }
+
+    __attribute__((target("avx2")))
+    static std::pair<Point, Point> _bounding_box_avx2(const Point* points, size_t count) {
+        const double* data = reinterpret_cast<const double*>(points);
+        __m256d min = _mm256_set1_pd(std::numeric_limits<double>().max());
+        __m256d max = _mm256_set1_pd(std::numeric_limits<double>().lowest());
+        __m256d min_2 = min;
+        __m256d max_2 = max;
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4) {
+            const __m256d first = _mm256_loadu_pd(data + (index * 2));
+            const __m256d second = _mm256_loadu_pd(data + (index * 2) + 4);
+            min = _mm256_min_pd(first, min);
+            max = _mm256_max_pd(first, max);
+            min_2 = _mm256_min_pd(second, min_2);
+            max_2 = _mm256_max_pd(second, max_2);
+        }
+        min = _mm256_min_pd(min_2, min);
+        max = _mm256_max_pd(max_2, max);
+        // Fold the two points held in each vector together, then finish off any remaining points
+        __m128d min_128 = _mm_min_pd(_mm256_extractf128_pd(min, 1), _mm256_castpd256_pd128(min));
+        __m128d max_128 = _mm_max_pd(_mm256_extractf128_pd(max, 1), _mm256_castpd256_pd128(max));
+        for (; index < count; index++) {
+            const __m128d point = _mm_loadu_pd(data + (index * 2));
+            min_128 = _mm_min_pd(point, min_128);
+            max_128 = _mm_max_pd(point, max_128);
+        }
+        std::pair<Point, Point> box;
+        _mm_storeu_pd(&box.first.x, min_128);
+        _mm_storeu_pd(&box.second.x, max_128);
+        return box;
+    }
+
+    // Crossings wider than an int end up as INT_MIN, just like the scalar conversion
+    __attribute__((target("sse4.1")))
+    static void _row_crossings_sse41(const double* ax, const double* ay, const double* dx, const double* dy,
+                                     size_t count, double y, int* x) {
+        const __m128d row = _mm_set1_pd(y);
+        size_t index = 0;
+        for (; index + 2 <= count; index += 2) {
+            const __m128d t = _mm_div_pd(_mm_sub_pd(row, _mm_loadu_pd(ay + index)), _mm_loadu_pd(dy + index));
+            const __m128d val = _mm_add_pd(_mm_loadu_pd(ax + index), _mm_mul_pd(t, _mm_loadu_pd(dx + index)));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(x + index), _mm_cvttpd_epi32(_round_sse41(val)));
+        }
+        _row_crossings_scalar(ax + index, ay + index, dx + index, dy + index, count - index, y, x + index);
+    }
+
+    __attribute__((target("avx2")))
+    static void _row_crossings_avx2(const double* ax, const double* ay, const double* dx, const double* dy,
+                                    size_t count, double y, int* x) {
+        const __m256d row = _mm256_set1_pd(y);
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4) {
+            const __m256d t = _mm256_div_pd(_mm256_sub_pd(row, _mm256_loadu_pd(ay + index)), _mm256_loadu_pd(dy + index));
+            const __m256d val = _mm256_add_pd(_mm256_loadu_pd(ax + index), _mm256_mul_pd(t, _mm256_loadu_pd(dx + index)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(x + index), _mm256_cvttpd_epi32(_round_avx2(val)));
+        }
+        _row_crossings_scalar(ax + index, ay + index, dx + index, dy + index, count - index, y, x + index);
+    }
+#endif
+
+public:
+    // Best instruction set supported by this processor
+    static Level get_level() { return _level(); }
+
+    // Limit the kernels to an instruction set. Used to check the versions against each other.
+    // Levels the processor doesn't support are ignored
+    static void set_level(Level level) {
+        if (level <= _detect()) _level() = level;
+    }
+
+    // out[i] = transform.apply(points[i]). points and out may be the same buffer
+    static void transform(const Point* points, Point* out, size_t count, const Transform& transform) {
+        Stats::add(Stats::kVerticesTransformed, count);
+#ifdef MAP_GEN_SIMD_X86
+        if (_level() == kAvx2) return _transform_avx2(points, out, count, transform);
+        if (_level() == kSse41) return _transform_sse41(points, out, count, transform);
+#endif
+        _transform_scalar(points, out, count, transform);
+    }
+
+    // Smallest and largest x and y of the points
+    static std::pair<Point, Point> bounding_box(const Point* points, size_t count) {
+#ifdef MAP_GEN_SIMD_X86
+        if (_level() == kAvx2) return _bounding_box_avx2(points, count);
+        if (_level() == kSse41) return _bounding_box_sse41(points, count);
+#endif
+        return _bounding_box_scalar(points, count);
+    }
+
+    // x[i] = round(ax[i] + (((y - ay[i]) / dy[i]) * dx[i])), the x where an edge from (ax, ay),
+    // with deltas (dx, dy) to its other end, crosses row y
+    static void row_crossings(const double* ax, const double* ay, const double* dx, const double* dy,
+                              size_t count, double y, int* x) {
+#ifdef MAP_GEN_SIMD_X86
+        if (_level() == kAvx2) return _row_crossings_avx2(ax, ay, dx, dy, count, y, x);
+        if (_level() == kSse41) return _row_crossings_sse41(ax, ay, dx, dy, count, y, x);
+#endif
+        _row_crossings_scalar(ax, ay, dx, dy, count, y, x);
+    }
+};
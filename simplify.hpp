@@ -0,0 +1,365 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>    // min, max
+#include <cmath>        // sqrt, pow
+#include <limits>       // numeric_limits
+#include <thread>
+#include <atomic>
+#include "point.hpp"
+#include "polygon.hpp"
+#include "stats.hpp"
+
+// Douglas-Peucker simplification of polygons, and levels of detail built from it.
+//
+// A simplified polygon keeps its original bounding box, so culling and the "less than 1px"
+// checks in Image::draw_polygon make the same decisions whichever level is drawn.
+// A simplified polygon is only used if every ring still has at least 3 distinct points,
+// keeps its orientation, and no two edges of any of its rings cross. Otherwise the
+// polygon falls back to the next finer level.
+class Simplify {
+
+private:
+
+    static inline double _distance_squared_to_segment(const Point& p, const Point& a, const Point& b) {
+        const double dx = b.x - a.x;
+        const double dy = b.y - a.y;
+        const double length_squared = (dx * dx) + (dy * dy);
+        double t = (length_squared > 0.0) ? (((p.x - a.x) * dx) + ((p.y - a.y) * dy)) / length_squared : 0.0;
+        t = std::max(0.0, std::min(1.0, t));
+        const double x = a.x + (t * dx) - p.x;
+        const double y = a.y + (t * dy) - p.y;
+        return (x * x) + (y * y);
+    }
+
+    // Set the significance of the points between first and last: the squared distance at which
+    // Douglas-Peucker would stop keeping them. A point is never more significant than the point
+    // that split its range, so the points kept for any tolerance are exactly those whose
+    // significance is over the tolerance squared
+    static void _rank(const std::vector<Point>& points, size_t first, size_t last,
+                      double parent_significance, std::vector<double>& significance) {
+        struct Range {
+            size_t start;
+            size_t stop;
+            double significance;
+        };
+        // Use a stack rather than recursion, as rings can have millions of points
+        std::vector<Range> stack;
+        stack.push_back({first, last, parent_significance});
+        while (!stack.empty()) {
+            const Range range = stack.back();
+            stack.pop_back();
+            if ((range.stop - range.start) < 2) continue;
+            double max_distance = -1.0;
+            size_t furthest = range.start;
+            for (size_t index = range.start + 1; index < range.stop; index++) {
+                double distance = _distance_squared_to_segment(points[index], points[range.start], points[range.stop]);
+                if (distance > max_distance) {
+                    max_distance = distance;
+                    furthest = index;
+                }
+            }
+            significance[furthest] = std::min(max_distance, range.significance);
+            stack.push_back({range.start, furthest, significance[furthest]});
+            stack.push_back({furthest, range.stop, significance[furthest]});
+        }
+    }
+
+    static double _signed_area(const Point* ring, size_t count) {
+        double area = 0.0;
+        for (size_t index = 1; index < count; index++) {
+            area += (ring[index - 1].x * ring[index].y) - (ring[index].x * ring[index - 1].y);
+        }
+        return area / 2.0;
+    }
+
+    static inline double _cross(const Point& o, const Point& a, const Point& b) {
+        return ((a.x - o.x) * (b.y - o.y)) - ((a.y - o.y) * (b.x - o.x));
+    }
+
+    static inline bool _on_segment(const Point& p, const Point& a, const Point& b) {
+        return std::min(a.x, b.x) <= p.x && p.x <= std::max(a.x, b.x) &&
+               std::min(a.y, b.y) <= p.y && p.y <= std::max(a.y, b.y);
+    }
+
+    static bool _segments_intersect(const Point& a, const Point& b, const Point& c, const Point& d) {
+        const double d1 = _cross(c, d, a);
+        const double d2 = _cross(c, d, b);
+        const double d3 = _cross(a, b, c);
+        const double d4 = _cross(a, b, d);
+        if (((d1 > 0 && d2 < 0) || (d1 < 0 && d2 > 0)) && ((d3 > 0 && d4 < 0) || (d3 < 0 && d4 > 0))) {
+            return true;
+        }
+        return (d1 == 0 && _on_segment(a, c, d)) || (d2 == 0 && _on_segment(b, c, d)) ||
+               (d3 == 0 && _on_segment(c, a, b)) || (d4 == 0 && _on_segment(d, a, b));
+    }
+
+    // Check if any two edges of the rings touch, other than neighbouring edges of the same ring.
+    // Edges are bucketed into a grid so only edges that are close together are compared
+    static bool _rings_intersect(const std::vector<const std::vector<Point>*>& rings) {
+        struct Edge {
+            unsigned int ring;
+            unsigned int index;
+        };
+        std::vector<Edge> edges;
+        Point min({std::numeric_limits<double>().max(), std::numeric_limits<double>().max()});
+        Point max({std::numeric_limits<double>().lowest(), std::numeric_limits<double>().lowest()});
+        for (unsigned int ring = 0; ring < rings.size(); ring++) {
+            const std::vector<Point>& points = *rings[ring];
+            for (unsigned int index = 0; index + 1 < points.size(); index++) {
+                edges.push_back({ring, index});
+            }
+            std::pair<Point, Point> box = Polygon::get_bounding_box(points.begin(), points.end());
+            min.x = std::min(min.x, box.first.x);
+            min.y = std::min(min.y, box.first.y);
+            max.x = std::max(max.x, box.second.x);
+            max.y = std::max(max.y, box.second.y);
+        }
+
+        const size_t grid_size = std::max<size_t>(1, std::sqrt(static_cast<double>(edges.size())));
+        const double cell_width = std::max((max.x - min.x) / grid_size, std::numeric_limits<double>().min());
+        const double cell_height = std::max((max.y - min.y) / grid_size, std::numeric_limits<double>().min());
+        auto cell_x = [&](double x) { return std::min<size_t>(grid_size - 1, (x - min.x) / cell_width); };
+        auto cell_y = [&](double y) { return std::min<size_t>(grid_size - 1, (y - min.y) / cell_height); };
+
+        std::vector<std::vector<unsigned int>> cells(grid_size * grid_size);
+        for (unsigned int edge = 0; edge < edges.size(); edge++) {
+            const Point& a = (*rings[edges[edge].ring])[edges[edge].index];
+            const Point& b = (*rings[edges[edge].ring])[edges[edge].index + 1];
+            for (size_t y = cell_y(std::min(a.y, b.y)); y <= cell_y(std::max(a.y, b.y)); y++) {
+                for (size_t x = cell_x(std::min(a.x, b.x)); x <= cell_x(std::max(a.x, b.x)); x++) {
+                    cells[(y * grid_size) + x].push_back(edge);
+                }
+            }
+        }
+
+        for (const auto& cell : cells) {
+            for (size_t i = 0; i < cell.size(); i++) {
+                const Edge& edge_i = edges[cell[i]];
+                const std::vector<Point>& ring_i = *rings[edge_i.ring];
+                for (size_t j = i + 1; j < cell.size(); j++) {
+                    const Edge& edge_j = edges[cell[j]];
+                    if (edge_i.ring == edge_j.ring) {
+                        // Neighbouring edges always share a point, including the
+                        // first and last edges which meet where the ring closes
+                        const unsigned int last_edge = ring_i.size() - 2;
+                        const unsigned int low = std::min(edge_i.index, edge_j.index);
+                        const unsigned int high = std::max(edge_i.index, edge_j.index);
+                        if ((high - low) == 1 || (low == 0 && high == last_edge)) continue;
+                    }
+                    const std::vector<Point>& ring_j = *rings[edge_j.ring];
+                    if (_segments_intersect(ring_i[edge_i.index], ring_i[edge_i.index + 1],
+                                            ring_j[edge_j.index], ring_j[edge_j.index + 1])) {
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+public:
+
+    // Rank the points of a closed ring (first point equal to the last) for simplification.
+    // Ranking is the expensive part, and only needs doing once for any number of tolerances
+    static void rank(const std::vector<Point>& points, std::vector<double>& significance) {
+        const double kAlwaysKeep = std::numeric_limits<double>().infinity();
+        significance.assign(points.size(), kAlwaysKeep);
+        if (points.size() < 4) return;
+        // The ring starts and ends on the same point, so split it at the
+        // point furthest from the start, and simplify both halves
+        const size_t last = points.size() - 1;
+        size_t furthest = 1;
+        double max_distance = -1.0;
+        for (size_t index = 1; index < last; index++) {
+            const double dx = points[index].x - points[0].x;
+            const double dy = points[index].y - points[0].y;
+            if (((dx * dx) + (dy * dy)) > max_distance) {
+                max_distance = (dx * dx) + (dy * dy);
+                furthest = index;
+            }
+        }
+        _rank(points, 0, furthest, kAlwaysKeep, significance);
+        _rank(points, furthest, last, kAlwaysKeep, significance);
+    }
+
+    // Simplify a ring of count points ranked by rank() so that no point of the original is more
+    // than tolerance away from the simplified ring.
+    // Returns false if the simplified ring would have fewer than 3 distinct points,
+    // or would change orientation
+    static bool ring(const Point* points, const double* significance, size_t count,
+                     double tolerance, std::vector<Point>& simplified) {
+        simplified.clear();
+        if (count < 4) return false;
+        const double tolerance_squared = tolerance * tolerance;
+        for (size_t index = 0; index < count; index++) {
+            if (significance[index] > tolerance_squared) simplified.push_back(points[index]);
+        }
+        if (simplified.size() < 4) return false;
+        const double area = _signed_area(simplified.data(), simplified.size());
+        const double original_area = _signed_area(points, count);
+        return (area > 0.0 && original_area > 0.0) || (area < 0.0 && original_area < 0.0);
+    }
+
+    static bool ring(const std::vector<Point>& points, const std::vector<double>& significance,
+                     double tolerance, std::vector<Point>& simplified) {
+        return ring(points.data(), significance.data(), points.size(), tolerance, simplified);
+    }
+
+    static bool ring(const std::vector<Point>& points, double tolerance, std::vector<Point>& simplified) {
+        std::vector<double> significance;
+        rank(points, significance);
+        return ring(points, significance, tolerance, simplified);
+    }
+
+    // Rank every ring of a polygon, outer ring first
+    static void rank(const Polygon& original, std::vector<std::vector<double>>& significances) {
+        significances.resize(original.inner.size() + 1);
+        rank(original.outer, significances[0]);
+        for (size_t index = 0; index < original.inner.size(); index++) {
+            rank(original.inner[index], significances[index + 1]);
+        }
+    }
+
+    // Simplify every ring of a polygon ranked by rank(). Holes that collapse are dropped, as
+    // they are smaller than the tolerance. Returns false if the result is not a valid polygon
+    static bool polygon(const Polygon& original, const std::vector<std::vector<double>>& significances,
+                        double tolerance, Polygon& simplified) {
+        simplified.bounding_box = original.bounding_box;
+        simplified.inner.clear();
+        if (!ring(original.outer, significances[0], tolerance, simplified.outer)) return false;
+        std::vector<const std::vector<Point>*> rings = {&simplified.outer};
+        simplified.inner.reserve(original.inner.size());
+        for (size_t index = 0; index < original.inner.size(); index++) {
+            std::vector<Point> simplified_inner;
+            if (ring(original.inner[index], significances[index + 1], tolerance, simplified_inner)) {
+                simplified.inner.push_back(std::move(simplified_inner));
+            }
+        }
+        for (const auto& inner : simplified.inner) {
+            rings.push_back(&inner);
+        }
+        return !_rings_intersect(rings);
+    }
+
+    static bool polygon(const Polygon& original, double tolerance, Polygon& simplified) {
+        std::vector<std::vector<double>> significances;
+        rank(original, significances);
+        return polygon(original, significances, tolerance, simplified);
+    }
+};
+
+// A list of polygons along with progressively simpler copies of it.
+// Every level has the same polygons, in the same order, with the same bounding boxes,
+// so a spatial index built from the original list works for all of them
+class LevelsOfDetail {
+
+private:
+
+    // Tolerance of the finest level, in map units, and the step between levels.
+    // Covers half a pixel from a 36000 px wide world map down to a 280 px wide one
+    static constexpr double kFinestTolerance = 0.005;
+    static const unsigned int kNumberLevels = 8;
+    static const unsigned int kLevelStep = 2;
+
+    const std::vector<Polygon>& original;
+    // A level only holds a polygon where simplifying it is valid and drops points from the next
+    // finer level. Elsewhere the polygon is left empty, and the finer level is used in its place
+    std::vector<std::vector<Polygon>> levels;
+
+    static size_t _count_points(const Polygon& polygon) {
+        size_t count = polygon.outer.size();
+        for (const auto& inner : polygon.inner) {
+            count += inner.size();
+        }
+        return count;
+    }
+
+public:
+    // Level of the polygons as they are, finer than any simplified level
+    static const int kOriginalLevel = -1;
+
+    // Simplify every polygon at every level, spreading the polygons across num_threads
+    LevelsOfDetail(const std::vector<Polygon>& polygons, unsigned int num_threads) :
+        original(polygons), levels(kNumberLevels) {
+
+        for (auto& level : levels) {
+            level.resize(polygons.size());
+        }
+        std::atomic<size_t> next_polygon(0);
+        auto simplify_polygons = [&]() {
+            size_t index;
+            std::vector<std::vector<double>> significances;
+            Polygon simplified;
+            while ((index = next_polygon++) < polygons.size()) {
+                Stats::Timer timer(Stats::kSimplify);
+                // Every level is simplified from the original so its error stays within its tolerance.
+                // A coarser level only ever keeps fewer points, so one with as many points as the
+                // finer level is the same polygon
+                Simplify::rank(polygons[index], significances);
+                size_t finer_points = _count_points(polygons[index]);
+                for (unsigned int level = 0; level < kNumberLevels; level++) {
+                    if (Simplify::polygon(polygons[index], significances, get_tolerance(level), simplified) &&
+                        _count_points(simplified) < finer_points) {
+                        finer_points = _count_points(simplified);
+                        levels[level][index] = std::move(simplified);
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < num_threads; i++) {
+            threads.emplace_back(simplify_polygons);
+        }
+        simplify_polygons();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    static double get_tolerance(unsigned int level) {
+        return kFinestTolerance * std::pow(static_cast<double>(kLevelStep), level);
+    }
+
+    // The coarsest level whose error is under half of pixel_size,
+    // or kOriginalLevel if even the finest level is too coarse
+    static int get_level_for_pixel_size(double pixel_size) {
+        int level = kOriginalLevel;
+        while ((level + 1) < static_cast<int>(kNumberLevels) && get_tolerance(level + 1) <= (pixel_size / 2.0)) {
+            level++;
+        }
+        return level;
+    }
+
+    // Rank a polygon, and find the levels it can be simplified to, as a mask with bit n set if level n is valid
+    static uint64_t get_valid_levels(const Polygon& polygon, std::vector<std::vector<double>>& significances) {
+        Simplify::rank(polygon, significances);
+        uint64_t valid_levels = 0;
+        Polygon simplified;
+        for (unsigned int level = 0; level < kNumberLevels; level++) {
+            if (Simplify::polygon(polygon, significances, get_tolerance(level), simplified)) {
+                valid_levels |= static_cast<uint64_t>(1) << level;
+            }
+        }
+        return valid_levels;
+    }
+
+    // The coarsest level no coarser than level that is set in a mask from get_valid_levels(),
+    // or kOriginalLevel if there isn't one
+    static int get_valid_level(uint64_t valid_levels, int level) {
+        while (level > kOriginalLevel && (valid_levels & (static_cast<uint64_t>(1) << level)) == 0) {
+            level--;
+        }
+        return level;
+    }
+
+    // A polygon at the given level, which is the finer level's polygon wherever that level is empty
+    const Polygon& get_polygon(size_t polygon_index, int level) const {
+        for (; level > kOriginalLevel; level--) {
+            const Polygon& polygon = levels[level][polygon_index];
+            if (!polygon.outer.empty()) return polygon;
+        }
+        return original[polygon_index];
+    }
+};
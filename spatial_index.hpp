@@ -0,0 +1,144 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>    // sort
+#include <cmath>        // ceil, sqrt
+#include <cstdint>
+#include "point.hpp"
+#include "polygon.hpp"
+
+// Static R-tree over bounding boxes, packed using Sort-Tile-Recursive (STR).
+// Built once from a list of polygons (or boxes), then queried for every
+// item whose bounding box intersects a given region.
+class SpatialIndex {
+
+private:
+
+    // Maximum number of children per node
+    static const unsigned int kNodeSize = 16;
+
+    struct Node {
+        std::pair<Point, Point> bounding_box;
+        // For leaf entries, the index of the item.
+        // Otherwise, the first child in the level below
+        uint32_t first;
+        uint32_t count;
+    };
+
+    // levels[0] holds one entry per item, levels.back() holds the root
+    std::vector<std::vector<Node>> levels;
+
+    static inline Point _centre(const Node& node) {
+        return {(node.bounding_box.first.x + node.bounding_box.second.x) / 2.0,
+                (node.bounding_box.first.y + node.bounding_box.second.y) / 2.0};
+    }
+
+    static inline bool _intersects(const std::pair<Point, Point>& box, const Point& min, const Point& max) {
+        return !(box.second.x < min.x || box.second.y < min.y || box.first.x > max.x || box.first.y > max.y);
+    }
+
+    // Sort nodes into vertical slices by x, and each slice by y, so that
+    // each run of kNodeSize nodes covers a small, roughly square area
+    static void _sort_tile(std::vector<Node>& nodes) {
+        const size_t number_parents = (nodes.size() + kNodeSize - 1) / kNodeSize;
+        const size_t number_slices = std::ceil(std::sqrt(static_cast<double>(number_parents)));
+        const size_t slice_size = number_slices * kNodeSize;
+
+        std::sort(nodes.begin(), nodes.end(),
+                  [](const Node& a, const Node& b) { return _centre(a).x < _centre(b).x; });
+        for (size_t start = 0; start < nodes.size(); start += slice_size) {
+            const size_t stop = std::min(start + slice_size, nodes.size());
+            std::sort(nodes.begin() + start, nodes.begin() + stop,
+                      [](const Node& a, const Node& b) { return _centre(a).y < _centre(b).y; });
+        }
+    }
+
+    // Group each run of kNodeSize nodes under a parent node
+    static std::vector<Node> _pack(const std::vector<Node>& nodes) {
+        std::vector<Node> parents;
+        parents.reserve((nodes.size() + kNodeSize - 1) / kNodeSize);
+        for (size_t start = 0; start < nodes.size(); start += kNodeSize) {
+            const size_t stop = std::min<size_t>(start + kNodeSize, nodes.size());
+            std::pair<Point, Point> box = nodes[start].bounding_box;
+            for (size_t index = start + 1; index < stop; index++) {
+                box.first.x = std::min(box.first.x, nodes[index].bounding_box.first.x);
+                box.first.y = std::min(box.first.y, nodes[index].bounding_box.first.y);
+                box.second.x = std::max(box.second.x, nodes[index].bounding_box.second.x);
+                box.second.y = std::max(box.second.y, nodes[index].bounding_box.second.y);
+            }
+            parents.push_back({box, static_cast<uint32_t>(start), static_cast<uint32_t>(stop - start)});
+        }
+        return parents;
+    }
+
+public:
+    SpatialIndex() {  }
+    SpatialIndex(const std::vector<Polygon>& polygons) { build(polygons); }
+    SpatialIndex(const std::vector<std::pair<Point, Point>>& boxes) { build(boxes); }
+
+    void build(const std::vector<Polygon>& polygons) {
+        std::vector<std::pair<Point, Point>> boxes;
+        boxes.reserve(polygons.size());
+        for (const auto& polygon : polygons) {
+            boxes.push_back(polygon.bounding_box);
+        }
+        build(boxes);
+    }
+
+    void build(const std::vector<std::pair<Point, Point>>& boxes) {
+        levels.clear();
+        if (boxes.empty()) return;
+
+        std::vector<Node> entries;
+        entries.reserve(boxes.size());
+        for (size_t index = 0; index < boxes.size(); index++) {
+            entries.push_back({boxes[index], static_cast<uint32_t>(index), 0});
+        }
+        levels.push_back(std::move(entries));
+
+        // Keep packing levels until there is a single root node
+        while (levels.back().size() > 1) {
+            _sort_tile(levels.back());
+            std::vector<Node> parents = _pack(levels.back());
+            levels.push_back(std::move(parents));
+        }
+    }
+
+    size_t size() const { return levels.empty() ? 0 : levels[0].size(); }
+
+    // Call visit(index) for every item whose bounding box intersects the region min to max.
+    // Items are visited in tree order, not index order
+    template <class Visitor>
+    void visit(const Point& min, const Point& max, Visitor visit) const {
+        if (levels.empty()) return;
+
+        if (!_intersects(levels.back()[0].bounding_box, min, max)) return;
+
+        // Stack of (level, node) still to be checked, whose boxes are already known to intersect.
+        // Items are 32 bit, so there are never more than 9 levels with up to kNodeSize entries each
+        std::pair<uint32_t, uint32_t> stack[kNodeSize * 9];
+        size_t stack_size = 0;
+        stack[stack_size++] = {static_cast<uint32_t>(levels.size() - 1), 0};
+        while (stack_size > 0) {
+            const uint32_t level = stack[stack_size - 1].first;
+            const Node& node = levels[level][stack[stack_size - 1].second];
+            stack_size--;
+            if (level == 0) {
+                visit(static_cast<size_t>(node.first));
+            } else {
+                const std::vector<Node>& children = levels[level - 1];
+                for (uint32_t child = node.first; child < (node.first + node.count); child++) {
+                    if (_intersects(children[child].bounding_box, min, max)) stack[stack_size++] = {level - 1, child};
+                }
+            }
+        }
+    }
+
+    // Get the index of every item whose bounding box intersects the region min to max.
+    // Results are sorted, so items can be drawn in their original order
+    void query(const Point& min, const Point& max, std::vector<size_t>& results) const {
+        results.clear();
+        visit(min, max, [&results](size_t index) { results.push_back(index); });
+        std::sort(results.begin(), results.end());
+    }
+};
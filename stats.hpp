@@ -0,0 +1,179 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <time.h>           // clock_gettime
+#include <sys/resource.h>   // getrusage
+
+// Optional timings and counters for each stage of drawing a map, reported as JSON.
+//
+// Everything is off until enable() is called, and while it is off, counting or timing
+// is a single check of a flag. Counts are kept per thread and added to the totals as
+// each thread finishes, so threads drawing their own bands never share a counter.
+// Stage times are summed over every thread that ran the stage, so with several threads
+// a stage can take longer than the whole run
+class Stats {
+
+public:
+    enum Stage {
+        kRead = 0,          // Opening and checking the shapefile or cache
+        kDecode,            // Decoding records into polygons
+        kCull,              // Finding the polygons within the viewport
+        kSimplify,
+        kTransform,         // Shifting and scaling polygons to pixels
+        kClip,              // Dropping the points of polygons that can't be seen
+        kFill,
+        kBorder,
+        kEncode,            // Writing the image file
+        kNumberStages
+    };
+
+    enum Counter {
+        kRecordsDecoded = 0,
+        kRingsDecoded,
+        kVerticesTransformed,
+        kPolygonsCulled,        // Polygons draw_polygon skipped as outside the image or too small
+        kPointsClipped,         // Points dropped from polygons as outside the image
+        kEdgesScanned,          // Edges looked at to find row crossings
+        kPixelsFilled,
+        kLinePixels,            // Pixels drawn for borders
+        kBytesWritten,
+        kNumberCounters
+    };
+
+private:
+    struct Totals {
+        std::atomic<uint64_t> counters[kNumberCounters];
+        std::atomic<uint64_t> wall_ns[kNumberStages];
+        std::atomic<uint64_t> cpu_ns[kNumberStages];
+    };
+
+    // Counts for the current thread, added to the totals when the thread exits
+    struct Local {
+        uint64_t counters[kNumberCounters] = {};
+        uint64_t wall_ns[kNumberStages] = {};
+        uint64_t cpu_ns[kNumberStages] = {};
+
+        void flush() {
+            for (unsigned int counter = 0; counter < kNumberCounters; counter++) {
+                _totals().counters[counter] += counters[counter];
+                counters[counter] = 0;
+            }
+            for (unsigned int stage = 0; stage < kNumberStages; stage++) {
+                _totals().wall_ns[stage] += wall_ns[stage];
+                _totals().cpu_ns[stage] += cpu_ns[stage];
+                wall_ns[stage] = 0;
+                cpu_ns[stage] = 0;
+            }
+        }
+
+        ~Local() { flush(); }
+    };
+
+    static bool& _enabled() {
+        static bool enabled = false;
+        return enabled;
+    }
+
+    static Totals& _totals() {
+        static Totals totals;
+        return totals;
+    }
+
+    static Local& _local() {
+        static thread_local Local local;
+        return local;
+    }
+
+    static std::chrono::steady_clock::time_point& _start() {
+        static std::chrono::steady_clock::time_point start;
+        return start;
+    }
+
+    static uint64_t _thread_cpu_ns() {
+        timespec time;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+        return (static_cast<uint64_t>(time.tv_sec) * 1000000000ULL) + time.tv_nsec;
+    }
+
+    static uint64_t _wall_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    // Times a stage from construction until it goes out of scope
+    class Timer {
+    private:
+        Stage stage;
+        bool running;
+        uint64_t wall_start;
+        uint64_t cpu_start;
+
+    public:
+        explicit Timer(Stage timer_stage) : stage(timer_stage), running(enabled()), wall_start(0), cpu_start(0) {
+            if (!running) return;
+            wall_start = _wall_ns();
+            cpu_start = _thread_cpu_ns();
+        }
+
+        ~Timer() {
+            if (!running) return;
+            Local& local = _local();
+            local.wall_ns[stage] += _wall_ns() - wall_start;
+            local.cpu_ns[stage] += _thread_cpu_ns() - cpu_start;
+        }
+    };
+
+    // Start collecting. Must be called before any threads are started
+    static void enable() {
+        _enabled() = true;
+        _start() = std::chrono::steady_clock::now();
+    }
+
+    static inline bool enabled() {
+        return _enabled();
+    }
+
+    static inline void add(Counter counter, uint64_t count) {
+        if (enabled()) _local().counters[counter] += count;
+    }
+
+    // Write every stage and counter as JSON. Counts from threads that are still running are not included
+    static void write_json(std::ostream& out) {
+        static const char* stage_names[kNumberStages] = {
+            "read", "decode", "cull", "simplify", "transform", "clip", "fill", "border", "encode"};
+        static const char* counter_names[kNumberCounters] = {
+            "records_decoded", "rings_decoded", "vertices_transformed", "polygons_culled",
+            "points_clipped", "edges_scanned", "pixels_filled", "line_pixels", "bytes_written"};
+
+        _local().flush();
+        const double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - _start()).count();
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        const double cpu_ms = (usage.ru_utime.tv_sec * 1000.0) + (usage.ru_utime.tv_usec / 1000.0) +
+                              (usage.ru_stime.tv_sec * 1000.0) + (usage.ru_stime.tv_usec / 1000.0);
+
+        out << "{\n";
+        out << "  \"wall_ms\": " << wall_ms << ",\n";
+        out << "  \"cpu_ms\": " << cpu_ms << ",\n";
+        // ru_maxrss is in kilobytes on Linux
+        out << "  \"peak_rss_kb\": " << usage.ru_maxrss << ",\n";
+        out << "  \"stages\": {\n";
+        for (unsigned int stage = 0; stage < kNumberStages; stage++) {
+            out << "    \"" << stage_names[stage] << "\": {\"wall_ms\": " << (_totals().wall_ns[stage] / 1e6)
+                << ", \"cpu_ms\": " << (_totals().cpu_ns[stage] / 1e6) << "}"
+                << ((stage + 1 < kNumberStages) ? "," : "") << "\n";
+        }
+        out << "  },\n";
+        out << "  \"counters\": {\n";
+        for (unsigned int counter = 0; counter < kNumberCounters; counter++) {
+            out << "    \"" << counter_names[counter] << "\": " << _totals().counters[counter]
+                << ((counter + 1 < kNumberCounters) ? "," : "") << "\n";
+        }
+        out << "  }\n";
+        out << "}" << std::endl;
+    }
+};
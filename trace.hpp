@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <ostream>
+#include <iomanip>     // setprecision
+
+// Optional timeline of what each thread was doing, written in the Chrome trace event format
+// so it can be opened in chrome://tracing or Perfetto.
+//
+// Like Stats, everything is off until enable() is called, and while it is off a scope is a
+// single check of a flag. Each thread keeps its own list of events, which is handed over
+// when the thread exits, so threads never wait on each other to record an event
+class Trace {
+
+private:
+    struct Event {
+        const char* name;       // Must be a string literal, as only the pointer is kept
+        const char* arg_name;   // Optional number to show with the event, or nullptr
+        uint64_t arg;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+    };
+
+    struct Thread {
+        uint32_t id;
+        std::vector<Event> events;
+    };
+
+    struct Shared {
+        std::mutex mutex;
+        std::vector<Thread> threads;
+        std::atomic<uint32_t> next_thread_id;
+    };
+
+    // Events for the current thread, handed over when the thread exits
+    struct Local {
+        Thread thread;
+
+        Local() {
+            thread.id = _shared().next_thread_id++;
+        }
+
+        void flush() {
+            if (thread.events.empty()) return;
+            std::lock_guard<std::mutex> lock(_shared().mutex);
+            _shared().threads.push_back(std::move(thread));
+            thread.events.clear();
+        }
+
+        ~Local() { flush(); }
+    };
+
+    static bool& _enabled() {
+        static bool enabled = false;
+        return enabled;
+    }
+
+    static Shared& _shared() {
+        static Shared shared;
+        return shared;
+    }
+
+    static Local& _local() {
+        static thread_local Local local;
+        return local;
+    }
+
+    static uint64_t& _start() {
+        static uint64_t start = 0;
+        return start;
+    }
+
+    static uint64_t _now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    // Records an event from construction until it goes out of scope
+    class Scope {
+    private:
+        bool running;
+        Event event;
+
+    public:
+        explicit Scope(const char* name, const char* arg_name = nullptr, uint64_t arg = 0) : running(enabled()) {
+            if (!running) return;
+            event = {name, arg_name, arg, _now_ns(), 0};
+        }
+
+        ~Scope() {
+            if (!running) return;
+            event.duration_ns = _now_ns() - event.start_ns;
+            _local().thread.events.push_back(event);
+        }
+    };
+
+    // Start recording. Must be called before any threads are started
+    static void enable() {
+        _enabled() = true;
+        _start() = _now_ns();
+    }
+
+    static inline bool enabled() {
+        return _enabled();
+    }
+
+    // Write every event as a JSON trace, with times in microseconds from enable().
+    // Events from threads that are still running are not included
+    static void write_json(std::ostream& out) {
+        _local().flush();
+        std::lock_guard<std::mutex> lock(_shared().mutex);
+        const std::ios::fmtflags flags = out.flags();
+        const std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(3);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        for (const auto& thread : _shared().threads) {
+            for (const auto& event : thread.events) {
+                out << (first ? "" : ",\n");
+                out << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << thread.id
+                    << ", \"ts\": " << ((event.start_ns - _start()) / 1e3) << ", \"dur\": " << (event.duration_ns / 1e3);
+                if (event.arg_name != nullptr) {
+                    out << ", \"args\": {\"" << event.arg_name << "\": " << event.arg << "}";
+                }
+                out << "}";
+                first = false;
+            }
+        }
+        out << "\n]}" << std::endl;
+        out.flags(flags);
+        out.precision(precision);
+    }
+};